@@ -28,17 +28,123 @@
 #include <iostream>
 
 #include <core/app-template.hh>
+#include <core/distributed.hh>
 #include <core/reactor.hh>
 
 #include "crimson.h"
+#include "msg/inbound_budget.h"
+#include "osd/server.h"
+#include "osd/store.h"
+#include "osd/write_stages.h"
 
 using namespace crimson;
 
+namespace bpo = boost::program_options;
+
 int main(int argc, char** argv) {
   seastar::app_template crimson;
-  crimson.run(argc, argv, [] {
-      std::cout << "It's fun to charter an accountant\n"
-		<< "And sail the wide accountant sea!" << std::endl;
-      return make_ready_future<>();
+  crimson.add_options()
+    ("address", bpo::value<std::string>()->default_value("0.0.0.0"),
+     "Address to listen on")
+    ("port", bpo::value<uint16_t>()->default_value(6800),
+     "Port to listen on")
+    ("shm-path", bpo::value<std::string>()->default_value(""),
+     "Also accept shared memory connections from local clients. Each core "
+     "listens on a unix socket at this path with its core id appended, and "
+     "takes each client's rings as a sealed memfd over it")
+    ("log-dir", bpo::value<std::string>()->default_value(""),
+     "Directory to keep each core's object log in. Objects are kept in "
+     "memory only if this is empty. The logs only open with the core count "
+     "they were created with")
+    ("log-size", bpo::value<uint64_t>()->default_value(1024),
+     "MiB of log to preallocate for each core")
+    ("read-cache", bpo::value<size_t>()->default_value(256),
+     "MiB of each core's log to cache for reads")
+    ("inbound-memory", bpo::value<size_t>()->default_value(
+        net::InboundBudget::default_limit >> 20),
+     "MiB per core for messages read from clients. Reads stall while it's "
+     "exhausted")
+    ("qos-concurrency", bpo::value<size_t>()->default_value(0),
+     "Schedule requests with dmClock, running at most this many at once "
+     "per core. 0 disables scheduling")
+    ("qos-reservation", bpo::value<double>()->default_value(0),
+     "Ops per second reserved for each client, per core")
+    ("qos-weight", bpo::value<double>()->default_value(1),
+     "Weight of each client")
+    ("qos-limit", bpo::value<double>()->default_value(0),
+     "Most ops per second for each client, per core, or 0 for no limit")
+    ("pre-apply-delay", bpo::value<std::string>()->default_value("none"),
+     "Delay injected before each write is applied: none, fixed:<us>, "
+     "uniform:<min_us>:<max_us>, exp:<mean_us> or queue:<us>[:<servers>]")
+    ("post-apply-delay", bpo::value<std::string>()->default_value("none"),
+     "Delay injected after each write is applied, in the same form")
+    ("commit-delay", bpo::value<std::string>()->default_value("none"),
+     "Delay before each write is committed, in the same form");
+
+  seastar::distributed<osd::Store> store;
+  seastar::distributed<osd::Server> server;
+
+  return crimson.run(argc, argv, [&] {
+      auto& config = crimson.configuration();
+      auto address = seastar::make_ipv4_address({
+          config["address"].as<std::string>(),
+          config["port"].as<uint16_t>()});
+      const auto shm_path = config["shm-path"].as<std::string>();
+      osd::StoreConfig store_config;
+      store_config.log_dir = config["log-dir"].as<std::string>();
+      store_config.log_size = config["log-size"].as<uint64_t>() << 20;
+      store_config.cache_size = config["read-cache"].as<size_t>() << 20;
+      auto inbound_memory = config["inbound-memory"].as<size_t>() << 20;
+      auto qos_concurrency = config["qos-concurrency"].as<size_t>();
+      osd::ClientInfo qos;
+      qos.reservation = config["qos-reservation"].as<double>();
+      qos.weight = config["qos-weight"].as<double>();
+      qos.limit = config["qos-limit"].as<double>();
+      auto pre_apply = config["pre-apply-delay"].as<std::string>();
+      auto post_apply = config["post-apply-delay"].as<std::string>();
+      auto commit = config["commit-delay"].as<std::string>();
+      // reject a bad spec before starting anything
+      osd::DelayModel::parse(pre_apply);
+      osd::DelayModel::parse(post_apply);
+      osd::DelayModel::parse(commit);
+
+      engine().at_exit([&] {
+          return server.stop().then([&] { return store.stop(); });
+        });
+
+      // every core listens on the same address, and serves the objects it
+      // owns from its share of the store
+      return store.start(store_config).then([&] {
+          return store.invoke_on_all(&osd::Store::open);
+        }).then([&, qos_concurrency, qos] {
+          return server.start(std::ref(store), qos_concurrency, qos);
+        }).then([&, inbound_memory] {
+          return server.invoke_on_all([inbound_memory] (osd::Server&) {
+              net::InboundBudget::local().set_limit(inbound_memory);
+            });
+        }).then([&, pre_apply, post_apply, commit] {
+          return server.invoke_on_all(
+            [pre_apply, post_apply, commit] (osd::Server&) {
+              osd::WriteStages::local().set_delays(
+                  osd::DelayModel::parse(pre_apply),
+                  osd::DelayModel::parse(post_apply),
+                  osd::DelayModel::parse(commit));
+            });
+        }).then([&, address] {
+          return server.invoke_on_all(&osd::Server::listen, address);
+        }).then([&, shm_path] {
+          if (shm_path.empty())
+            return now();
+          return server.invoke_on_all([shm_path] (osd::Server& s) {
+              auto path = shm_path + "." + std::to_string(engine().cpu_id());
+              return s.listen_shm(string(path.data(), path.size()));
+            });
+        }).then([&] {
+          auto& config = crimson.configuration();
+          std::cout << "crimson listening on "
+                    << config["address"].as<std::string>() << ':'
+                    << config["port"].as<uint16_t>()
+                    << " with " << smp::count << " cores" << std::endl;
+        });
     });
 }
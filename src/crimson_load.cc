@@ -0,0 +1,534 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+/// \file crimson_load.cc
+/// \brief Closed-loop load generator for a crimson server
+///
+/// Every core opens its own connections to the server and keeps a fixed
+/// number of osd_read and osd_write calls in flight on each. Core 0 reports
+/// IOPS, bandwidth and latency percentiles for each interval, and for the
+/// whole run at the end.
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <boost/range/irange.hpp>
+#include <capnp/message.h>
+#include <core/app-template.hh>
+#include <core/distributed.hh>
+#include <core/future-util.hh>
+#include <core/reactor.hh>
+#include <core/sleep.hh>
+
+#include "crimson.h"
+#include "crimson.capnp.h"
+#include "histogram.h"
+#include "msg/message_pool.h"
+#include "msg/rpc_client.h"
+#include "msg/shm_messenger.h"
+#include "msg/socket_messenger.h"
+
+using namespace crimson;
+using namespace crimson::net;
+
+namespace bpo = boost::program_options;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct LoadConfig {
+  std::string server;
+  uint16_t port;
+  std::string shm_path; //< connect over shared memory instead, unless empty
+  unsigned connections; //< per core
+  unsigned depth; //< calls in flight per connection
+  double read_ratio;
+  uint64_t objects;
+  uint64_t object_size; //< smallest object size
+  uint64_t object_size_max; //< largest object size
+  uint64_t op_size; //< bytes per op, or 0 for whole objects
+  bool random_offsets;
+  double zipf_theta; //< skew of object popularity, or 0 for uniform
+  uint64_t chunk_size; //< stream ops larger than this, unless 0
+};
+
+/// Return the bytes of data in a read reply, whether the OSD sent them
+/// whole or as extents
+uint64_t data_size(proto::osd::read::Res::Reader res)
+{
+  uint64_t bytes = res.getData().size();
+  for (auto extent : res.getExtents())
+    bytes += extent.size();
+  return bytes;
+}
+
+/// Counters and latency histograms for a set of ops
+struct OpStats {
+  uint64_t reads{0};
+  uint64_t writes{0};
+  uint64_t errors{0};
+  uint64_t read_bytes{0};
+  uint64_t write_bytes{0};
+  Histogram read_latency; //< microseconds
+  Histogram write_latency; //< microseconds
+
+  void merge(const OpStats& rhs) {
+    reads += rhs.reads;
+    writes += rhs.writes;
+    errors += rhs.errors;
+    read_bytes += rhs.read_bytes;
+    write_bytes += rhs.write_bytes;
+    read_latency.merge(rhs.read_latency);
+    write_latency.merge(rhs.write_latency);
+  }
+};
+
+/// Zipfian distribution over [0, n), using the method from Gray et al.,
+/// "Quickly Generating Billion-Record Synthetic Databases". Rank 0 is the
+/// most popular.
+class ZipfDistribution {
+  uint64_t n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+  std::uniform_real_distribution<double> uniform{0.0, 1.0};
+
+  static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++)
+      sum += 1.0 / std::pow(i, theta);
+    return sum;
+  }
+
+ public:
+  ZipfDistribution(uint64_t n, double theta)
+    : n(n), theta(theta), alpha(1.0 / (1.0 - theta)), zetan(zeta(n, theta)),
+      eta((1.0 - std::pow(2.0 / n, 1.0 - theta)) /
+          (1.0 - zeta(2, theta) / zetan))
+  {}
+
+  template <typename RNG>
+  uint64_t operator()(RNG& rng) {
+    const double u = uniform(rng);
+    const double uz = u * zetan;
+    if (uz < 1.0)
+      return 0;
+    if (uz < 1.0 + std::pow(0.5, theta))
+      return 1;
+    auto rank = static_cast<uint64_t>(n * std::pow(eta * u - eta + 1.0, alpha));
+    return std::min(rank, n - 1);
+  }
+};
+
+/// Generates load from a single core
+class LoadGenerator {
+  LoadConfig cfg;
+  std::mt19937_64 rng;
+  std::unique_ptr<ZipfDistribution> zipf;
+  std::uniform_int_distribution<uint64_t> uniform_object;
+  std::uniform_real_distribution<double> uniform_op{0.0, 1.0};
+  temporary_buffer payload; //< write data, shared by all writes
+  std::vector<lw_shared_ptr<RpcClient>> clients;
+  OpStats interval; //< since the last report
+  OpStats total;
+
+  uint64_t pick_object() {
+    return zipf ? (*zipf)(rng) : uniform_object(rng);
+  }
+
+  /// Each object's size is a fixed function of its id, so that every core
+  /// agrees on it
+  uint64_t object_size(uint64_t id) const {
+    const auto range = cfg.object_size_max - cfg.object_size;
+    if (range == 0)
+      return cfg.object_size;
+    auto h = id * 0x9e3779b97f4a7c15ull; // fibonacci hashing
+    return cfg.object_size + (h >> 16) % (range + 1);
+  }
+
+  Connection::MessageBuilderPtr make_read(uint64_t id, uint64_t offset,
+                                          uint64_t length) {
+    auto message = make_message();
+    auto args = message->initRoot<proto::Message>().initOsdRead();
+    args.setObject(("obj." + seastar::to_sstring(id)).c_str());
+    args.setOffset(offset);
+    args.setLength(length);
+    return std::move(message);
+  }
+
+  Connection::MessageBuilderPtr make_write(uint64_t id, uint64_t offset,
+                                           uint64_t length) {
+    auto message = make_message(length < 4096 ? length + 128 : 0);
+    auto args = message->initRoot<proto::Message>().initOsdWrite();
+    args.setObject(("obj." + seastar::to_sstring(id)).c_str());
+    args.setOffset(offset);
+    args.setLength(length);
+    if (length < 4096) {
+      args.setData(capnp::Data::Reader(
+              reinterpret_cast<const capnp::byte*>(payload.get()), length));
+    } else {
+      // reference the payload in place rather than copying it
+      args.adoptData(message->reference_data(
+              temporary_buffer(payload.get_write(), length, seastar::deleter())));
+    }
+    return std::move(message);
+  }
+
+  struct OpResult {
+    bool failed;
+    uint64_t bytes;
+  };
+
+  /// Read, streaming the data back in chunks if it's larger than one
+  future<OpResult> do_read(RpcClient& client, uint64_t id, uint64_t offset,
+                           uint64_t length) {
+    auto message = make_read(id, offset, length);
+    if (!cfg.chunk_size || length <= cfg.chunk_size) {
+      return client.call(std::move(message)).then(
+        [] (Connection::MessageReaderPtr&& reply) {
+          auto root = reply->getRoot<proto::Message>();
+          if (!root.isOsdReadReply())
+            return OpResult{true, 0};
+          auto res = root.getOsdReadReply();
+          return OpResult{res.getErrorCode() != 0, data_size(res)};
+        });
+    }
+    message->getRoot<proto::Message>().getOsdRead().setChunkSize(cfg.chunk_size);
+    auto result = make_lw_shared<OpResult>(OpResult{false, 0});
+    return client.call_streamed(std::move(message),
+      [result] (Connection::MessageReaderPtr&& reply) {
+        auto root = reply->getRoot<proto::Message>();
+        if (!root.isOsdReadReply()) {
+          result->failed = true;
+          return seastar::stop_iteration::yes;
+        }
+        auto res = root.getOsdReadReply();
+        if (res.getErrorCode())
+          result->failed = true;
+        result->bytes += data_size(res);
+        return res.getMore() ? seastar::stop_iteration::no
+                             : seastar::stop_iteration::yes;
+      }).then([result] {
+        return *result;
+      });
+  }
+
+  /// Write, sending the data in chunks if it's larger than one
+  future<OpResult> do_write(RpcClient& client, uint64_t id, uint64_t offset,
+                            uint64_t length) {
+    auto reply = [length] (Connection::MessageReaderPtr&& reply) {
+      auto root = reply->getRoot<proto::Message>();
+      if (!root.isOsdWriteReply())
+        return OpResult{true, length};
+      auto res = root.getOsdWriteReply();
+      return OpResult{res.isErrorCode(), length};
+    };
+    if (!cfg.chunk_size || length <= cfg.chunk_size)
+      return client.call(make_write(id, offset, length)).then(reply);
+
+    auto pos = make_lw_shared<uint64_t>(0);
+    return client.call_chunked(
+      [this, id, offset, length, pos] () -> Connection::MessageBuilderPtr {
+        if (*pos == length)
+          return nullptr;
+        auto n = std::min(cfg.chunk_size, length - *pos);
+        auto message = make_write(id, offset + *pos, n);
+        *pos += n;
+        message->getRoot<proto::Message>().getOsdWrite().setMore(*pos < length);
+        return message;
+      }).then(reply);
+  }
+
+  /// Issue one op and record its result
+  future<> do_op(RpcClient& client) {
+    const auto id = pick_object();
+    const auto size = object_size(id);
+    const auto length = cfg.op_size ? std::min(cfg.op_size, size) : size;
+    uint64_t offset = 0;
+    if (cfg.random_offsets && size > length) {
+      // align offsets to the op size
+      auto slots = (size - length) / length + 1;
+      offset = (rng() % slots) * length;
+    }
+    const bool read = uniform_op(rng) < cfg.read_ratio;
+    auto start = clock_type::now();
+    auto op = read ? do_read(client, id, offset, length)
+                   : do_write(client, id, offset, length);
+    return op.then([this, read, start] (OpResult result) {
+        auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+            clock_type::now() - start).count();
+        for (auto stats : {&interval, &total}) {
+          if (result.failed)
+            stats->errors++;
+          if (read) {
+            stats->reads++;
+            stats->read_bytes += result.bytes;
+            stats->read_latency.add(usec);
+          } else {
+            stats->writes++;
+            stats->write_bytes += result.bytes;
+            stats->write_latency.add(usec);
+          }
+        }
+      });
+  }
+
+ public:
+  LoadGenerator(LoadConfig cfg)
+    : cfg(cfg),
+      rng(engine().cpu_id() + 1),
+      uniform_object(0, cfg.objects - 1),
+      payload(temporary_buffer::aligned(sizeof(capnp::word),
+          std::max(cfg.object_size_max, cfg.op_size) + sizeof(capnp::word)))
+  {
+    if (cfg.zipf_theta > 0)
+      zipf = std::make_unique<ZipfDistribution>(cfg.objects, cfg.zipf_theta);
+    std::fill(payload.get_write(), payload.get_write() + payload.size(), 'x');
+  }
+
+  /// Open this core's connections to the server
+  future<> connect() {
+    if (!cfg.shm_path.empty()) {
+      // each core connects to the server's core with the same id
+      const auto path = cfg.shm_path + "." +
+          std::to_string(engine().cpu_id());
+      auto range = boost::irange(0u, cfg.connections);
+      return do_for_each(range.begin(), range.end(),
+        [this, path] (unsigned) {
+          return ShmConnection::connect(string(path.data(), path.size())).then(
+            [this] (shared_ptr<Connection> conn) {
+              clients.push_back(make_lw_shared<RpcClient>(conn));
+            });
+        });
+    }
+    auto addr = seastar::make_ipv4_address({cfg.server, cfg.port});
+    auto range = boost::irange(0u, cfg.connections);
+    return do_for_each(range.begin(), range.end(),
+      [this, addr] (unsigned) {
+        return engine().connect(addr).then(
+          [this, addr] (connected_socket fd) {
+            auto conn = make_shared<SocketConnection>(std::move(fd), addr);
+            conn->set_cork(true);
+            clients.push_back(make_lw_shared<RpcClient>(conn));
+          });
+      });
+  }
+
+  /// Write every object whose id maps to this core, so reads find them
+  future<> prefill() {
+    auto next = make_lw_shared<uint64_t>(engine().cpu_id());
+    auto workers = boost::irange(0u, cfg.depth);
+    return seastar::parallel_for_each(workers.begin(), workers.end(),
+      [this, next] (unsigned) {
+        return seastar::do_until([this, next] { return *next >= cfg.objects; },
+          [this, next] {
+            auto id = *next;
+            *next += smp::count;
+            auto size = object_size(id);
+            return clients.front()->call(make_write(id, 0, size)).discard_result();
+          });
+      });
+  }
+
+  /// Keep depth ops in flight on every connection until \a end
+  future<> run(clock_type::time_point end) {
+    return seastar::parallel_for_each(clients.begin(), clients.end(),
+      [this, end] (lw_shared_ptr<RpcClient> client) {
+        auto workers = boost::irange(0u, cfg.depth);
+        return seastar::parallel_for_each(workers.begin(), workers.end(),
+          [this, end, client] (unsigned) {
+            return seastar::do_until([end] { return clock_type::now() >= end; },
+              [this, client] { return do_op(*client); });
+          });
+      });
+  }
+
+  /// Return the stats since the last call, and reset them
+  OpStats take_interval() {
+    auto stats = std::move(interval);
+    interval = OpStats{};
+    return stats;
+  }
+
+  OpStats get_total() const { return total; }
+
+  future<> stop() {
+    return seastar::parallel_for_each(clients.begin(), clients.end(),
+      [] (lw_shared_ptr<RpcClient> client) {
+        return client->close().handle_exception([] (auto eptr) {});
+      });
+  }
+};
+
+/// Gather stats from every core
+future<OpStats> collect(seastar::distributed<LoadGenerator>& gen,
+                        bool interval)
+{
+  auto stats = make_lw_shared<OpStats>();
+  auto cpus = boost::irange(0u, smp::count);
+  return seastar::parallel_for_each(cpus.begin(), cpus.end(),
+    [&gen, stats, interval] (unsigned cpu) {
+      return gen.invoke_on(cpu, [interval] (LoadGenerator& g) {
+          return interval ? g.take_interval() : g.get_total();
+        }).then([stats] (OpStats s) {
+          stats->merge(s);
+        });
+    }).then([stats] {
+      return std::move(*stats);
+    });
+}
+
+void report(std::ostream& out, const char* label, const OpStats& s,
+            double secs)
+{
+  auto mib = (s.read_bytes + s.write_bytes) / secs / (1024 * 1024);
+  out << std::fixed << std::setprecision(1)
+      << label
+      << " read_iops=" << s.reads / secs
+      << " write_iops=" << s.writes / secs
+      << " MiB/s=" << mib
+      << " errors=" << s.errors
+      << " read_us(p50/p99/p999)=" << s.read_latency.percentile(50)
+      << '/' << s.read_latency.percentile(99)
+      << '/' << s.read_latency.percentile(99.9)
+      << " write_us(p50/p99/p999)=" << s.write_latency.percentile(50)
+      << '/' << s.write_latency.percentile(99)
+      << '/' << s.write_latency.percentile(99.9)
+      << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+  seastar::app_template app;
+  app.add_options()
+    ("server", bpo::value<std::string>()->default_value("127.0.0.1"),
+     "Address of the crimson server")
+    ("port", bpo::value<uint16_t>()->default_value(6800),
+     "Port of the crimson server")
+    ("shm-path", bpo::value<std::string>()->default_value(""),
+     "Connect over shared memory to a server on this host that was given "
+     "the same --shm-path, instead of over TCP")
+    ("connections", bpo::value<unsigned>()->default_value(1),
+     "Connections per core")
+    ("depth", bpo::value<unsigned>()->default_value(16),
+     "Ops in flight per connection")
+    ("duration", bpo::value<unsigned>()->default_value(10),
+     "Seconds to run")
+    ("report-interval", bpo::value<unsigned>()->default_value(1),
+     "Seconds between reports, or 0 to only report the total")
+    ("read-ratio", bpo::value<double>()->default_value(0.7),
+     "Fraction of ops that are reads")
+    ("objects", bpo::value<uint64_t>()->default_value(10000),
+     "Number of objects")
+    ("object-size", bpo::value<uint64_t>()->default_value(4096),
+     "Object size, or the smallest object size with --object-size-max")
+    ("object-size-max", bpo::value<uint64_t>()->default_value(0),
+     "Largest object size; sizes are uniform between the two")
+    ("op-size", bpo::value<uint64_t>()->default_value(4096),
+     "Bytes per op, or 0 for whole objects")
+    ("random-offsets", bpo::value<bool>()->default_value(true),
+     "Use random op-aligned offsets within objects, instead of offset 0")
+    ("zipf", bpo::value<double>()->default_value(0),
+     "Zipfian skew of object popularity in (0, 1), or 0 for uniform")
+    ("chunk-size", bpo::value<uint64_t>()->default_value(0),
+     "Stream reads and writes larger than this in chunks, unless 0")
+    ("prefill", bpo::value<bool>()->default_value(true),
+     "Write every object before starting");
+
+  seastar::distributed<LoadGenerator> gen;
+
+  return app.run(argc, argv, [&] {
+      auto& config = app.configuration();
+      LoadConfig cfg;
+      cfg.server = config["server"].as<std::string>();
+      cfg.port = config["port"].as<uint16_t>();
+      cfg.shm_path = config["shm-path"].as<std::string>();
+      cfg.connections = config["connections"].as<unsigned>();
+      cfg.depth = config["depth"].as<unsigned>();
+      cfg.read_ratio = config["read-ratio"].as<double>();
+      cfg.objects = config["objects"].as<uint64_t>();
+      cfg.object_size = config["object-size"].as<uint64_t>();
+      cfg.object_size_max = std::max(cfg.object_size,
+          config["object-size-max"].as<uint64_t>());
+      cfg.op_size = config["op-size"].as<uint64_t>();
+      cfg.random_offsets = config["random-offsets"].as<bool>();
+      cfg.zipf_theta = config["zipf"].as<double>();
+      cfg.chunk_size = config["chunk-size"].as<uint64_t>();
+      if (cfg.objects == 0 || cfg.object_size == 0 || cfg.connections == 0 ||
+          cfg.depth == 0)
+        throw std::invalid_argument("objects, object-size, connections and "
+                                    "depth must be nonzero");
+      if (cfg.zipf_theta < 0 || cfg.zipf_theta >= 1)
+        throw std::invalid_argument("zipf must be in [0, 1)");
+
+      const bool prefill = config["prefill"].as<bool>();
+      const auto duration = std::chrono::seconds(
+          config["duration"].as<unsigned>());
+      const auto interval = std::chrono::seconds(
+          config["report-interval"].as<unsigned>());
+
+      return gen.start(cfg).then([&] {
+          return gen.invoke_on_all(&LoadGenerator::connect);
+        }).then([&, prefill] {
+          if (!prefill)
+            return now();
+          std::cout << "writing " << cfg.objects << " objects" << std::endl;
+          return gen.invoke_on_all(&LoadGenerator::prefill);
+        }).then([&, duration, interval] {
+          auto start = clock_type::now();
+          auto end = start + duration;
+          // report from core 0 while every core runs
+          auto reporter = interval.count() == 0 ? now() : seastar::do_until(
+            [end] { return clock_type::now() >= end; },
+            [&gen, interval, start] {
+              return seastar::sleep(interval).then([&gen] {
+                  return collect(gen, true);
+                }).then([interval, start] (OpStats stats) {
+                  auto t = std::chrono::duration_cast<std::chrono::seconds>(
+                      clock_type::now() - start).count();
+                  auto label = "t=" + std::to_string(t) + "s";
+                  report(std::cout, label.c_str(), stats,
+                         std::chrono::duration<double>(interval).count());
+                });
+            });
+          return gen.invoke_on_all(&LoadGenerator::run, end).then(
+            [start, reporter = std::move(reporter)] () mutable {
+              auto elapsed = clock_type::now() - start;
+              return reporter.then([elapsed] { return elapsed; });
+            });
+        }).then([&] (clock_type::duration elapsed) {
+          return collect(gen, false).then([elapsed] (OpStats stats) {
+              report(std::cout, "total", stats,
+                     std::chrono::duration<double>(elapsed).count());
+            });
+        }).finally([&] {
+          return gen.stop();
+        });
+    });
+}
@@ -0,0 +1,107 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+/// \file histogram.h
+/// \brief Log-linear histogram for latency percentiles
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+
+namespace crimson {
+
+/// A histogram of unsigned values with logarithmic buckets, each divided into
+/// 2^sub_bits linear sub-buckets. Values are recorded to within about 3%
+/// across the full 64-bit range, and adding one costs a few instructions.
+class Histogram {
+  static constexpr unsigned sub_bits = 5;
+  static constexpr uint64_t sub_count = 1ull << sub_bits;
+  static constexpr size_t nr_counts = (65 - sub_bits) << sub_bits;
+
+  std::array<uint64_t, nr_counts> counts{};
+  uint64_t total{0};
+  uint64_t sum{0};
+  uint64_t min_value{std::numeric_limits<uint64_t>::max()};
+  uint64_t max_value{0};
+
+  static size_t index_of(uint64_t value) {
+    if (value < sub_count)
+      return value;
+    const unsigned msb = 63 - __builtin_clzll(value);
+    const unsigned shift = msb - sub_bits;
+    return ((shift + 1) << sub_bits) + ((value >> shift) - sub_count);
+  }
+
+  /// Return the smallest value that falls in the given index
+  static uint64_t lowest_value(size_t index) {
+    if (index < sub_count)
+      return index;
+    const unsigned shift = (index >> sub_bits) - 1;
+    return (sub_count + (index & (sub_count - 1))) << shift;
+  }
+
+ public:
+  void add(uint64_t value) {
+    counts[index_of(value)]++;
+    total++;
+    sum += value;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+  }
+
+  void merge(const Histogram& other) {
+    for (size_t i = 0; i < nr_counts; i++)
+      counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+  }
+
+  void reset() { *this = Histogram{}; }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? min_value : 0; }
+  uint64_t max() const { return max_value; }
+  double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+
+  /// Return the value at the given percentile, in [0, 100]. The result is
+  /// the highest value of the sub-bucket it falls in, capped at max().
+  uint64_t percentile(double p) const {
+    if (total == 0)
+      return 0;
+    auto target = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+    target = std::max<uint64_t>(target, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < nr_counts; i++) {
+      seen += counts[i];
+      if (seen >= target)
+        return std::min(max_value, lowest_value(i + 1) - 1);
+    }
+    return max_value;
+  }
+};
+
+} // namespace crimson
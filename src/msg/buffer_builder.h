@@ -0,0 +1,60 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <vector>
+#include <capnp/message.h>
+#include <capnp/orphan.h>
+
+#include "crimson.h"
+
+namespace crimson {
+namespace net {
+
+/// A MallocMessageBuilder that can use externally owned buffers as Data
+/// fields without copying them. The builder holds a reference on each buffer,
+/// so they stay alive until the message is released by its Connection.
+class BufferMessageBuilder : public capnp::MallocMessageBuilder {
+  std::vector<temporary_buffer> buffers;
+
+ public:
+  using capnp::MallocMessageBuilder::MallocMessageBuilder;
+
+  /// Return a Data orphan that refers to the contents of \a buf in place, to
+  /// be adopted into a field of this message. Capnp can only reference
+  /// word-aligned data; buffers that aren't are copied instead. Up to 7 bytes
+  /// past the end of the buffer will be sent as padding, so they must be
+  /// readable.
+  capnp::Orphan<capnp::Data> reference_data(temporary_buffer&& buf)
+  {
+    capnp::Data::Reader data{reinterpret_cast<const capnp::byte*>(buf.get()),
+                             buf.size()};
+    auto orphanage = getOrphanage();
+    if (reinterpret_cast<uintptr_t>(buf.get()) % sizeof(capnp::word) != 0)
+      return orphanage.newOrphanCopy(data);
+    buffers.emplace_back(std::move(buf));
+    return orphanage.referenceExternalData(data);
+  }
+};
+
+} // namespace net
+} // namespace crimson
@@ -21,6 +21,7 @@
 // 02110-1301 USA
 
 #include <capnp/message.h>
+#include <core/gate.hh>
 #include <core/reactor.hh>
 
 #include "direct_messenger.h"
@@ -42,29 +43,45 @@ class MessageBuilderReader : public capnp::SegmentArrayMessageReader {
       message(std::move(builder)) {}
 };
 
+/// ForeignBuilderReader adapts a MessageBuilder from another core into a
+/// MessageReader. The builder is released back to its own core when the
+/// reader is destroyed.
+class ForeignBuilderReader : public capnp::SegmentArrayMessageReader {
+  CrossCoreConnection::ForeignBuilderPtr message;
+ public:
+  ForeignBuilderReader(CrossCoreConnection::ForeignBuilderPtr&& builder)
+    : SegmentArrayMessageReader((*builder).getSegmentsForOutput()),
+      message(std::move(builder)) {}
+};
+
 } // anonymous namespace
 
-void DirectConnection::handle_message(MessageBuilderPtr&& message)
+void DirectConnection::handle_message(MessageBuilderPtr&& message,
+                                      size_t bytes)
 {
   auto adapter = std::make_unique<MessageBuilderReader>(std::move(message));
   if (!reads_waiting_for_message.empty()) {
-    // use this message to fulfil the first promise from read_message()
+    // use this message to fulfil the first promise from read_message(), and
+    // return its credits right away
     reads_waiting_for_message.front().set_value(std::move(adapter));
     reads_waiting_for_message.pop_front();
+    message_credits.signal(1);
+    byte_credits.signal(bytes);
   } else {
-    // enqueue a promise for read_message()
-    messages_waiting_for_read.emplace_back();
-    messages_waiting_for_read.back().set_value(std::move(adapter));
+    // queue the message for read_message()
+    messages_waiting_for_read.push_back(QueuedMessage{std::move(adapter), bytes});
   }
 }
 
 future<Connection::MessageReaderPtr> DirectConnection::read_message()
 {
   if (!messages_waiting_for_read.empty()) {
-    // return an already-fulfilled promise from handle_message()
-    auto fut = messages_waiting_for_read.front().get_future();
+    // dequeue a message from handle_message() and return its credits
+    auto queued = std::move(messages_waiting_for_read.front());
     messages_waiting_for_read.pop_front();
-    return fut;
+    message_credits.signal(1);
+    byte_credits.signal(queued.bytes);
+    return make_ready_future<MessageReaderPtr>(std::move(queued.message));
   } else {
     // enqueue a promise for handle_message()
     reads_waiting_for_message.emplace_back();
@@ -74,8 +91,26 @@ future<Connection::MessageReaderPtr> DirectConnection::read_message()
 
 future<> DirectConnection::write_message(MessageBuilderPtr&& message)
 {
-  other->handle_message(std::move(message));
-  return now();
+  auto p = other;
+  if (!p)
+    return make_exception_future<>(std::runtime_error("connection closed"));
+
+  size_t bytes = 0;
+  for (auto segment : message->getSegmentsForOutput())
+    bytes += segment.size() * sizeof(capnp::word);
+  // clamp to the limit so that large messages can't wait forever
+  bytes = std::min(bytes, p->max_bytes);
+
+  // the semaphores are fifo, so messages are queued in the order written
+  return p->message_credits.wait(1).then([p, bytes] {
+      return p->byte_credits.wait(bytes).handle_exception(
+        [p] (auto eptr) {
+          p->message_credits.signal(1);
+          return make_exception_future<>(eptr);
+        });
+    }).then([p, bytes, message = std::move(message)] () mutable {
+      p->handle_message(std::move(message), bytes);
+    });
 }
 
 future<> DirectConnection::close()
@@ -88,10 +123,100 @@ future<> DirectConnection::close()
   reads_waiting_for_message.for_each([&e] (auto& p) { p.set_exception(e); });
   auto release_read = std::move(reads_waiting_for_message);
 
+  // fail the other endpoint's writes that are waiting for credits
+  message_credits.broken(e);
+  byte_credits.broken(e);
+
   auto destroy_unread = std::move(messages_waiting_for_read);
   return p->close();
 }
 
+void CrossCoreConnection::send_batch()
+{
+  sending = true;
+  auto batch = std::move(outgoing);
+  outgoing.clear();
+  seastar::with_gate(sends, [this, batch = std::move(batch)] () mutable {
+      return smp::submit_to(peer_cpu,
+        [p = peer, batch = std::move(batch)] () mutable {
+          p->handle_messages(std::move(batch));
+        });
+    }).then_wrapped([this] (auto f) {
+      f.ignore_ready_future();
+      if (!outgoing.empty() && !closed) {
+        // send the messages that were written during the hop
+        this->send_batch();
+      } else {
+        sending = false;
+      }
+    });
+}
+
+void CrossCoreConnection::handle_messages(std::vector<ForeignBuilderPtr>&& batch)
+{
+  if (closed)
+    return; // the foreign_ptrs release the messages on their own core
+
+  for (auto& message : batch) {
+    auto adapter = std::make_unique<ForeignBuilderReader>(std::move(message));
+    if (!reads_waiting_for_message.empty()) {
+      reads_waiting_for_message.front().set_value(std::move(adapter));
+      reads_waiting_for_message.pop_front();
+    } else {
+      messages_waiting_for_read.emplace_back();
+      messages_waiting_for_read.back().set_value(std::move(adapter));
+    }
+  }
+}
+
+future<Connection::MessageReaderPtr> CrossCoreConnection::read_message()
+{
+  if (!messages_waiting_for_read.empty()) {
+    auto fut = messages_waiting_for_read.front().get_future();
+    messages_waiting_for_read.pop_front();
+    return fut;
+  }
+  if (closed)
+    return make_exception_future<MessageReaderPtr>(
+        std::runtime_error("connection closed"));
+  reads_waiting_for_message.emplace_back();
+  return reads_waiting_for_message.back().get_future();
+}
+
+future<> CrossCoreConnection::write_message(MessageBuilderPtr&& message)
+{
+  if (closed || !peer)
+    return make_exception_future<>(std::runtime_error("connection closed"));
+  outgoing.emplace_back(seastar::make_foreign(std::move(message)));
+  if (!sending)
+    send_batch();
+  return now();
+}
+
+future<> CrossCoreConnection::close()
+{
+  if (closed)
+    return now();
+  closed = true;
+
+  auto e = std::runtime_error{"connection closed"};
+  reads_waiting_for_message.for_each([&e] (auto& p) { p.set_exception(e); });
+  auto release_read = std::move(reads_waiting_for_message);
+  auto destroy_unread = std::move(messages_waiting_for_read);
+  auto destroy_unsent = std::move(outgoing);
+
+  // wait for the hop in flight, then close the other endpoint
+  return sends.close().then([this] {
+      auto p = peer;
+      peer = nullptr;
+      if (!p)
+        return now();
+      // hold our reference to the other endpoint until it has closed
+      return smp::submit_to(peer_cpu, [p] { return p->close(); }).finally(
+        [ref = std::move(peer_ref)] {});
+    });
+}
+
 
 DirectListener::DirectListener()
   : accepting(false)
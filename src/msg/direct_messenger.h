@@ -22,41 +22,72 @@
 #pragma once
 
 #include "messenger.h"
+#include <vector>
 #include <core/circular_buffer.hh>
+#include <core/gate.hh>
+#include <core/reactor.hh>
+#include <core/semaphore.hh>
 #include <core/shared_ptr.hh>
 
 namespace crimson {
 namespace net {
 
 /// A Connection that reads and writes directly to another Connection pointer.
+///
+/// Each endpoint grants its writer credits for a bounded number of queued
+/// messages and bytes. write_message() waits for credits from the other
+/// endpoint, and they are returned as read_message() dequeues the messages.
 class DirectConnection : public Connection {
+ public:
+  static constexpr size_t default_max_messages = 1024;
+  static constexpr size_t default_max_bytes = 64 << 20;
+
+ private:
   shared_ptr<DirectConnection> other; //< other endpoint of the connection
   seastar::circular_buffer<promise<MessageReaderPtr>> reads_waiting_for_message;
-  seastar::circular_buffer<promise<MessageReaderPtr>> messages_waiting_for_read;
+
+  /// a message that was received before anyone asked to read it
+  struct QueuedMessage {
+    MessageReaderPtr message;
+    size_t bytes; //< byte credits held by the message
+  };
+  seastar::circular_buffer<QueuedMessage> messages_waiting_for_read;
+
+  size_t max_bytes; //< largest number of byte credits a message can take
+  semaphore message_credits; //< messages that may still be queued
+  semaphore byte_credits; //< bytes that may still be queued
 
   /// connect to another endpoint
   void connect(shared_ptr<DirectConnection> conn) { other = conn; }
 
-  /// receive a message from the other endpoint
-  void handle_message(MessageBuilderPtr&& message);
+  /// receive a message from the other endpoint, which holds \a bytes of
+  /// this endpoint's byte credits
+  void handle_message(MessageBuilderPtr&& message, size_t bytes);
 
   // constructor is hidden for make_pair()
-  DirectConnection() = default;
+  DirectConnection(size_t max_messages, size_t max_bytes)
+    : max_bytes(max_bytes), message_credits(max_messages),
+      byte_credits(max_bytes)
+  {}
 
  public:
   /// Read a message from the \a other connection.
   future<MessageReaderPtr> read_message() override;
 
-  /// Write a message to the \a other connection.
+  /// Write a message to the \a other connection. The returned future
+  /// resolves once the other connection has room to queue it.
   future<> write_message(MessageBuilderPtr&& message) override;
 
   /// Close the connection.
   future<> close() override;
 
-  /// Return a connected pair.
-  static auto make_pair()
+  /// Return a connected pair. Each endpoint queues at most \a max_messages
+  /// unread messages and \a max_bytes unread bytes. A message larger than
+  /// \a max_bytes is queued only once the queue is empty of bytes.
+  static auto make_pair(size_t max_messages = default_max_messages,
+                        size_t max_bytes = default_max_bytes)
   {
-    DirectConnection c;
+    DirectConnection c(max_messages, max_bytes);
     auto a = make_shared<DirectConnection>(std::move(c));
     auto b = make_shared<DirectConnection>(std::move(c));
     a->connect(b);
@@ -65,6 +96,77 @@ class DirectConnection : public Connection {
   }
 };
 
+/// A Connection between endpoints on different cores. Messages are handed to
+/// the other core as foreign_ptrs without copying their segments, and the
+/// messages written while a hop is in flight go over together in the next.
+class CrossCoreConnection : public Connection {
+ public:
+  using ForeignBuilderPtr = seastar::foreign_ptr<MessageBuilderPtr>;
+
+ private:
+  unsigned peer_cpu; //< the core that the other endpoint lives on
+  CrossCoreConnection* peer{nullptr}; //< only dereferenced on peer_cpu
+  seastar::foreign_ptr<shared_ptr<CrossCoreConnection>> peer_ref;
+  bool closed{false};
+
+  std::vector<ForeignBuilderPtr> outgoing; //< messages for the next hop
+  bool sending{false}; //< a hop is in flight
+  seastar::gate sends; //< close() waits for the hop in flight
+
+  seastar::circular_buffer<promise<MessageReaderPtr>> reads_waiting_for_message;
+  seastar::circular_buffer<promise<MessageReaderPtr>> messages_waiting_for_read;
+
+  /// attach to the other endpoint
+  void attach(CrossCoreConnection* conn,
+              seastar::foreign_ptr<shared_ptr<CrossCoreConnection>>&& ref) {
+    peer = conn;
+    peer_ref = std::move(ref);
+  }
+
+  /// send the outgoing messages to the other core in a single hop
+  void send_batch();
+
+  /// receive a batch of messages from the other endpoint
+  void handle_messages(std::vector<ForeignBuilderPtr>&& batch);
+
+ public:
+  /// Construct an unattached endpoint; use connect() instead.
+  explicit CrossCoreConnection(unsigned peer_cpu) : peer_cpu(peer_cpu) {}
+
+  /// Read a message from the other endpoint.
+  future<MessageReaderPtr> read_message() override;
+
+  /// Queue a message for the other endpoint. It goes out with the next
+  /// cross-core hop.
+  future<> write_message(MessageBuilderPtr&& message) override;
+
+  /// Close both endpoints.
+  future<> close() override;
+
+  /// Create a connected pair with one endpoint on this core and the other
+  /// on \a cpu. \a func is called on \a cpu with the remote endpoint, and the
+  /// returned future resolves with the local endpoint.
+  template <typename Func>
+  static future<shared_ptr<Connection>> connect(unsigned cpu, Func func)
+  {
+    auto local = make_shared<CrossCoreConnection>(cpu);
+    auto local_ptr = local.get();
+    auto local_cpu = engine().cpu_id();
+    return smp::submit_to(cpu,
+      [local_cpu, local_ptr, local_ref = seastar::make_foreign(local),
+       func = std::move(func)] () mutable {
+        auto remote = make_shared<CrossCoreConnection>(local_cpu);
+        remote->attach(local_ptr, std::move(local_ref));
+        func(remote);
+        return seastar::make_foreign(remote);
+      }).then([local] (auto remote_ref) {
+        auto remote_ptr = &*remote_ref;
+        local->attach(remote_ptr, std::move(remote_ref));
+        return shared_ptr<Connection>(local);
+      });
+  }
+};
+
 /// A Listener that enables clients within the process to initiate a
 /// DirectConnection.
 class DirectListener : public Listener {
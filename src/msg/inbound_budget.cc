@@ -0,0 +1,71 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "inbound_budget.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace crimson;
+using namespace crimson::net;
+
+future<seastar::deleter> InboundBudget::charge(size_t bytes)
+{
+  if (bytes > limit)
+    return make_exception_future<seastar::deleter>(
+        std::invalid_argument("charge exceeds the inbound budget"));
+  return available.wait(bytes).then([this, bytes] {
+      return seastar::make_deleter([this, bytes] { release(bytes); });
+    });
+}
+
+void InboundBudget::release(size_t bytes)
+{
+  // withhold what's owed from a lowered limit
+  auto owed = std::min(bytes, deficit);
+  deficit -= owed;
+  available.signal(bytes - owed);
+}
+
+void InboundBudget::set_limit(size_t bytes)
+{
+  if (bytes >= limit) {
+    auto n = bytes - limit;
+    auto owed = std::min(n, deficit);
+    deficit -= owed;
+    available.signal(n - owed);
+  } else {
+    deficit += limit - bytes;
+    // take what we can right away, unless that would jump the queue
+    auto n = std::min(deficit, available.current());
+    if (n && available.waiters() == 0) {
+      available.wait(n); // ready immediately
+      deficit -= n;
+    }
+  }
+  limit = bytes;
+}
+
+InboundBudget& InboundBudget::local()
+{
+  static thread_local InboundBudget budget;
+  return budget;
+}
@@ -0,0 +1,73 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <core/deleter.hh>
+#include <core/semaphore.hh>
+
+#include "crimson.h"
+
+namespace crimson {
+namespace net {
+
+/// A per-core memory budget for the messages read from sockets. Each frame
+/// is charged for its size as soon as its header is parsed, before its
+/// segments are read, and the charge is released with the message. While
+/// the budget is exhausted, reads from the sockets stall and their peers
+/// see TCP backpressure.
+class InboundBudget {
+ public:
+  static constexpr size_t default_limit = 256 << 20;
+
+ private:
+  size_t limit;
+  size_t deficit{0}; //< units to withhold after the limit was lowered
+  seastar::semaphore available;
+
+ public:
+  explicit InboundBudget(size_t limit = default_limit)
+    : limit(limit), available(limit) {}
+
+  /// Wait until \a bytes are available and take them. A charge larger than
+  /// the limit could never be admitted, so it fails with
+  /// std::invalid_argument, and callers should reject such frames first.
+  /// The returned deleter releases the charge, and must be destroyed on
+  /// this core.
+  future<seastar::deleter> charge(size_t bytes);
+
+  /// Return bytes to the budget
+  void release(size_t bytes);
+
+  /// Change the limit. Lowering it takes effect as charges are released.
+  void set_limit(size_t bytes);
+
+  size_t get_limit() const { return limit; }
+
+  /// Return the bytes that can be charged without waiting
+  size_t get_available() const { return available.current(); }
+
+  /// Return this core's budget
+  static InboundBudget& local();
+};
+
+} // namespace net
+} // namespace crimson
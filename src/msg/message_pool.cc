@@ -0,0 +1,69 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "message_pool.h"
+
+using namespace crimson;
+using namespace crimson::net;
+
+constexpr size_t MessagePool::class_words[];
+constexpr size_t MessagePool::max_free[];
+
+MessagePool::~MessagePool()
+{
+  for (auto& segments : free)
+    for (auto segment : segments)
+      delete[] segment;
+}
+
+size_t MessagePool::size_class(size_t bytes)
+{
+  for (size_t cls = 0; cls < nr_classes - 1; cls++)
+    if (bytes <= class_words[cls] * sizeof(capnp::word))
+      return cls;
+  return nr_classes - 1;
+}
+
+capnp::word* MessagePool::allocate(size_t cls)
+{
+  auto& segments = free[cls];
+  if (segments.empty())
+    return new capnp::word[class_words[cls]](); // zeroed
+  auto segment = segments.back();
+  segments.pop_back();
+  return segment;
+}
+
+void MessagePool::release(size_t cls, capnp::word* segment)
+{
+  auto& segments = free[cls];
+  if (segments.size() < max_free[cls])
+    segments.push_back(segment);
+  else
+    delete[] segment;
+}
+
+MessagePool& MessagePool::local()
+{
+  static thread_local MessagePool pool;
+  return pool;
+}
@@ -0,0 +1,103 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <array>
+#include <vector>
+#include <capnp/message.h>
+
+#include "buffer_builder.h"
+
+namespace crimson {
+namespace net {
+
+/// A per-core pool of zeroed first segments for message builders, in a few
+/// size classes. Segments are recycled when their builder is destroyed, so
+/// building a message that fits in its first segment doesn't allocate.
+class MessagePool {
+ public:
+  /// first segment sizes in words, from 1KiB to 64KiB
+  static constexpr size_t nr_classes = 3;
+  static constexpr size_t class_words[nr_classes] = {128, 1024, 8192};
+  /// how many free segments to keep per class
+  static constexpr size_t max_free[nr_classes] = {1024, 256, 32};
+
+ private:
+  std::array<std::vector<capnp::word*>, nr_classes> free;
+
+ public:
+  ~MessagePool();
+
+  /// Return the smallest size class that holds \a bytes, or the largest
+  static size_t size_class(size_t bytes);
+
+  /// Take a zeroed segment of the given size class
+  capnp::word* allocate(size_t cls);
+
+  /// Return a segment whose contents have been zeroed
+  void release(size_t cls, capnp::word* segment);
+
+  /// Return this core's pool
+  static MessagePool& local();
+};
+
+namespace detail {
+
+/// Owns the first segment of a PooledMessageBuilder. It's a base class so
+/// that the segment is taken before and returned after the MessageBuilder's
+/// lifetime, because ~MallocMessageBuilder() zeroes the segment.
+class PooledSegment {
+ protected:
+  size_t size_class;
+  capnp::word* segment;
+
+  PooledSegment(size_t bytes)
+    : size_class(MessagePool::size_class(bytes)),
+      segment(MessagePool::local().allocate(size_class)) {}
+
+  ~PooledSegment() { MessagePool::local().release(size_class, segment); }
+
+  kj::ArrayPtr<capnp::word> first_segment() const {
+    return {segment, MessagePool::class_words[size_class]};
+  }
+};
+
+} // namespace detail
+
+/// A BufferMessageBuilder whose first segment comes from the MessagePool
+class PooledMessageBuilder : private detail::PooledSegment,
+                             public BufferMessageBuilder {
+ public:
+  /// Build a message that is expected to take about \a bytes
+  explicit PooledMessageBuilder(size_t bytes = 0)
+    : PooledSegment(bytes),
+      BufferMessageBuilder(first_segment()) {}
+};
+
+/// Return a pooled message builder sized for about \a bytes of content
+inline std::unique_ptr<PooledMessageBuilder> make_message(size_t bytes = 0)
+{
+  return std::make_unique<PooledMessageBuilder>(bytes);
+}
+
+} // namespace net
+} // namespace crimson
@@ -0,0 +1,155 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "rpc_client.h"
+#include "crimson.capnp.h"
+#include <capnp/message.h>
+#include <core/future-util.hh>
+
+using namespace crimson;
+using namespace crimson::net;
+
+RpcClient::RpcClient(shared_ptr<Connection> conn)
+  : conn(conn),
+    reader_done(read_replies())
+{}
+
+future<> RpcClient::read_replies()
+{
+  return seastar::repeat([this] {
+      return conn->read_message().then(
+        [this] (MessageReaderPtr&& reader) {
+          auto sequence = reader->getRoot<proto::Message>()
+              .getHeader().getSequence();
+          auto i = pending.find(sequence);
+          if (i == pending.end())
+            return seastar::stop_iteration::no;
+          auto& call = i->second;
+          if (call.on_reply) {
+            // pass a streamed reply along, and finish the call after the last
+            try {
+              if (call.on_reply(std::move(reader)) == seastar::stop_iteration::no)
+                return seastar::stop_iteration::no;
+              call.reply.set_value(MessageReaderPtr());
+            } catch (...) {
+              call.reply.set_exception(std::current_exception());
+            }
+            pending.erase(i);
+            return seastar::stop_iteration::no;
+          }
+          auto p = std::move(call.reply);
+          pending.erase(i);
+          p.set_value(std::move(reader));
+          return seastar::stop_iteration::no;
+        });
+    }).handle_exception([this] (auto eptr) {
+      this->failure = eptr;
+      this->fail_pending(eptr);
+    });
+}
+
+void RpcClient::fail_pending(std::exception_ptr eptr)
+{
+  auto calls = std::move(pending);
+  pending.clear();
+  for (auto& p : calls)
+    p.second.reply.set_exception(eptr);
+}
+
+future<Connection::MessageReaderPtr>
+RpcClient::start_call(MessageBuilderPtr&& message, StreamFunc on_reply)
+{
+  if (failure)
+    return make_exception_future<MessageReaderPtr>(failure);
+
+  auto sequence = next_sequence++;
+  message->getRoot<proto::Message>().getHeader().setSequence(sequence);
+
+  auto& call = pending[sequence];
+  call.on_reply = std::move(on_reply);
+  auto reply = call.reply.get_future();
+  return conn->write_message(std::move(message)).then_wrapped(
+    [this, sequence, reply = std::move(reply)] (auto f) mutable {
+      if (f.failed()) {
+        // the request never made it out, so don't wait for a reply
+        pending.erase(sequence);
+        return make_exception_future<MessageReaderPtr>(f.get_exception());
+      }
+      return std::move(reply);
+    });
+}
+
+future<Connection::MessageReaderPtr> RpcClient::call(MessageBuilderPtr&& message)
+{
+  return start_call(std::move(message), nullptr);
+}
+
+future<> RpcClient::call_streamed(MessageBuilderPtr&& message,
+                                  StreamFunc on_reply)
+{
+  return start_call(std::move(message), std::move(on_reply)).discard_result();
+}
+
+future<Connection::MessageReaderPtr> RpcClient::call_chunked(ChunkFunc next)
+{
+  auto first = next();
+  if (!first)
+    return make_exception_future<MessageReaderPtr>(
+        std::invalid_argument("chunked call has no chunks"));
+  if (failure)
+    return make_exception_future<MessageReaderPtr>(failure);
+
+  auto sequence = next_sequence++;
+  first->getRoot<proto::Message>().getHeader().setSequence(sequence);
+  auto& call = pending[sequence];
+  auto reply = call.reply.get_future();
+
+  // write the chunks in order, each after the previous write completes.
+  // repeat() may move its lambda before a write resolves, so the generator
+  // is shared rather than captured by reference.
+  auto chunk = make_lw_shared<MessageBuilderPtr>(std::move(first));
+  auto generator = make_lw_shared<ChunkFunc>(std::move(next));
+  return seastar::repeat([this, sequence, chunk, generator] {
+      return conn->write_message(std::move(*chunk)).then(
+        [sequence, chunk, generator] {
+          *chunk = (*generator)();
+          if (!*chunk)
+            return seastar::stop_iteration::yes;
+          (*chunk)->getRoot<proto::Message>().getHeader().setSequence(sequence);
+          return seastar::stop_iteration::no;
+        });
+    }).then_wrapped([this, sequence, reply = std::move(reply)] (auto f) mutable {
+      if (f.failed()) {
+        // the server won't see the end of the request
+        pending.erase(sequence);
+        return make_exception_future<MessageReaderPtr>(f.get_exception());
+      }
+      return std::move(reply);
+    });
+}
+
+future<> RpcClient::close()
+{
+  return conn->close().finally([this] {
+      return std::move(reader_done);
+    });
+}
@@ -0,0 +1,107 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <core/future.hh>
+#include <core/future-util.hh>
+#include <core/shared_ptr.hh>
+
+#include "messenger.h"
+
+namespace crimson {
+namespace net {
+
+/// A client-side request/reply layer over a Connection. Each call is tagged
+/// with the next Header.sequence, so any number of requests may be in flight
+/// at once. Replies are matched to their calls by sequence as they arrive,
+/// in whatever order the server sends them.
+///
+/// A call may also stream several messages under one sequence in either
+/// direction: call_chunked() sends a request in several messages, and
+/// call_streamed() takes several replies to a request as they arrive.
+class RpcClient {
+ public:
+  using MessageReaderPtr = Connection::MessageReaderPtr;
+  using MessageBuilderPtr = Connection::MessageBuilderPtr;
+  /// Returns the next message of a chunked request, or null after the last
+  using ChunkFunc = std::function<MessageBuilderPtr()>;
+  /// Consumes a streamed reply, and says whether it was the last
+  using StreamFunc = std::function<seastar::stop_iteration(MessageReaderPtr&&)>;
+
+ private:
+  shared_ptr<Connection> conn;
+  uint32_t next_sequence{0};
+
+  struct PendingCall {
+    promise<MessageReaderPtr> reply; //< set with the reply, or null at the
+                                     //< end of a stream
+    StreamFunc on_reply; //< consumes the replies of a streamed call
+  };
+  /// calls waiting for a reply, indexed by sequence
+  std::unordered_map<uint32_t, PendingCall> pending;
+  std::exception_ptr failure; //< why the reply loop exited
+  /// resolves when the reply loop exits. It's started by its initializer,
+  /// so it must follow every member that the loop uses.
+  future<> reader_done;
+
+  /// Read replies and dispatch them to pending calls until the connection
+  /// fails, then fail any calls that are still pending. A reply that
+  /// matches no pending call, such as a late error for a call that
+  /// already finished, is dropped.
+  future<> read_replies();
+
+  /// Fail all pending calls with the given exception
+  void fail_pending(std::exception_ptr eptr);
+
+  /// Register a call and send its first message
+  future<MessageReaderPtr> start_call(MessageBuilderPtr&& message,
+                                      StreamFunc on_reply);
+
+ public:
+  RpcClient(shared_ptr<Connection> conn);
+
+  /// Assign the next sequence number to the message's header, send it, and
+  /// return a future for the matching reply
+  future<MessageReaderPtr> call(MessageBuilderPtr&& message);
+
+  /// Send a request whose replies are streamed. \a on_reply is called with
+  /// each reply as it arrives, until it returns stop_iteration::yes.
+  future<> call_streamed(MessageBuilderPtr&& message, StreamFunc on_reply);
+
+  /// Send a request in chunks that share the next sequence number, and
+  /// return a future for the single reply. \a next is called for each
+  /// chunk once the previous one has been written, so that only one chunk
+  /// needs to be built at a time.
+  future<MessageReaderPtr> call_chunked(ChunkFunc next);
+
+  /// Return the number of calls waiting for a reply
+  size_t in_flight() const { return pending.size(); }
+
+  /// Close the connection, and wait for the reply loop to exit. Calls that
+  /// are still pending will fail.
+  future<> close();
+};
+
+} // namespace net
+} // namespace crimson
@@ -0,0 +1,73 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "segment_reader.h"
+#include <core/align.hh>
+#include <kj/debug.h>
+#include <algorithm>
+
+using namespace crimson;
+using namespace crimson::net;
+
+kj::ArrayPtr<const capnp::word> SegmentMessageReader::getSegment(uint id)
+{
+  if (id >= segments.size())
+    return nullptr;
+  auto& s = segments[id];
+  KJ_REQUIRE(s.size() % sizeof(capnp::word) == 0,
+             "segment is not a whole number of words");
+  return {reinterpret_cast<const capnp::word*>(s.begin()),
+          s.size() / sizeof(capnp::word)};
+}
+
+temporary_buffer SegmentMessageReader::share(capnp::Data::Reader data)
+{
+  auto p = reinterpret_cast<const char*>(data.begin());
+  for (auto& s : segments) {
+    if (p >= s.begin() && p + data.size() <= s.end())
+      return s.share(p - s.begin(), data.size());
+  }
+  return {};
+}
+
+temporary_buffer crimson::net::copy_data(capnp::Data::Reader data)
+{
+  constexpr auto alignment = sizeof(capnp::word);
+  auto buf = temporary_buffer::aligned(alignment,
+      seastar::align_up(data.size(), alignment));
+  auto p = std::copy(data.begin(), data.end(), buf.get_write());
+  std::fill(p, buf.get_write() + buf.size(), 0); // padding
+  buf.trim(data.size());
+  return buf;
+}
+
+temporary_buffer crimson::net::share_data(capnp::MessageReader& reader,
+                                          capnp::Data::Reader data)
+{
+  auto segment_reader = dynamic_cast<SegmentMessageReader*>(&reader);
+  if (segment_reader) {
+    auto buf = segment_reader->share(data);
+    if (buf.size() == data.size())
+      return buf;
+  }
+  return copy_data(data);
+}
@@ -0,0 +1,68 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <vector>
+#include <capnp/message.h>
+#include <core/deleter.hh>
+
+#include "crimson.h"
+
+namespace crimson {
+namespace net {
+
+/// A MessageReader similar to capnp::SegmentArrayMessageReader, except that it
+/// takes ownership of the given segments. That means it must not be destructed
+/// while there are outstanding references to its segments.
+class SegmentMessageReader final : public capnp::MessageReader {
+  std::vector<temporary_buffer> segments; //< buffers from the input stream
+  seastar::deleter charge; //< released along with the reader
+ public:
+  SegmentMessageReader(std::vector<temporary_buffer>&& segments,
+                       seastar::deleter&& charge = seastar::deleter(),
+                       capnp::ReaderOptions options = capnp::ReaderOptions())
+    : MessageReader(options), segments(std::move(segments)),
+      charge(std::move(charge)) {}
+
+  /// Returns an ArrayPtr to the given buffer segment
+  kj::ArrayPtr<const capnp::word> getSegment(uint id) override;
+
+  /// Return a buffer that shares the bytes of \a data with the segment that
+  /// holds them, or an empty buffer if they aren't in a single segment
+  temporary_buffer share(capnp::Data::Reader data);
+};
+
+/// Copy the given data into a buffer that is word-aligned and padded to a
+/// whole word
+temporary_buffer copy_data(capnp::Data::Reader data);
+
+/// Return the contents of a Data field of the given message as a buffer that
+/// outlives the message. For messages read from a socket, the buffer shares
+/// the received segment without copying. Otherwise the data is copied as by
+/// copy_data().
+///
+/// Note that a shared buffer keeps the entire segment alive.
+temporary_buffer share_data(capnp::MessageReader& reader,
+                            capnp::Data::Reader data);
+
+} // namespace net
+} // namespace crimson
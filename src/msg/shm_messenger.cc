@@ -0,0 +1,607 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "shm_messenger.h"
+#include <capnp/message.h>
+#include <core/align.hh>
+#include <core/deleter.hh>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <experimental/optional>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace crimson;
+using namespace crimson::net;
+
+namespace crimson {
+namespace net {
+
+/// One direction of a ShmConnection. Positions count bytes written since
+/// the ring was created, and wrap around its buffer. The writer's and the
+/// reader's fields are on separate cache lines, so that they don't bounce
+/// between the two sides on every message.
+struct ShmRing {
+  alignas(64) std::atomic<uint64_t> head; //< end of the frames written
+  std::atomic<uint32_t> reader_sleeping; //< the reader waits for a wakeup
+  alignas(64) std::atomic<uint64_t> tail; //< end of the frames released
+  std::atomic<uint32_t> writer_sleeping; //< the writer waits for room
+  alignas(64) std::atomic<uint32_t> closed;
+};
+
+} // namespace net
+} // namespace crimson
+
+constexpr size_t ShmConnection::default_ring_size;
+constexpr size_t ShmConnection::min_ring_size;
+constexpr std::chrono::microseconds ShmConnection::default_poll;
+
+namespace {
+
+// the rings are shared with another process, so their atomics must not
+// depend on a lock in this one
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory rings need lock-free atomics");
+
+using capnp::word;
+
+constexpr uint64_t shm_magic = 0x316d6873636d7263; // "crmcshm1"
+
+/// The start of the mapping. The buffer of each ring follows it at
+/// buffer_offset, client to server first.
+struct ShmLayout {
+  uint64_t magic;
+  uint64_t ring_size;
+  ShmRing rings[2]; //< client to server, then server to client
+};
+constexpr size_t buffer_offset = 4096;
+static_assert(sizeof(ShmLayout) <= buffer_offset, "ShmLayout too large");
+
+size_t mapping_size(uint64_t ring_size)
+{
+  return buffer_offset + 2 * ring_size;
+}
+
+/// The start of every frame in a ring. The size of each segment in bytes
+/// follows it, then padding up to a word boundary, then the segments. A
+/// frame with no segments pads the ring out to the end of its buffer, so
+/// that the next frame doesn't wrap.
+struct FrameHeader {
+  uint32_t count; //< of segments
+  uint32_t size; //< of the whole frame in bytes, a multiple of a word
+};
+
+/// The most segments we'll accept in a frame, as for SocketConnection
+constexpr uint32_t max_segments = 512;
+
+/// Frame sizes are 32 bits, and padding may take up to a whole ring
+constexpr uint64_t max_ring_size = 1ull << 30;
+
+bool valid_ring_size(uint64_t ring_size)
+{
+  return ring_size >= ShmConnection::min_ring_size &&
+      ring_size <= max_ring_size && (ring_size & (ring_size - 1)) == 0;
+}
+
+size_t frame_header_size(uint32_t count)
+{
+  return seastar::align_up(sizeof(FrameHeader) + 4 * count, sizeof(word));
+}
+
+/// A MessageReader over segments that are still in a ring. The deleter
+/// releases their frame along with the reader.
+class RingMessageReader final : public capnp::MessageReader {
+  std::vector<kj::ArrayPtr<const word>> segments;
+  seastar::deleter release;
+ public:
+  RingMessageReader(std::vector<kj::ArrayPtr<const word>>&& segments,
+                    seastar::deleter&& release)
+    : MessageReader(capnp::ReaderOptions()),
+      segments(std::move(segments)), release(std::move(release)) {}
+
+  kj::ArrayPtr<const word> getSegment(uint id) override {
+    if (id >= segments.size())
+      return nullptr;
+    return segments[id];
+  }
+};
+
+std::runtime_error corrupt_ring()
+{
+  return std::runtime_error("corrupt frame in shared memory ring");
+}
+
+/// The request that a client sends as soon as it has connected to a
+/// listener's socket. The descriptor of the memfd that holds the rings
+/// comes with it.
+struct ConnectRequest {
+  uint64_t magic;
+  uint64_t ring_size;
+};
+
+/// The memfd must be sealed against these, so that its size is fixed and
+/// neither side can fault on a mapping past its end
+constexpr int required_seals = F_SEAL_SHRINK | F_SEAL_GROW;
+
+/// A ConnectRequest as a message, with room for its descriptor
+struct RequestMessage {
+  ConnectRequest request{};
+  iovec iov{&request, sizeof(request)};
+  union {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  msghdr msg{};
+
+  RequestMessage() {
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+  }
+
+  /// Take ownership of the descriptor that was received, if there was one
+  /// and it wasn't truncated
+  std::experimental::optional<seastar::file_desc> take_fd() {
+    for (auto c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+          c->cmsg_len == CMSG_LEN(sizeof(int))) {
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+        auto file = seastar::file_desc::from_fd(fd);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (msg.msg_flags & MSG_CTRUNC)
+          return {};
+        return std::move(file);
+      }
+    }
+    return {};
+  }
+};
+
+/// Send a ConnectRequest with the descriptor of the rings
+void send_request(seastar::file_desc& socket, const ConnectRequest& request,
+                  int rings)
+{
+  RequestMessage out;
+  out.request = request;
+  out.msg.msg_controllen = CMSG_SPACE(sizeof(int));
+  auto c = CMSG_FIRSTHDR(&out.msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(c), &rings, sizeof(rings));
+  auto sent = ::sendmsg(socket.get(), &out.msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (sent < 0 && errno != EAGAIN)
+    throw std::system_error(errno, std::system_category(), "sendmsg");
+  if (sent != sizeof(ConnectRequest))
+    throw std::system_error(EAGAIN, std::system_category(),
+                            "listener is backlogged");
+}
+
+sockaddr_un unix_address(const string& path)
+{
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path))
+    throw std::invalid_argument("socket path too long");
+  addr.sun_family = AF_UNIX;
+  std::copy(path.begin(), path.end(), addr.sun_path);
+  return addr;
+}
+
+seastar::file_desc unix_socket()
+{
+  return seastar::file_desc::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                                             SOCK_CLOEXEC, 0);
+}
+
+seastar::pollable_fd make_listen(const string& path)
+{
+  auto addr = unix_address(path);
+  ::unlink(path.c_str());
+  auto fd = unix_socket();
+  fd.bind(reinterpret_cast<sockaddr&>(addr), sizeof(addr));
+  fd.listen(128);
+  return seastar::pollable_fd(std::move(fd));
+}
+
+} // anonymous namespace
+
+ShmChannel::ShmChannel(seastar::mmap_area&& mapping, uint64_t ring_size,
+                       bool client, seastar::pollable_fd&& socket)
+  : mapping(std::move(mapping)),
+    ring_size(ring_size),
+    socket(std::move(socket))
+{
+  auto layout = reinterpret_cast<ShmLayout*>(this->mapping.get());
+  auto buffers = this->mapping.get() + buffer_offset;
+  in = &layout->rings[client ? 1 : 0];
+  out = &layout->rings[client ? 0 : 1];
+  in_buf = buffers + (client ? ring_size : 0);
+  out_buf = buffers + (client ? 0 : ring_size);
+  in_next = in->tail.load();
+  out_head = out->head.load();
+}
+
+Connection::MessageReaderPtr ShmChannel::take_frame()
+{
+  while (in->head.load(std::memory_order_acquire) != in_next) {
+    const auto start = in_next;
+    const auto offset = start & (ring_size - 1);
+    // the peer can write to the ring at any time, so read each field once
+    // and check it before using it
+    auto p = in_buf + offset;
+    FrameHeader header;
+    std::memcpy(&header, p, sizeof(header));
+    if (header.size < sizeof(FrameHeader) || header.size % sizeof(word) ||
+        header.size > ring_size - offset)
+      throw corrupt_ring();
+    in_next += header.size;
+    unreleased.push_back(Frame{start, in_next, false});
+    if (header.count == 0) {
+      release(start); // padding
+      continue;
+    }
+    const auto header_size = frame_header_size(header.count);
+    if (header.count > max_segments || header_size > header.size)
+      throw corrupt_ring();
+
+    std::vector<kj::ArrayPtr<const word>> segments;
+    segments.reserve(header.count);
+    auto sizes = p + sizeof(FrameHeader);
+    auto segment = p + header_size;
+    auto remaining = header.size - header_size;
+    for (uint32_t i = 0; i < header.count; i++) {
+      uint32_t size;
+      std::memcpy(&size, sizes + 4 * i, sizeof(size));
+      if (size % sizeof(word) || size > remaining)
+        throw corrupt_ring();
+      segments.emplace_back(reinterpret_cast<const word*>(segment),
+                            size / sizeof(word));
+      segment += size;
+      remaining -= size;
+    }
+    return std::make_unique<RingMessageReader>(std::move(segments),
+        seastar::make_deleter([self = shared_from_this(), start] {
+            self->release(start);
+          }));
+  }
+  return nullptr;
+}
+
+void ShmChannel::release(uint64_t start)
+{
+  for (auto& frame : unreleased) {
+    if (frame.start == start) {
+      frame.released = true;
+      break;
+    }
+  }
+  if (unreleased.empty() || !unreleased.front().released)
+    return;
+  uint64_t tail = 0;
+  while (!unreleased.empty() && unreleased.front().released) {
+    tail = unreleased.front().end;
+    unreleased.pop_front();
+  }
+  in->tail.store(tail);
+  if (in->writer_sleeping.exchange(0))
+    wake_peer();
+}
+
+void ShmChannel::put_frame(capnp::MessageBuilder& message, uint64_t size)
+{
+  auto offset = out_head & (ring_size - 1);
+  if (size > ring_size - offset) {
+    // pad out to the end of the ring, so the frame doesn't wrap
+    const FrameHeader padding{0, static_cast<uint32_t>(ring_size - offset)};
+    std::memcpy(out_buf + offset, &padding, sizeof(padding));
+    out_head += ring_size - offset;
+    offset = 0;
+  }
+  auto segments = message.getSegmentsForOutput();
+  auto p = out_buf + offset;
+  const FrameHeader header{static_cast<uint32_t>(segments.size()),
+                           static_cast<uint32_t>(size)};
+  std::memcpy(p, &header, sizeof(header));
+  auto q = p + sizeof(FrameHeader);
+  for (auto& segment : segments) {
+    const uint32_t bytes = segment.asBytes().size();
+    std::memcpy(q, &bytes, sizeof(bytes));
+    q += sizeof(bytes);
+  }
+  std::fill(q, p + frame_header_size(segments.size()), 0); // padding
+  q = p + frame_header_size(segments.size());
+  for (auto& segment : segments) {
+    auto bytes = segment.asBytes();
+    q = std::copy(bytes.begin(), bytes.end(), q);
+  }
+  // publish the frame, then wake the reader if it went to sleep before
+  // seeing it
+  out_head += size;
+  out->head.store(out_head);
+  if (out->reader_sleeping.exchange(0))
+    wake_peer();
+}
+
+future<> ShmChannel::wait()
+{
+  if (hangup)
+    return now();
+  sleepers.emplace_back();
+  auto f = sleepers.back().get_future();
+  if (sleepers.size() == 1) {
+    // the first sleeper reads the socket for all of them
+    socket.read_some(wakeup_buf, sizeof(wakeup_buf)).then_wrapped(
+      [self = shared_from_this()] (future<size_t> f) {
+        // end of file, or an error, means that the peer has gone or that
+        // close() shut the socket down
+        size_t bytes = 0;
+        try {
+          bytes = std::get<0>(f.get());
+        } catch (...) {
+        }
+        if (bytes == 0)
+          self->hangup = true;
+        auto sleepers = std::move(self->sleepers);
+        self->sleepers.clear();
+        for (auto& p : sleepers) p.set_value();
+      });
+  }
+  return f;
+}
+
+void ShmChannel::wake_peer()
+{
+  // a full socket already holds a wakeup, and a peer that has gone needs
+  // none, so a send that fails can be dropped
+  const char c = 0;
+  ::send(socket.get_file_desc().get(), &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+future<Connection::MessageReaderPtr> ShmConnection::read_message()
+{
+  return seastar::with_semaphore(read_lock, 1, [this] {
+      return receive(clock_type::now() + poll);
+    });
+}
+
+future<Connection::MessageReaderPtr>
+ShmConnection::receive(clock_type::time_point poll_until)
+{
+  auto& c = *channel;
+  try {
+    if (auto message = c.take_frame())
+      return make_ready_future<MessageReaderPtr>(std::move(message));
+  } catch (...) {
+    return make_exception_future<MessageReaderPtr>(std::current_exception());
+  }
+  if (c.in->closed.load() || c.hangup)
+    return make_exception_future<MessageReaderPtr>(
+        std::runtime_error("connection closed"));
+  if (clock_type::now() < poll_until) {
+    // poll while the reactor runs its other tasks
+    return seastar::later().then([this, poll_until] {
+        return receive(poll_until);
+      });
+  }
+  // announce that we're going to sleep, then check again for a frame that
+  // the writer published before it could see the announcement
+  c.in->reader_sleeping.store(1);
+  if (c.in->head.load() != c.in_next || c.in->closed.load()) {
+    c.in->reader_sleeping.store(0);
+    return receive(poll_until);
+  }
+  return c.wait().then([this] {
+      return receive(clock_type::now() + poll);
+    });
+}
+
+future<> ShmConnection::write_message(MessageBuilderPtr&& message)
+{
+  if (channel->out->closed.load() || channel->hangup)
+    return make_exception_future<>(std::runtime_error("connection closed"));
+  auto segments = message->getSegmentsForOutput();
+  if (segments.size() > max_segments)
+    return make_exception_future<>(std::runtime_error("too many segments"));
+  uint64_t size = frame_header_size(segments.size());
+  for (auto& segment : segments)
+    size += segment.asBytes().size();
+  // a frame no larger than half the ring always fits in an empty ring,
+  // even when it has to skip the space before the end of the buffer
+  if (size > channel->ring_size / 2)
+    return make_exception_future<>(
+        std::runtime_error("message too large for the ring"));
+
+  return seastar::with_semaphore(write_lock, 1,
+    [this, size, message = std::move(message)] () mutable {
+      auto& c = *channel;
+      const auto before_wrap = c.ring_size - (c.out_head & (c.ring_size - 1));
+      const auto needed = size > before_wrap ? size + before_wrap : size;
+      return wait_for_room(needed).then(
+        [this, size, message = std::move(message)] {
+          channel->put_frame(*message, size);
+        });
+    });
+}
+
+future<> ShmConnection::wait_for_room(uint64_t needed)
+{
+  auto& c = *channel;
+  auto room = [&c] {
+    return c.ring_size - (c.out_head - c.out->tail.load());
+  };
+  if (c.out->closed.load() || c.hangup)
+    return make_exception_future<>(std::runtime_error("connection closed"));
+  if (room() >= needed)
+    return now();
+  c.out->writer_sleeping.store(1);
+  if (room() >= needed || c.out->closed.load()) {
+    c.out->writer_sleeping.store(0);
+    return wait_for_room(needed);
+  }
+  return c.wait().then([this, needed] {
+      return wait_for_room(needed);
+    });
+}
+
+future<> ShmConnection::close()
+{
+  auto& c = *channel;
+  if (c.closed)
+    return now();
+  c.closed = true;
+  c.in->closed.store(1);
+  c.out->closed.store(1);
+  // shutting the socket down wakes our own sleepers and the peer's, so they
+  // see the connection closed
+  ::shutdown(c.socket.get_file_desc().get(), SHUT_RDWR);
+  return now();
+}
+
+future<shared_ptr<Connection>> ShmConnection::connect(
+    const string& path, size_t ring_size, std::chrono::microseconds poll)
+{
+  try {
+    if (!valid_ring_size(ring_size))
+      throw std::invalid_argument("ring size must be a power of two from "
+                                  "64KiB to 1GiB");
+    // the rings are in an anonymous memfd, sealed at its size, so the
+    // listener never opens a path that we chose, and can't be made to
+    // fault by a file that shrinks under its mapping
+    const int fd = ::memfd_create("crimson-shm",
+                                  MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+      throw std::system_error(errno, std::system_category(), "memfd_create");
+    auto file = seastar::file_desc::from_fd(fd);
+    file.truncate(mapping_size(ring_size));
+    if (::fcntl(fd, F_ADD_SEALS, required_seals | F_SEAL_SEAL) < 0)
+      throw std::system_error(errno, std::system_category(), "F_ADD_SEALS");
+    auto mapping = file.map_shared_rw(mapping_size(ring_size), 0);
+    auto layout = new (mapping.get()) ShmLayout{};
+    layout->magic = shm_magic;
+    layout->ring_size = ring_size;
+
+    // fails with ENOENT or ECONNREFUSED if nothing is listening, and with
+    // EAGAIN if the listener is backlogged
+    auto socket = unix_socket();
+    auto addr = unix_address(path);
+    socket.connect(reinterpret_cast<sockaddr&>(addr), sizeof(addr));
+    send_request(socket, ConnectRequest{shm_magic, ring_size}, fd);
+    auto channel = make_lw_shared<ShmChannel>(std::move(mapping), ring_size,
+        true, seastar::pollable_fd(std::move(socket)));
+    return make_ready_future<shared_ptr<Connection>>(
+        make_shared<ShmConnection>(std::move(channel), poll));
+  } catch (...) {
+    return make_exception_future<shared_ptr<Connection>>(
+        std::current_exception());
+  }
+}
+
+ShmListener::ShmListener(string path, std::chrono::microseconds poll)
+  : path(std::move(path)),
+    socket(make_listen(this->path)),
+    poll(poll)
+{
+}
+
+future<shared_ptr<Connection>> ShmListener::accept()
+{
+  if (closed)
+    return make_exception_future<shared_ptr<Connection>>(
+        std::runtime_error("listener closed"));
+  return socket.accept().then(
+    [this] (seastar::pollable_fd fd, auto address)
+        -> future<shared_ptr<Connection>> {
+      if (closed)
+        return make_exception_future<shared_ptr<Connection>>(
+            std::runtime_error("listener closed"));
+      auto peer = make_lw_shared<seastar::pollable_fd>(std::move(fd));
+      auto received = make_lw_shared<RequestMessage>();
+      // clients send their request as soon as they connect, and a unix
+      // socket delivers a write that small in one piece
+      return peer->recvmsg(&received->msg).then_wrapped(
+        [this, peer, received] (future<size_t> f)
+            -> future<shared_ptr<Connection>> {
+          if (closed)
+            return make_exception_future<shared_ptr<Connection>>(
+                std::runtime_error("listener closed"));
+          // dropping the socket tells the client that we refused it, and
+          // closes any descriptor it sent
+          size_t bytes = 0;
+          std::experimental::optional<seastar::file_desc> file;
+          try {
+            bytes = std::get<0>(f.get());
+            file = received->take_fd();
+          } catch (...) {
+          }
+          const auto& request = received->request;
+          if (bytes != sizeof(ConnectRequest) || !file ||
+              request.magic != shm_magic)
+            return accept();
+          const auto ring_size = request.ring_size;
+          try {
+            // touching a mapping past the end of the file would fault, so
+            // it must be sealed at a size that covers the rings
+            const int seals = ::fcntl(file->get(), F_GET_SEALS);
+            if (!valid_ring_size(ring_size) || seals < 0 ||
+                (seals & required_seals) != required_seals ||
+                uint64_t(file->stat().st_size) < mapping_size(ring_size))
+              throw corrupt_ring();
+            auto mapping = file->map_shared_rw(mapping_size(ring_size), 0);
+            auto layout = reinterpret_cast<const ShmLayout*>(mapping.get());
+            if (layout->magic != shm_magic || layout->ring_size != ring_size)
+              throw corrupt_ring();
+            auto channel = make_lw_shared<ShmChannel>(std::move(mapping),
+                ring_size, false, std::move(*peer));
+            return make_ready_future<shared_ptr<Connection>>(
+                make_shared<ShmConnection>(std::move(channel), poll));
+          } catch (std::exception&) {
+            // the client gave up before we got to it, or isn't a client
+            return accept();
+          }
+        });
+    });
+}
+
+future<> ShmListener::close()
+{
+  if (closed)
+    return now();
+  closed = true;
+  // wake an outstanding accept() with a connection of our own, which it
+  // drops
+  try {
+    auto addr = unix_address(path);
+    unix_socket().connect(reinterpret_cast<sockaddr&>(addr), sizeof(addr));
+  } catch (std::system_error&) {
+    // a backlogged listener has an accept() to wake it already
+  }
+  ::unlink(path.c_str());
+  return now();
+}
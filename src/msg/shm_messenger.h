@@ -0,0 +1,178 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include "messenger.h"
+#include <chrono>
+#include <vector>
+#include <core/circular_buffer.hh>
+#include <core/posix.hh>
+#include <core/reactor.hh>
+#include <core/semaphore.hh>
+#include <core/shared_ptr.hh>
+
+namespace crimson {
+namespace net {
+
+struct ShmRing;
+
+/// The state of one endpoint of a ShmConnection: its view of the shared
+/// mapping, and the socket to its peer. Messages read from the ring refer
+/// to the mapping, so they hold the channel until they release their
+/// frames.
+struct ShmChannel : public seastar::enable_lw_shared_from_this<ShmChannel> {
+  ShmChannel(seastar::mmap_area&& mapping, uint64_t ring_size, bool client,
+             seastar::pollable_fd&& socket);
+
+  seastar::mmap_area mapping;
+  const uint64_t ring_size; //< bytes in each ring, a power of two
+  ShmRing* in; //< the ring we read
+  ShmRing* out; //< the ring we write
+  const char* in_buf;
+  char* out_buf;
+  uint64_t in_next{0}; //< position of the next frame to read
+  uint64_t out_head{0}; //< position of the next frame to write
+  bool closed{false};
+
+  /// a frame that was read, and whether its message has released it
+  struct Frame {
+    uint64_t start;
+    uint64_t end;
+    bool released;
+  };
+  /// frames that were read and not yet given back to the writer, in order
+  seastar::circular_buffer<Frame> unreleased;
+
+  /// the unix socket to the peer. Each side wakes the other by writing a
+  /// byte to it, and it reads end of file once the peer has gone, even if
+  /// its process died without closing the connection.
+  seastar::pollable_fd socket;
+  bool hangup{false}; //< the socket read end of file
+  std::vector<promise<>> sleepers; //< waiting for the next wakeup
+  char wakeup_buf[64];
+
+  /// Return a message for the next frame of the input ring, or null if the
+  /// ring holds no more messages
+  Connection::MessageReaderPtr take_frame();
+
+  /// Give the frame at \a start back to the writer once it and every frame
+  /// before it are released
+  void release(uint64_t start);
+
+  /// Copy a message into the output ring as a frame of \a size bytes,
+  /// which must fit
+  void put_frame(capnp::MessageBuilder& message, uint64_t size);
+
+  /// Resolve on the next wakeup from the peer, or once the socket hangs up
+  future<> wait();
+
+  /// Wake the peer
+  void wake_peer();
+};
+
+/// A Connection between processes on the same host, over a pair of
+/// single-producer/single-consumer rings in a shared memory mapping.
+///
+/// A message is written by copying its segments into the ring behind a
+/// small frame header, and the reader parses the segments in place, so a
+/// message costs one copy and no system calls. Each side wakes the other
+/// through the unix socket that the connection was set up over, only once
+/// the other has gone to sleep, and a reader polls its ring for a while
+/// before it sleeps. A side that sleeps also learns from the socket when
+/// its peer's process dies.
+///
+/// A received message holds its frame until it is destroyed, and frames
+/// are given back to the writer in order. share_data() copies out of these
+/// messages, so a store that keeps the data doesn't hold the ring.
+class ShmConnection : public Connection {
+ public:
+  static constexpr size_t default_ring_size = 8 << 20;
+  static constexpr size_t min_ring_size = 64 << 10;
+  static constexpr std::chrono::microseconds default_poll{100};
+
+ private:
+  using clock_type = std::chrono::steady_clock;
+
+  lw_shared_ptr<ShmChannel> channel;
+  std::chrono::microseconds poll; //< how long a reader polls before sleeping
+  seastar::semaphore read_lock{1};
+  seastar::semaphore write_lock{1};
+
+  /// Read the next message, polling until \a poll_until before sleeping
+  future<MessageReaderPtr> receive(clock_type::time_point poll_until);
+
+  /// Wait until the output ring has room for \a needed bytes
+  future<> wait_for_room(uint64_t needed);
+
+ public:
+  ShmConnection(lw_shared_ptr<ShmChannel> channel,
+                std::chrono::microseconds poll = default_poll)
+    : channel(std::move(channel)), poll(poll) {}
+
+  /// Read the next message from the ring
+  future<MessageReaderPtr> read_message() override;
+
+  /// Copy a message into the ring. The returned future resolves once the
+  /// ring has room for it, and fails if it's larger than half the ring.
+  future<> write_message(MessageBuilderPtr&& message) override;
+
+  /// Close both endpoints, and shut down the socket to wake both sides.
+  /// Messages already in the ring can still be read.
+  future<> close() override;
+
+  /// Connect to the ShmListener at \a path with rings of \a ring_size
+  /// bytes, a power of two of at most 1GiB. The rings are mapped from a
+  /// memfd, sealed at its size, whose descriptor is passed to the listener
+  /// over the socket.
+  static future<shared_ptr<Connection>> connect(
+      const string& path, size_t ring_size = default_ring_size,
+      std::chrono::microseconds poll = default_poll);
+};
+
+/// A Listener for ShmConnections from other processes. Clients connect to
+/// a unix socket at the listener's path, and pass it their rings' memfd.
+/// The listener only maps a memfd that is sealed against shrinking and
+/// growing, and never opens a path that a client names.
+class ShmListener : public Listener {
+  const string path;
+  seastar::pollable_fd socket; //< listening at path
+  std::chrono::microseconds poll;
+  bool closed{false};
+
+ public:
+  /// Listen on a unix socket at \a path, replacing any that a previous
+  /// listener left behind
+  explicit ShmListener(string path,
+                       std::chrono::microseconds poll =
+                           ShmConnection::default_poll);
+
+  const string& get_path() const { return path; }
+
+  /// Accept the next connection announced on the socket
+  future<shared_ptr<Connection>> accept() override;
+
+  /// Fail outstanding accept() and remove the socket
+  future<> close() override;
+};
+
+} // namespace net
+} // namespace crimson
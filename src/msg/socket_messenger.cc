@@ -21,9 +21,12 @@
 // 02110-1301 USA
 
 #include "socket_messenger.h"
+#include "inbound_budget.h"
+#include "segment_reader.h"
 #include <capnp/message.h>
+#include <core/scattered_message.hh>
 #include <kj/debug.h>
-#include <numeric>
+#include <algorithm>
 #include <vector>
 
 using namespace crimson;
@@ -67,24 +70,6 @@ inline std::ostream& operator<<(std::ostream& out, kj_segment_t& rhs) {
   return out << std::dec;
 }
 
-/// A MessageReader similar to capnp::SegmentArrayMessageReader, except that it
-/// takes ownership of the given segments. That means it must not be destructed
-/// while there are outstanding references to its segments.
-class SegmentMessageReader final : public capnp::MessageReader {
-  segment_array_t segments; //< buffers from the input stream
- public:
-  SegmentMessageReader(segment_array_t&& segments,
-                       capnp::ReaderOptions options = capnp::ReaderOptions())
-    : MessageReader(options), segments(std::move(segments)) {}
-
-  /// Returns an ArrayPtr to the given buffer segment
-  kj::ArrayPtr<const capnp::word> getSegment(uint id) override {
-    if (id >= segments.size())
-      return nullptr;
-    return kj_segment_cast(segments[id]);
-  }
-};
-
 class ProtocolError : public std::runtime_error {
  public:
   ProtocolError(const std::string& msg) : std::runtime_error(msg) {}
@@ -105,142 +90,281 @@ class ProtocolError : public std::runtime_error {
 // The content of each segment, in order.
 // """
 
-future<uint32_t> read_segment_count(input_stream<char>& in)
-{
-  return in.read_exactly(4).then(
-    [] (auto data) {
-      if (data.size() != 4)
-	throw ProtocolError("failed to read segment count");
-      auto p = unaligned_cast<uint32_t>(data.get());
-      return seastar::net::ntoh(*p) + 1;
-    });
-}
-
-future<segment_t> read_segment_sizes(input_stream<char>& in, uint32_t count)
+/// Return the size of the frame header for the given number of segments,
+/// including the segment count and the padding up to a word boundary
+inline size_t frame_header_size(uint32_t count)
 {
-  return in.read_exactly(4*count).then(
-    [count] (auto data) {
-      if (data.size() < 4*count)
-        throw ProtocolError("failed to read segment sizes");
-      return data;
-    });
+  return (4 * (count + 1) + sizeof(word) - 1) & ~(sizeof(word) - 1);
 }
 
-/// An input_stream consumer that collects buffer segments for the message.
-/// We're given the array of segment sizes, but we only care about their sum
-/// because we know input_stream::consume() will give us zero-copy buffers.
-template <class CharType>
-class SegmentConsumer {
-  segment_array_t segments;
-  uint32_t bytes_remaining;
-
-  /// Transform sizes to host byte order and calculate the total message size
-  static uint32_t total_bytes(segment_t& sizes) {
-    return std::accumulate(unaligned_cast<uint32_t>(sizes.begin()),
-			   unaligned_cast<uint32_t>(sizes.end()), 0,
-			   [] (auto sum, auto next) {
-			     return sum + seastar::net::ntoh(next);
-			   });
+/// The most segments we'll accept in a frame, as in capnp's own stream reader
+constexpr uint32_t max_segments = 512;
+
+/// Decodes a frame from the buffers of an input stream. Each segment is
+/// mapped onto the buffers that hold it: a segment that lies within a single
+/// buffer at a word-aligned address is shared without copying, and only
+/// segments that straddle buffers or are misaligned are copied.
+///
+/// Once the header is parsed, the frame is charged to this core's
+/// InboundBudget before any of its segments are taken from the stream. A
+/// frame larger than the whole budget is a protocol error.
+class FrameDecoder {
+  enum class State { count, sizes, segments, done };
+  State state{State::count};
+  std::vector<char> header; //< header bytes gathered across buffers
+  std::vector<uint32_t> sizes; //< segment sizes in bytes
+  segment_array_t segments; //< decoded segments
+  segment_t partial; //< the segment being copied
+  size_t partial_bytes{0}; //< bytes copied into the partial segment
+  seastar::deleter charge; //< releases the frame's InboundBudget charge
+
+  /// Gather \a count header bytes from the front of \a data. Returns false
+  /// if more data is needed.
+  bool gather(segment_t& data, size_t count, segment_t& out) {
+    if (header.empty() && data.size() >= count) {
+      out = data.share(0, count);
+      data.trim_front(count);
+      return true;
+    }
+    auto n = std::min(count - header.size(), data.size());
+    header.insert(header.end(), data.begin(), data.begin() + n);
+    data.trim_front(n);
+    if (header.size() < count)
+      return false;
+    out = segment_t(header.data(), count);
+    header.clear();
+    return true;
   }
 
- public:
-  SegmentConsumer(segment_t&& sizes) : bytes_remaining(total_bytes(sizes)) {
+  /// Parse the segment count and sizes from the front of \a data. Returns
+  /// false if more data is needed.
+  bool parse_header(segment_t& data) {
+    segment_t buf;
+    if (state == State::count) {
+      if (!gather(data, 4, buf))
+        return false;
+      auto count = seastar::net::ntoh(*unaligned_cast<uint32_t>(buf.get())) + 1;
+      if (count == 0 || count > max_segments)
+        throw ProtocolError("invalid segment count");
+      sizes.resize(count);
+      state = State::sizes;
+    }
+    // read the sizes along with any padding that follows them
+    if (!gather(data, frame_header_size(sizes.size()) - 4, buf))
+      return false;
+    auto p = unaligned_cast<uint32_t>(buf.get());
+    for (auto& size : sizes) {
+      size = seastar::net::ntoh(*p++);
+      if (size % sizeof(word))
+        throw ProtocolError("segment size is not a whole number of words");
+    }
     segments.reserve(sizes.size());
+    state = State::segments;
+    return true;
   }
 
-  segment_array_t take_segments() { return std::move(segments); }
-
-  using unconsumed_remainder = typename input_stream<CharType>::unconsumed_remainder;
-  using tmp_buf = seastar::temporary_buffer<CharType>;
-
-  future<unconsumed_remainder> operator()(tmp_buf data) {
-    // return an empty buffer to declare that we're done
-    if (bytes_remaining == 0)
-      return make_ready_future<unconsumed_remainder>(tmp_buf{});
+  /// Take as many segments as possible from the front of \a data
+  void parse_segments(segment_t& data) {
+    while (segments.size() < sizes.size()) {
+      const size_t size = sizes[segments.size()];
+      if (partial_bytes == 0) {
+        if (data.size() >= size &&
+            reinterpret_cast<uintptr_t>(data.get()) % sizeof(word) == 0) {
+          // the whole segment is here and aligned, so share it
+          segments.emplace_back(data.share(0, size));
+          data.trim_front(size);
+          continue;
+        }
+        if (data.empty())
+          return;
+        partial = segment_t::aligned(sizeof(word), size);
+      }
+      // copy what we have of a segment that straddles buffers
+      auto n = std::min(size - partial_bytes, data.size());
+      std::copy(data.begin(), data.begin() + n,
+                partial.get_write() + partial_bytes);
+      data.trim_front(n);
+      partial_bytes += n;
+      if (partial_bytes < size)
+        return;
+      segments.emplace_back(std::move(partial));
+      partial_bytes = 0;
+    }
+  }
 
-    // return an undefined remainder to ask for another buffer
-    if (data.empty())
+ public:
+  using unconsumed_remainder = input_stream<char>::unconsumed_remainder;
+
+  /// Consume a buffer from the input stream. Returns the unused remainder
+  /// of the buffer once the frame is complete, or an undefined remainder to
+  /// ask for another buffer.
+  future<unconsumed_remainder> consume(segment_t data) {
+    if (data.empty()) // end of stream
+      throw ProtocolError("connection closed before end of frame");
+    if (state == State::segments)
+      return consume_segments(std::move(data));
+    if (!parse_header(data))
       return make_ready_future<unconsumed_remainder>(std::experimental::nullopt);
+    // wait for the budget to admit the frame. until then, nothing more is
+    // read from the socket
+    size_t bytes = frame_header_size(sizes.size());
+    for (auto size : sizes)
+      bytes += size;
+    auto& budget = InboundBudget::local();
+    if (bytes > budget.get_limit())
+      throw ProtocolError("frame larger than the inbound budget");
+    return budget.charge(bytes).then(
+      [this, data = std::move(data)] (seastar::deleter d) mutable {
+        charge = std::move(d);
+        return consume_segments(std::move(data));
+      });
+  }
 
-    if (bytes_remaining > data.size()) {
-      // take the whole buffer and ask for another
-      bytes_remaining -= data.size();
-      segments.emplace_back(std::move(data));
+  /// Take segments from a buffer after the header has been parsed
+  future<unconsumed_remainder> consume_segments(segment_t data) {
+    parse_segments(data);
+    if (segments.size() < sizes.size())
       return make_ready_future<unconsumed_remainder>(std::experimental::nullopt);
-    }
-
-    // chop off the bytes we need and return the remainder
-    auto len = data.size() - bytes_remaining;
-    auto remainder = data.share(bytes_remaining, len);
+    state = State::done;
+    return make_ready_future<unconsumed_remainder>(std::move(data));
+  }
 
-    data.trim(bytes_remaining);
-    segments.emplace_back(std::move(data));
+  segment_array_t take_segments() { return std::move(segments); }
+  seastar::deleter take_charge() { return std::move(charge); }
+};
 
-    bytes_remaining = 0;
-    return make_ready_future<unconsumed_remainder>(std::move(remainder));
+/// An input_stream consumer that feeds buffers to a FrameDecoder
+class FrameConsumer {
+  FrameDecoder* decoder;
+ public:
+  FrameConsumer(FrameDecoder* decoder) : decoder(decoder) {}
+
+  future<FrameDecoder::unconsumed_remainder> operator()(segment_t data) {
+    try {
+      return decoder->consume(std::move(data));
+    } catch (...) {
+      return make_exception_future<FrameDecoder::unconsumed_remainder>(
+          std::current_exception());
+    }
   }
 };
 
-future<> write_segment_count(uint32_t count, output_stream<char>& out)
-{
-  auto data = seastar::net::hton(count - 1);
-  return out.write(reinterpret_cast<const char*>(&data), 4);
-}
+/// The state of a read_message() call, which must outlive its consume()
+struct FrameReader {
+  FrameDecoder decoder;
+  FrameConsumer consumer{&decoder};
+};
 
-template <class Iter>
-future<> write_segment_sizes(Iter begin, Iter end, output_stream<char>& out)
+/// Build the frame header (segment count, segment sizes and padding) in a
+/// single buffer, so it can go out with the segments in one packet
+segment_t make_frame_header(kj_segment_array_t segments)
 {
-  return do_for_each(begin, end,
-    [&out] (auto segment) {
-      uint32_t size = segment.asBytes().size(); // size in bytes
-      uint32_t data = seastar::net::hton(size);
-      return out.write(reinterpret_cast<const char*>(&data), 4);
-    });
+  const uint32_t count = segments.size();
+  segment_t header(frame_header_size(count));
+  auto p = reinterpret_cast<uint32_t*>(header.get_write());
+  *p++ = seastar::net::hton(count - 1);
+  for (auto& segment : segments) {
+    uint32_t size = segment.asBytes().size(); // size in bytes
+    *p++ = seastar::net::hton(size);
+  }
+  if (count % 2 == 0)
+    *p = 0; // padding
+  return header;
 }
 
-future<> write_frame(kj_segment_array_t segments, output_stream<char>& out)
+/// Write the frame header and segments of a message as a single packet. The
+/// segments are not copied; the packet takes ownership of the message, and
+/// releases it once the output stream is done with the segments.
+future<> write_frame(Connection::MessageBuilderPtr&& message,
+                     output_stream<char>& out)
 {
-  return write_segment_count(segments.size(), out).then(
-    [&out, segments] {
-      return write_segment_sizes(segments.begin(), segments.end(), out);
-    }).then([&out, segments] {
-      return do_for_each(segments.begin(), segments.end(),
-        [&out] (auto segment) {
-          auto s = segment.asBytes();
-          return out.write(reinterpret_cast<const char*>(s.begin()), s.size());
-			 });
-    });
+  auto segments = message->getSegmentsForOutput();
+
+  seastar::scattered_message<char> msg;
+  msg.reserve(segments.size() + 1);
+  msg.append(make_frame_header(segments));
+  for (auto& segment : segments) {
+    auto s = segment.asBytes();
+    msg.append_static(reinterpret_cast<const char*>(s.begin()), s.size());
+  }
+  msg.on_delete([message = std::move(message)] {});
+  return out.write(std::move(msg));
 }
 
 } // anonymous namespace
 
 future<Connection::MessageReaderPtr> SocketConnection::read_message()
 {
-  return read_segment_count(in).then(
-    [this] (auto count) {
-      return read_segment_sizes(in, count).then(
-        [this, count] (auto sizes) {
-          SegmentConsumer<char> c(std::move(sizes));
-          auto consume = in.consume(c);
-          return consume.then([c = std::move(c)] () mutable -> MessageReaderPtr {
-              return std::make_unique<SegmentMessageReader>(c.take_segments());
-            });
-        });
+  auto reader = make_lw_shared<FrameReader>();
+  return in.consume(reader->consumer).then(
+    [reader] () -> MessageReaderPtr {
+      auto segments = reader->decoder.take_segments();
+      return std::make_unique<SegmentMessageReader>(std::move(segments),
+          reader->decoder.take_charge());
     });
 }
 
 future<> SocketConnection::write_message(MessageBuilderPtr&& message)
 {
-  // write the segment count, sizes, and data
-  auto segments = message->getSegmentsForOutput();
-  return write_frame(std::move(segments), out).then(
-    [this] { return out.flush(); }
-  ).finally([message = std::move(message)] {});
+  if (corked) {
+    // queue the frame now, and share a flush with the other messages
+    // written during this reactor tick
+    return seastar::with_semaphore(write_lock, 1,
+      [this, message = std::move(message)] () mutable {
+        return write_frame(std::move(message), out);
+      }).then([this] { return flush_corked(); });
+  }
+  return seastar::with_semaphore(write_lock, 1,
+    [this, message = std::move(message)] () mutable {
+      return write_frame(std::move(message), out).then(
+        [this] { return out.flush(); });
+    });
+}
+
+future<> SocketConnection::flush_corked()
+{
+  if (flush_waiters.empty() && closed) {
+    // close() has stopped taking flushes, and closing flushes the stream
+    return make_exception_future<>(std::runtime_error("connection closed"));
+  }
+  flush_waiters.emplace_back();
+  auto f = flush_waiters.back().get_future();
+  if (flush_waiters.size() == 1) {
+    // the first corked write schedules the flush, deferring it until the
+    // reactor has run the other tasks that are ready. The gate keeps the
+    // connection alive until it runs.
+    seastar::with_gate(flushes, [this] {
+      return seastar::later().then([this] {
+          // writes that complete after this point wait for the next flush
+          auto waiters = std::move(flush_waiters);
+          flush_waiters.clear();
+          return seastar::with_semaphore(write_lock, 1,
+            [this] { return out.flush(); }
+          ).then_wrapped([waiters = std::move(waiters)] (auto f) mutable {
+            if (f.failed()) {
+              auto eptr = f.get_exception();
+              for (auto& p : waiters) p.set_exception(eptr);
+            } else {
+              for (auto& p : waiters) p.set_value();
+            }
+          });
+        });
+    });
+  }
+  return f;
 }
 
 future<> SocketConnection::close()
 {
-  return out.close();
+  if (closed)
+    return now();
+  closed = true;
+  socket.shutdown_input();
+  // wait for a pending corked flush before closing the stream
+  return flushes.close().finally([this] {
+      return seastar::with_semaphore(write_lock, 1,
+        [this] { return out.close(); });
+    });
 }
 
 static auto make_listen(socket_address address)
@@ -258,8 +382,9 @@ SocketListener::SocketListener(socket_address address)
 future<shared_ptr<Connection>> SocketListener::accept()
 {
   return listener.accept().then(
-    [] (auto socket, auto addr) {
+    [this] (auto socket, auto addr) {
       auto conn = make_shared<SocketConnection>(std::move(socket), addr);
+      conn->set_cork(cork);
       return make_ready_future<shared_ptr<Connection>>(conn);
     });
 }
@@ -22,7 +22,10 @@
 #pragma once
 
 #include "messenger.h"
+#include <core/gate.hh>
 #include <core/reactor.hh>
+#include <core/semaphore.hh>
+#include <vector>
 
 namespace crimson {
 namespace net {
@@ -37,6 +40,14 @@ class SocketConnection : public Connection {
   socket_address address;
   input_stream<char> in;
   output_stream<char> out;
+  seastar::semaphore write_lock{1}; //< serializes access to the output stream
+  bool corked{false};
+  bool closed{false};
+  std::vector<promise<>> flush_waiters; //< corked writes waiting for a flush
+  seastar::gate flushes; //< close() waits for the deferred flush
+
+  /// Flush once for all of the corked writes in this reactor tick
+  future<> flush_corked();
 
  public:
   SocketConnection(connected_socket&& fd, socket_address address)
@@ -49,16 +60,26 @@ class SocketConnection : public Connection {
   /// Read a message from the Connection's input stream
   future<MessageReaderPtr> read_message() override;
 
-  /// Write a message to the Connection's output stream
+  /// Write a message to the Connection's output stream. The message is sent
+  /// as a single zero-copy packet, and the returned future resolves once the
+  /// message has been flushed.
   future<> write_message(MessageBuilderPtr&& message) override;
 
-  /// Close the output stream
+  /// When corked, messages written in the same reactor tick share a single
+  /// flush of the output stream instead of flushing one at a time
+  void set_cork(bool enable) { corked = enable; }
+
+  /// Shut down the input stream, which fails a pending read_message(), and
+  /// close the output stream once pending writes are flushed. A corked
+  /// connection must not be destroyed before this resolves, since its
+  /// deferred flush refers to it.
   future<> close() override;
 };
 
 /// A Listener that listens on a server_socket.
 class SocketListener : public Listener {
   server_socket listener;
+  bool cork{false};
 
  public:
   SocketListener(socket_address address);
@@ -66,6 +87,9 @@ class SocketListener : public Listener {
   /// Accept the next incoming connection on the server_socket
   future<shared_ptr<Connection>> accept() override;
 
+  /// Enable corking on the connections accepted from now on
+  void set_cork(bool enable) { cork = enable; }
+
   /// Cancel outstanding accept()
   future<> close() override;
 };
@@ -0,0 +1,125 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "extent_cache.h"
+
+using namespace crimson;
+using namespace crimson::osd;
+
+constexpr size_t ExtentCache::reclaim_step;
+
+ExtentCache::ExtentCache(size_t budget)
+  : budget(budget),
+    reclaimer([this] {
+        return reclaim(reclaim_step)
+            ? seastar::memory::reclaiming_result::reclaimed_something
+            : seastar::memory::reclaiming_result::reclaimed_nothing;
+      })
+{}
+
+const temporary_buffer* ExtentCache::find(uint64_t position)
+{
+  auto i = entries.find(position);
+  if (i == entries.end()) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  auto& entry = i->second;
+  if (entry.queue == Queue::frequent)
+    frequent.splice(frequent.begin(), frequent, entry.link);
+  // an entry on the recent queue stays where it is, so that a burst of
+  // reads doesn't make it look frequent
+  return &entry.data;
+}
+
+void ExtentCache::insert(uint64_t position, temporary_buffer data)
+{
+  if (!admits(data.size()) || entries.count(position))
+    return;
+  const auto size = data.size();
+  Queue queue = Queue::recent;
+  auto ghost = ghosts.find(position);
+  if (ghost != ghosts.end()) {
+    // seen again since it was last evicted
+    queue = Queue::frequent;
+    ghost_bytes -= ghost->second.bytes;
+    ghost_order.erase(ghost->second.link);
+    ghosts.erase(ghost);
+  }
+  auto& list = queue == Queue::recent ? recent : frequent;
+  list.push_front(position);
+  entries.emplace(position, Entry{std::move(data), queue, list.begin()});
+  bytes += size;
+  if (queue == Queue::recent)
+    recent_bytes += size;
+  shrink();
+}
+
+size_t ExtentCache::evict_one()
+{
+  // evict from the recent queue while it holds more than its share
+  const bool from_recent = !recent.empty() &&
+      (recent_bytes > budget / 4 || frequent.empty());
+  auto position = from_recent ? recent.back() : frequent.back();
+  auto i = entries.find(position);
+  const auto size = i->second.data.size();
+  if (from_recent) {
+    recent.pop_back();
+    recent_bytes -= size;
+    // remember it, so it's kept longer if it's read again soon
+    ghost_order.push_front(position);
+    ghosts.emplace(position, Ghost{size, ghost_order.begin()});
+    ghost_bytes += size;
+    while (ghost_bytes > budget / 2) {
+      auto oldest = ghosts.find(ghost_order.back());
+      ghost_bytes -= oldest->second.bytes;
+      ghosts.erase(oldest);
+      ghost_order.pop_back();
+    }
+  } else {
+    frequent.pop_back();
+  }
+  entries.erase(i);
+  bytes -= size;
+  return size;
+}
+
+void ExtentCache::shrink()
+{
+  while (bytes > budget)
+    evict_one();
+}
+
+size_t ExtentCache::reclaim(size_t target)
+{
+  size_t dropped = 0;
+  while (dropped < target && !entries.empty())
+    dropped += evict_one();
+  return dropped;
+}
+
+void ExtentCache::set_budget(size_t budget)
+{
+  this->budget = budget;
+  shrink();
+}
@@ -0,0 +1,110 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <core/memory.hh>
+
+#include "crimson.h"
+
+namespace crimson {
+namespace osd {
+
+/// A cache of the extents of a core's log, by their position in the log.
+/// The log is append-only, so an extent's contents never change and
+/// entries never need to be invalidated. Entries are temporary_buffers that
+/// reads share, so a hit is served without I/O or copies.
+///
+/// Eviction follows 2Q (Johnson and Shasha, VLDB '94), which keeps a scan
+/// from flushing the hot set. An extent seen for the first time goes on the
+/// recent queue, which holds at most a quarter of the budget once the cache
+/// is full. An extent evicted from the recent queue is remembered, without
+/// its data, on the ghost list; if it's inserted again while remembered, it
+/// goes on the frequent queue, which is evicted in LRU order. An extent that's
+/// read only once passes through the recent queue without displacing any
+/// frequent ones.
+///
+/// The cache gives memory back to seastar's reclaimer when memory runs
+/// short, on top of staying within its budget.
+class ExtentCache {
+  enum class Queue { recent, frequent };
+  struct Entry {
+    temporary_buffer data;
+    Queue queue;
+    std::list<uint64_t>::iterator link; //< in its queue
+  };
+  struct Ghost {
+    size_t bytes;
+    std::list<uint64_t>::iterator link; //< in ghost_order
+  };
+  std::unordered_map<uint64_t, Entry> entries;
+  std::list<uint64_t> recent; //< in FIFO order, newest first
+  std::list<uint64_t> frequent; //< in LRU order, most recent first
+  std::unordered_map<uint64_t, Ghost> ghosts;
+  std::list<uint64_t> ghost_order; //< newest first
+
+  size_t budget; //< bytes
+  size_t bytes{0}; //< of all entries
+  size_t recent_bytes{0};
+  size_t ghost_bytes{0}; //< of the extents the ghosts remember
+  uint64_t hits{0};
+  uint64_t misses{0};
+
+  seastar::memory::reclaimer reclaimer;
+
+  /// Evict an entry, and return the bytes it held
+  size_t evict_one();
+
+  /// Evict entries until the cache is within its budget
+  void shrink();
+
+ public:
+  /// Bytes given back each time seastar's reclaimer asks
+  static constexpr size_t reclaim_step = 1 << 20;
+
+  explicit ExtentCache(size_t budget);
+
+  /// Return true if an extent of the given size may be cached
+  bool admits(size_t size) const { return size && size <= budget / 8; }
+
+  /// Return the extent cached at the given position, or null on a miss
+  const temporary_buffer* find(uint64_t position);
+
+  /// Cache the extent at the given position, unless it's already cached
+  void insert(uint64_t position, temporary_buffer data);
+
+  /// Evict entries until at least the given number of bytes have been
+  /// dropped, or the cache is empty, and return the bytes dropped
+  size_t reclaim(size_t target);
+
+  void set_budget(size_t budget);
+  size_t get_budget() const { return budget; }
+
+  /// Return the bytes held by the cache
+  size_t get_bytes() const { return bytes; }
+  uint64_t get_hits() const { return hits; }
+  uint64_t get_misses() const { return misses; }
+};
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,118 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+namespace crimson {
+namespace osd {
+
+/// A sparse map of an object's data, from ranges of the object to the
+/// extents that hold them. Ranges that aren't mapped are holes, which read
+/// back as zeroes. An Extent is anything with a size() and a share(skip,
+/// length) that returns the part of it that starts \a skip bytes in, such
+/// as a temporary_buffer.
+///
+/// Extents are kept in a tree ordered by offset, so a write finds what it
+/// overlaps in O(log n). An overwrite trims and splits the extents it
+/// overlaps by sharing them, without copying any data.
+template <typename Extent>
+class ExtentMap {
+  std::map<uint64_t, Extent> extents; //< by offset, non-empty, non-overlapping
+  uint64_t length{0}; //< logical size of the object
+
+ public:
+  /// Return the logical size of the object
+  uint64_t size() const { return length; }
+
+  /// Return the number of extents in the map
+  size_t extent_count() const { return extents.size(); }
+
+  /// Map the range that \a extent covers at \a offset to it, replacing what
+  /// the range held before, and extend the object to the end of the range.
+  /// The range must not wrap, which the stores ensure by rejecting writes
+  /// past ObjectStore::max_object_size.
+  void insert(uint64_t offset, Extent extent) {
+    const auto end = offset + extent.size();
+    length = std::max(length, end);
+    if (extent.size() == 0)
+      return;
+
+    auto i = extents.lower_bound(offset);
+    if (i != extents.begin()) {
+      // trim the extent that starts before the range, and keep its part
+      // past the range if there is one
+      auto prev = std::prev(i);
+      const auto prev_end = prev->first + prev->second.size();
+      if (prev_end > end)
+        extents.emplace(end, prev->second.share(end - prev->first,
+                                                prev_end - end));
+      if (prev_end > offset)
+        prev->second = prev->second.share(0, offset - prev->first);
+    }
+    // drop the extents that start in the range, keeping their parts past it
+    while (i != extents.end() && i->first < end) {
+      const auto i_end = i->first + i->second.size();
+      if (i_end > end)
+        extents.emplace(end, i->second.share(end - i->first, i_end - end));
+      i = extents.erase(i);
+    }
+    extents.emplace(offset, std::move(extent));
+  }
+
+  /// Return the extent that ends exactly at \a offset, and set \a start to
+  /// its offset, or return null if there isn't one
+  Extent* ending_at(uint64_t offset, uint64_t& start) {
+    auto i = extents.lower_bound(offset);
+    if (i == extents.begin())
+      return nullptr;
+    --i;
+    if (i->first + i->second.size() != offset)
+      return nullptr;
+    start = i->first;
+    return &i->second;
+  }
+
+  /// Call func(position, extent, skip, count) for each mapped part of the
+  /// range [offset, offset + count), in order. The part is \a count bytes
+  /// of \a extent from \a skip bytes in, and it's at \a position within the
+  /// range. Holes are skipped.
+  template <typename Func>
+  void for_each(uint64_t offset, uint64_t count, Func&& func) {
+    const auto end = offset + count;
+    auto i = extents.upper_bound(offset);
+    if (i != extents.begin())
+      --i;
+    for (; i != extents.end() && i->first < end; ++i) {
+      const auto start = std::max(i->first, offset);
+      const auto stop = std::min(i->first + i->second.size(), end);
+      if (start < stop)
+        func(start - offset, i->second, start - i->first, stop - start);
+    }
+  }
+};
+
+} // namespace osd
+} // namespace crimson
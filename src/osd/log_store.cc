@@ -0,0 +1,546 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "log_store.h"
+#include <algorithm>
+#include <cstddef>
+#include <system_error>
+#include <core/align.hh>
+#include <core/future-util.hh>
+#include <core/reactor.hh>
+
+#include "xxHash/xxhash.h"
+
+using namespace crimson;
+using namespace crimson::osd;
+
+namespace {
+
+constexpr uint32_t record_magic = 0x474c5243; //< "CRLG"
+constexpr uint32_t header_magic = 0x484c5243; //< "CRLH"
+
+/// Replay reads the log in windows of this many bytes
+constexpr uint64_t replay_window = 1 << 20;
+
+/// The start of every record in the log. The object's name follows it, then
+/// the data at the next multiple of 8 bytes, so that reads of the data are
+/// word-aligned. Records are packed at multiples of 8 bytes, and each batch
+/// of them is padded with zeroes to a whole block.
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t checksum; //< of the rest of the record, up to the end of the data
+  uint64_t generation;
+  uint64_t sequence;
+  uint64_t offset; //< in the object
+  uint64_t length; //< of the data
+  uint32_t name_length;
+  uint32_t reserved;
+};
+static_assert(sizeof(RecordHeader) == 48, "RecordHeader has padding");
+
+/// The start of the log's first block, which holds no records
+struct LogHeader {
+  uint32_t magic;
+  uint32_t checksum; //< of the rest of the header
+  uint32_t shard;
+  uint32_t shard_count;
+  uint64_t placement;
+};
+static_assert(sizeof(LogHeader) == 24, "LogHeader has padding");
+
+uint32_t header_checksum(const LogHeader& header)
+{
+  constexpr auto skip = offsetof(LogHeader, shard);
+  return XXH32(reinterpret_cast<const char*>(&header) + skip,
+               sizeof(header) - skip, 0);
+}
+
+/// Return the position of a record's data within the record
+uint64_t data_start(uint64_t name_length)
+{
+  return seastar::align_up<uint64_t>(sizeof(RecordHeader) + name_length, 8);
+}
+
+uint64_t record_size(uint64_t name_length, uint64_t length)
+{
+  return seastar::align_up<uint64_t>(data_start(name_length) + length, 8);
+}
+
+/// Checksum a record whose data ends at \a end
+uint32_t record_checksum(const char* record, uint64_t end)
+{
+  constexpr auto skip = offsetof(RecordHeader, generation);
+  return XXH32(record + skip, end - skip, 0);
+}
+
+std::system_error store_error(int error)
+{
+  return std::system_error(error, std::system_category());
+}
+
+/// Reads the log in large windows while it's replayed, so that small
+/// records don't each cost a read
+struct ReplayCursor {
+  uint64_t position{LogStore::block_size}; //< of the next record
+  uint64_t last_sequence{0};
+  uint64_t last_generation{0};
+  temporary_buffer window;
+  uint64_t window_position{0};
+
+  /// Return the given range of the log, which may be short at the end of
+  /// the log
+  future<temporary_buffer> read(seastar::file& log, uint64_t capacity,
+                                uint64_t start, uint64_t length) {
+    if (start >= window_position &&
+        start + length <= window_position + window.size())
+      return make_ready_future<temporary_buffer>(
+          window.share(start - window_position, length));
+    const auto from = seastar::align_down(start, LogStore::block_size);
+    const auto to = seastar::align_up(start + length, LogStore::block_size);
+    auto size = std::min(std::max(to - from, replay_window), capacity - from);
+    return log.dma_read<char>(from, size).then(
+      [this, from, start, length] (temporary_buffer data) {
+        window = std::move(data);
+        window_position = from;
+        const auto skip = std::min<uint64_t>(start - from, window.size());
+        return window.share(skip, std::min(length, window.size() - skip));
+      });
+  }
+};
+
+} // anonymous namespace
+
+constexpr uint64_t LogStore::block_size;
+constexpr uint64_t LogStore::batch_size;
+
+LogStore::LogStore(string path, uint64_t capacity, size_t cache_size,
+                   Layout layout)
+  : cache(cache_size),
+    path(std::move(path)),
+    capacity(seastar::align_down(capacity, block_size)),
+    layout(layout)
+{}
+
+future<> LogStore::open()
+{
+  return seastar::open_file_dma(path, seastar::open_flags::rw |
+                                      seastar::open_flags::create).then(
+    [this] (seastar::file f) {
+      log = std::move(f);
+      return log.size();
+    }).then([this] (uint64_t size) {
+      if (size >= capacity)
+        return now();
+      // allocate the whole log up front, so that appends don't wait for
+      // the filesystem to allocate blocks
+      return log.allocate(size, capacity - size).then([this] {
+          return log.truncate(capacity);
+        });
+    }).then([this] {
+      return check_header();
+    }).then([this] {
+      return replay();
+    }).then([this] (uint64_t end) {
+      return zero_after(end);
+    });
+}
+
+future<> LogStore::check_header()
+{
+  if (capacity < 2 * block_size)
+    return make_exception_future<>(store_error(ENOSPC));
+  return log.dma_read<char>(0, block_size).then(
+    [this] (temporary_buffer block) {
+      if (block.size() < block_size)
+        throw store_error(EIO);
+      auto header = reinterpret_cast<const LogHeader*>(block.get());
+      if (header->magic == header_magic) {
+        if (header->checksum != header_checksum(*header))
+          throw std::system_error(EIO, std::system_category(),
+                                  path + ": corrupt log header");
+        const Layout found{header->shard, header->shard_count,
+                           header->placement};
+        if (!(found == layout))
+          throw std::system_error(EINVAL, std::system_category(),
+              path + ": log was created for shard " +
+              seastar::to_sstring(found.shard) + " of " +
+              seastar::to_sstring(found.shard_count) +
+              ", under another layout of placement groups");
+        return now();
+      }
+      if (std::any_of(block.get(), block.get() + block_size,
+                      [] (char c) { return c != 0; }))
+        throw std::system_error(EINVAL, std::system_category(),
+                                path + ": not a log");
+      // a new log
+      auto buf = make_lw_shared<temporary_buffer>(
+          temporary_buffer::aligned(block_size, block_size));
+      std::fill(buf->get_write(), buf->get_write() + block_size, 0);
+      auto created = reinterpret_cast<LogHeader*>(buf->get_write());
+      created->magic = header_magic;
+      created->shard = layout.shard;
+      created->shard_count = layout.shard_count;
+      created->placement = layout.placement;
+      created->checksum = header_checksum(*created);
+      return log.dma_write(0, buf->get(), block_size).then(
+        [this, buf] (size_t written) {
+          if (written != block_size)
+            throw store_error(EIO);
+          return log.flush();
+        });
+    });
+}
+
+future<uint64_t> LogStore::replay()
+{
+  auto cursor = make_lw_shared<ReplayCursor>();
+  return seastar::repeat([this, cursor] {
+      using seastar::stop_iteration;
+      const auto position = cursor->position;
+      if (capacity - position < sizeof(RecordHeader))
+        return make_ready_future<stop_iteration>(stop_iteration::yes);
+      return cursor->read(log, capacity, position, sizeof(RecordHeader)).then(
+        [this, cursor, position] (temporary_buffer block) {
+          auto header = reinterpret_cast<const RecordHeader*>(block.get());
+          if (block.size() < sizeof(RecordHeader) ||
+              header->magic != record_magic) {
+            // a batch ends with zeroes up to the next block, and the log
+            // ends at a block that doesn't start with a record
+            if (block.size() < sizeof(RecordHeader) ||
+                position % block_size == 0)
+              return make_ready_future<stop_iteration>(stop_iteration::yes);
+            cursor->position = seastar::align_up(position, block_size);
+            return make_ready_future<stop_iteration>(stop_iteration::no);
+          }
+          if (header->length > capacity || header->name_length > capacity ||
+              !in_bounds(header->offset, header->length))
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+          const auto size = record_size(header->name_length, header->length);
+          if (size > capacity - position)
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+          return cursor->read(log, capacity, position, size).then(
+            [this, cursor, position, size] (temporary_buffer record) {
+              if (record.size() < size)
+                return stop_iteration::yes;
+              auto header = reinterpret_cast<const RecordHeader*>(record.get());
+              const auto start = data_start(header->name_length);
+              // the log ends at the first record that's torn, or that was
+              // left over from an earlier run
+              if (header->checksum !=
+                      record_checksum(record.get(), start + header->length) ||
+                  header->sequence != cursor->last_sequence + 1 ||
+                  header->generation < cursor->last_generation)
+                return stop_iteration::yes;
+              ObjectName name(record.get() + sizeof(RecordHeader),
+                              header->name_length);
+              objects[name].insert(header->offset,
+                                   Extent{header->length, position + start,
+                                          position + start, header->length});
+              cursor->last_sequence = header->sequence;
+              cursor->last_generation = header->generation;
+              cursor->position = position + size;
+              return stop_iteration::no;
+            });
+        });
+    }).then([this, cursor] {
+      tail = seastar::align_up(cursor->position, block_size);
+      next_sequence = cursor->last_sequence + 1;
+      committed = cursor->last_sequence;
+      generation = cursor->last_generation + 1;
+      return cursor->position;
+    });
+}
+
+future<> LogStore::zero_after(uint64_t end)
+{
+  if (end % block_size == 0)
+    return now();
+  const auto block = seastar::align_down(end, block_size);
+  return log.dma_read<char>(block, block_size).then(
+    [this, block, end] (temporary_buffer data) {
+      if (data.size() < end - block)
+        throw store_error(EIO);
+      auto buf = make_lw_shared<temporary_buffer>(
+          temporary_buffer::aligned(block_size, block_size));
+      auto p = std::copy(data.get(), data.get() + (end - block),
+                         buf->get_write());
+      std::fill(p, buf->get_write() + block_size, 0);
+      return log.dma_write(block, buf->get(), block_size).then(
+        [buf] (size_t written) {
+          if (written != block_size)
+            throw store_error(EIO);
+        });
+    }).then([this] {
+      return log.flush();
+    });
+}
+
+future<temporary_buffer> LogStore::read_log(uint64_t position,
+                                            uint64_t length)
+{
+  // records that haven't been written yet are copied from their batch
+  for (auto& batch : batches) {
+    if (position >= batch.position && position < batch.position + batch.used)
+      return make_ready_future<temporary_buffer>(temporary_buffer(
+          batch.buf.get() + (position - batch.position), length));
+  }
+  return log.dma_read<char>(position, length).then(
+    [length] (temporary_buffer data) {
+      if (data.size() < length)
+        throw store_error(EIO);
+      return data;
+    });
+}
+
+future<std::vector<temporary_buffer>>
+LogStore::read_extents(const ObjectName& oid, uint64_t offset,
+                       uint64_t length)
+{
+  using extents = std::vector<temporary_buffer>;
+  auto found = objects.find(oid);
+  if (!found)
+    return make_exception_future<extents>(store_error(ENOENT));
+
+  auto& object = *found;
+  if (offset >= object.size() || length == 0)
+    return make_ready_future<extents>();
+  length = std::min(length, object.size() - offset);
+
+  // find the parts of the range that are in the log, and leave a slot in
+  // the result for each of them between the holes
+  struct Piece {
+    size_t index; //< in the result
+    uint64_t length;
+    uint64_t position; //< in the log
+    Extent extent; //< that holds the piece
+  };
+  std::vector<Piece> pieces;
+  auto result = make_lw_shared<extents>();
+  uint64_t position = 0; // end of the last piece in the range
+  object.for_each(offset, length,
+    [&pieces, result, &position] (uint64_t at, const Extent& extent,
+                                  uint64_t skip, uint64_t count) {
+      if (at > position)
+        result->push_back(zero_buffer(at - position));
+      pieces.push_back(Piece{result->size(), count, extent.position + skip,
+                             extent});
+      result->emplace_back();
+      position = at + count;
+    });
+  if (position < length)
+    result->push_back(zero_buffer(length - position));
+
+  return seastar::parallel_for_each(pieces.begin(), pieces.end(),
+    [this, result] (const Piece& piece) {
+      return read_extent(piece.extent, piece.position, piece.length).then(
+        [result, index = piece.index] (temporary_buffer data) {
+          (*result)[index] = std::move(data);
+        });
+    }).then([result] {
+      return std::move(*result);
+    });
+}
+
+future<temporary_buffer> LogStore::read_extent(const Extent& extent,
+                                               uint64_t position,
+                                               uint64_t length)
+{
+  // key the cache by the record rather than the extent, so the pieces an
+  // overwrite leaves of a record share one entry instead of each missing
+  const auto skip = position - extent.record;
+  if (auto cached = cache.find(extent.record)) {
+    if (skip + length <= cached->size())
+      return make_ready_future<temporary_buffer>(cached->share(skip, length));
+  }
+  if (!cache.admits(extent.record_length))
+    return read_log(position, length);
+  // read and cache the whole record, since the rest of it is likely to be
+  // read next
+  return read_log(extent.record, extent.record_length).then(
+    [this, record = extent.record, skip, length] (temporary_buffer data) {
+      auto piece = data.share(skip, length);
+      cache.insert(record, std::move(data));
+      return piece;
+    });
+}
+
+LogStore::Batch* LogStore::batch_for(uint64_t size)
+{
+  if (batches.size() > flushing) {
+    auto& last = batches.back();
+    if (last.buf.size() - last.used >= size)
+      return &last;
+    close_batch(last);
+  }
+  const auto needed = seastar::align_up(size, block_size);
+  if (needed > capacity - tail)
+    return nullptr;
+  temporary_buffer buf;
+  if (needed <= batch_size && batch_size <= capacity - tail) {
+    if (!spare.empty()) {
+      buf = std::move(spare.back());
+      spare.pop_back();
+    } else {
+      buf = temporary_buffer::aligned(block_size, batch_size);
+    }
+  } else {
+    buf = temporary_buffer::aligned(block_size, needed);
+  }
+  batches.push_back(Batch{std::move(buf), tail});
+  // the tail moves past the batch once it's closed
+  tail += batches.back().buf.size();
+  return &batches.back();
+}
+
+void LogStore::close_batch(Batch& batch)
+{
+  const auto end = seastar::align_up(batch.used, block_size);
+  std::fill(batch.buf.get_write() + batch.used, batch.buf.get_write() + end, 0);
+  tail = batch.position + end;
+}
+
+future<uint64_t> LogStore::write(const ObjectName& oid, uint64_t offset,
+                                 temporary_buffer&& data)
+{
+  if (failure)
+    return make_exception_future<uint64_t>(store_error(EIO));
+  if (!in_bounds(offset, data.size()))
+    return make_exception_future<uint64_t>(store_error(EFBIG));
+  const uint64_t length = data.size();
+  const auto start = data_start(oid.size);
+  const auto size = record_size(oid.size, length);
+  auto batch = batch_for(size);
+  if (!batch)
+    return make_exception_future<uint64_t>(store_error(ENOSPC));
+  const auto position = batch->position + batch->used;
+  const auto sequence = next_sequence++;
+
+  auto p = batch->buf.get_write() + batch->used;
+  auto header = reinterpret_cast<RecordHeader*>(p);
+  *header = RecordHeader{record_magic, 0, generation, sequence, offset, length,
+                         static_cast<uint32_t>(oid.size), 0};
+  std::copy(oid.data, oid.data + oid.size, p + sizeof(RecordHeader));
+  std::fill(p + sizeof(RecordHeader) + oid.size, p + start, 0);
+  std::copy(data.get(), data.get() + length, p + start);
+  std::fill(p + start + length, p + size, 0);
+  header->checksum = record_checksum(p, start + length);
+  batch->used += size;
+  batch->last_sequence = sequence;
+
+  objects[oid].insert(offset, Extent{length, position + start,
+                                     position + start, length});
+  schedule_flush();
+  return make_ready_future<uint64_t>(sequence);
+}
+
+void LogStore::schedule_flush()
+{
+  // a pass in progress schedules the next when it completes
+  if (flush_scheduled || flushing)
+    return;
+  flush_scheduled = true;
+  seastar::later().then([this] {
+      flush_scheduled = false;
+      flush_batches();
+    });
+}
+
+void LogStore::flush_batches()
+{
+  if (batches.empty() || failure)
+    return;
+  close_batch(batches.back());
+  flushing = batches.size();
+  const auto sequence = batches.back().last_sequence;
+
+  struct Write {
+    uint64_t position;
+    const char* data;
+    uint64_t length;
+  };
+  std::vector<Write> writes;
+  for (auto& batch : batches)
+    writes.push_back(Write{batch.position, batch.buf.get(),
+                           seastar::align_up(batch.used, block_size)});
+
+  seastar::parallel_for_each(writes.begin(), writes.end(),
+    [this] (const Write& w) {
+      return log.dma_write(w.position, w.data, w.length).then(
+        [length = w.length] (size_t written) {
+          if (written != length)
+            throw store_error(EIO);
+        });
+    }).then([this] {
+      return log.flush();
+    }).then_wrapped([this, sequence] (future<> f) {
+      try {
+        f.get();
+      } catch (...) {
+        // later records can't be replayed past these
+        fail(std::current_exception());
+        return;
+      }
+      flushes++;
+      committed = sequence;
+      for (; flushing; flushing--) {
+        auto& batch = batches.front();
+        if (batch.buf.size() == batch_size && spare.size() < 2)
+          spare.push_back(std::move(batch.buf));
+        batches.pop_front();
+      }
+      while (!waiters.empty() && waiters.begin()->first <= committed) {
+        waiters.begin()->second.set_value();
+        waiters.erase(waiters.begin());
+      }
+      // the writes that arrived during this pass go in the next
+      if (!batches.empty())
+        schedule_flush();
+    });
+}
+
+void LogStore::fail(std::exception_ptr eptr)
+{
+  if (!failure)
+    failure = eptr;
+  auto failed = std::move(waiters);
+  waiters.clear();
+  for (auto& w : failed)
+    w.second.set_exception(eptr);
+}
+
+future<> LogStore::commit(uint64_t sequence)
+{
+  if (sequence <= committed)
+    return now();
+  if (failure)
+    return make_exception_future<>(failure);
+  return waiters.emplace(sequence, promise<>())->second.get_future();
+}
+
+future<> LogStore::stop()
+{
+  return commit(next_sequence - 1).handle_exception([] (auto eptr) {
+      // the failure was reported to the commits
+    }).then([this] {
+      return log.close();
+    });
+}
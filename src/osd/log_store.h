@@ -0,0 +1,201 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <core/file.hh>
+
+#include "extent_cache.h"
+#include "extent_map.h"
+#include "store.h"
+
+namespace crimson {
+namespace osd {
+
+/// An append-only, log-structured object store for a single core, kept in a
+/// preallocated file that's read and written with direct I/O. Every write
+/// appends a record of its object's name, the offset and the data to the
+/// log, and an in-memory index maps each object to the extents of the log
+/// that hold its data. The index is rebuilt by replaying the log on open().
+///
+/// Records are packed into batches in memory, and a write is applied as
+/// soon as its record is in a batch: reads of records that haven't reached
+/// the log yet are served from their batch. Batches are committed by a
+/// single flusher. It writes every batch that has filled up since its last
+/// pass with one aligned write each, flushes the log once, and then
+/// completes every commit that was waiting on them. The flusher starts a
+/// pass as soon as the last one completes, so a batch collects whatever
+/// arrives during a flush: under load, the number of writes per flush
+/// grows with concurrency instead of the rate being capped by flush
+/// latency.
+///
+/// Reads go through an ExtentCache, which keeps whole extents of the log so
+/// that hot data is served from memory.
+///
+/// The first block of the log records the Layout it was created with, and
+/// open() refuses a log whose layout differs. Each core's log holds the
+/// objects of the placement groups that core owned, so replaying it under
+/// another layout would lose them.
+///
+/// Space in the log is never reclaimed. Once it's full, writes fail with
+/// ENOSPC. Writes to an object must not overlap in time, as the OSD's
+/// PGSequencer ensures.
+class LogStore : public ObjectStore {
+ public:
+  /// Batches are aligned to this for direct I/O
+  static constexpr uint64_t block_size = 4096;
+  /// Size of a batch's buffer, unless a record needs a larger one
+  static constexpr uint64_t batch_size = 1 << 20;
+
+  /// The shard a log belongs to, and the placement it was written under
+  struct Layout {
+    uint32_t shard{0};
+    uint32_t shard_count{1};
+    uint64_t placement{0}; //< digest of the owner of each placement group
+
+    bool operator==(const Layout& rhs) const {
+      return shard == rhs.shard && shard_count == rhs.shard_count &&
+             placement == rhs.placement;
+    }
+  };
+
+ private:
+  /// A run of an object's data in the log, within the data of one record
+  struct Extent {
+    uint64_t length;
+    uint64_t position; //< of the run in the log
+    uint64_t record; //< position of the record's data in the log
+    uint64_t record_length; //< of the record's data
+
+    uint64_t size() const { return length; }
+    Extent share(uint64_t skip, uint64_t count) const {
+      return Extent{count, position + skip, record, record_length};
+    }
+  };
+  ObjectIndex<ExtentMap<Extent>> objects;
+  ExtentCache cache;
+
+  const string path;
+  const uint64_t capacity; //< size of the log
+  const Layout layout;
+  seastar::file log;
+  /// every run of the log has its own generation, so that replay can tell
+  /// the records of this run from stale ones that follow them
+  uint64_t generation{1};
+  uint64_t tail{0}; //< position of the next batch
+  uint64_t next_sequence{1};
+
+  /// Records that aren't committed yet, in the order of the log
+  struct Batch {
+    temporary_buffer buf; //< block-aligned, and a whole number of blocks
+    uint64_t position; //< in the log
+    uint64_t used{0}; //< bytes of records in the buffer
+    uint64_t last_sequence{0};
+  };
+  /// Batches in log order. The first \a flushing of them are being written,
+  /// and only the last batch after those may take more records.
+  std::deque<Batch> batches;
+  size_t flushing{0};
+  bool flush_scheduled{false};
+  std::vector<temporary_buffer> spare; //< buffers of batch_size to reuse
+  uint64_t flushes{0}; //< passes of the flusher
+
+  /// commits waiting for the flusher, by sequence
+  std::multimap<uint64_t, promise<>> waiters;
+  uint64_t committed{0}; //< every record up to this sequence is flushed
+  std::exception_ptr failure; //< a write to the log failed
+
+  /// Check the layout in the log's header, or write it if the log is new
+  future<> check_header();
+
+  /// Replay the log from the start, and rebuild the index. Resolves with
+  /// the end of the last record replayed.
+  future<uint64_t> replay();
+
+  /// Zero the rest of the block that ends at the log's last good record.
+  /// A record torn across the block boundary would otherwise leave a
+  /// header there that the next replay reads once this run has written
+  /// the following blocks, and replay would stop at it.
+  future<> zero_after(uint64_t end);
+
+  /// Return a batch with room for a record of the given size, starting a
+  /// new one if the last is full or being written. Return null if the log
+  /// is full.
+  Batch* batch_for(uint64_t size);
+
+  /// Pad a batch to a whole block, and move the tail past it
+  void close_batch(Batch& batch);
+
+  /// Return the given range of the log, which is within a single record
+  future<temporary_buffer> read_log(uint64_t position, uint64_t length);
+
+  /// Return the given range of the log, which is within the given extent,
+  /// through the cache, which holds the data of whole records
+  future<temporary_buffer> read_extent(const Extent& extent, uint64_t position,
+                                       uint64_t length);
+
+  /// Run a pass of the flusher once this task's writes have been added
+  void schedule_flush();
+
+  /// Write and flush every batch, then complete the commits they satisfy
+  void flush_batches();
+
+  /// Fail this and every later write and commit
+  void fail(std::exception_ptr eptr);
+
+ public:
+  /// Keep the log in the file at \a path, which is created or extended to
+  /// \a capacity bytes, and cache up to \a cache_size bytes of it
+  LogStore(string path, uint64_t capacity, size_t cache_size = 0,
+           Layout layout = Layout{});
+
+  /// Open the log and replay it. Must resolve before the store is used.
+  /// Fails with EINVAL if the log was written under another layout.
+  future<> open();
+
+  /// Return the range as the pieces of the records that hold it, through
+  /// the cache, with buffers of zeroes for the holes between them
+  future<std::vector<temporary_buffer>> read_extents(
+      const ObjectName& oid, uint64_t offset, uint64_t length) override;
+
+  future<uint64_t> write(const ObjectName& oid, uint64_t offset,
+                         temporary_buffer&& data) override;
+
+  future<> commit(uint64_t sequence) override;
+
+  size_t size() const override { return objects.size(); }
+
+  /// Return the position of the next batch in the log
+  uint64_t get_tail() const { return tail; }
+
+  ExtentCache& get_cache() { return cache; }
+
+  /// Return the number of times the log has been flushed
+  uint64_t get_flushes() const { return flushes; }
+
+  future<> stop() override;
+};
+
+} // namespace osd
+} // namespace crimson
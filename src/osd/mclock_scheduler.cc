@@ -0,0 +1,194 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "mclock_scheduler.h"
+#include <algorithm>
+
+using namespace crimson;
+using namespace crimson::osd;
+
+MClockScheduler::MClockScheduler(size_t concurrency, ClientInfo default_info)
+  : concurrency(std::max<size_t>(concurrency, 1)),
+    default_info(default_info)
+{
+  wakeup.set_callback([this] { pump(); });
+}
+
+MClockScheduler::Client& MClockScheduler::get_client(client_id id)
+{
+  auto& c = clients[id];
+  if (!c) {
+    c = std::make_unique<Client>();
+    c->info = default_info;
+  }
+  return *c;
+}
+
+void MClockScheduler::set_client_info(client_id id, ClientInfo info)
+{
+  get_client(id).info = info;
+}
+
+void MClockScheduler::remove_client(client_id id)
+{
+  auto i = clients.find(id);
+  if (i == clients.end())
+    return;
+  auto& c = *i->second;
+  if (!c.queue.empty()) {
+    reservation_heap.erase(&c);
+    if (c.ready)
+      ready_heap.erase(&c);
+    else
+      limit_heap.erase(&c);
+    queued -= c.queue.size();
+    for (auto& op : c.queue)
+      op.dispatched.set_exception(std::runtime_error("client removed"));
+  }
+  clients.erase(i);
+}
+
+void MClockScheduler::tag(Client& c, double t, double cost,
+                          uint32_t delta, uint32_t rho)
+{
+  constexpr auto inf = std::numeric_limits<double>::infinity();
+  auto& info = c.info;
+  // reservation tags are stored with the client's offset added, so that
+  // raising the offset pulls all of them forward
+  double r = info.reservation > 0
+      ? std::max(c.prev_reservation - c.reservation_offset +
+                 rho * cost / info.reservation, t)
+      : inf;
+  double p = std::max(c.prev_proportion + delta * cost / info.weight, t);
+  double l = info.limit > 0
+      ? std::max(c.prev_limit + delta * cost / info.limit, t)
+      : t;
+  c.prev_reservation = r + c.reservation_offset;
+  c.prev_proportion = p;
+  c.prev_limit = l;
+  c.queue.push_back(Op{cost, c.prev_reservation, p, l, promise<Phase>()});
+}
+
+future<MClockScheduler::Phase> MClockScheduler::admit(client_id id,
+                                                      double cost,
+                                                      uint32_t delta,
+                                                      uint32_t rho)
+{
+  auto& c = get_client(id);
+  const auto t = now();
+  tag(c, t, cost, std::max(delta, 1u), std::max(rho, 1u));
+
+  if (queued == 0 && in_flight < concurrency) {
+    // nothing is waiting, so dispatch without queueing if the op is due
+    auto& op = c.head();
+    if (op.reservation - c.reservation_offset <= t ||
+        op.limit <= t) {
+      auto phase = op.reservation - c.reservation_offset <= t
+          ? Phase::reservation : Phase::priority;
+      if (phase == Phase::priority && c.info.reservation > 0)
+        c.reservation_offset += cost / c.info.reservation;
+      c.queue.pop_front();
+      in_flight++;
+      return make_ready_future<Phase>(phase);
+    }
+  }
+
+  auto f = c.queue.back().dispatched.get_future();
+  queued++;
+  if (c.queue.size() == 1) {
+    reservation_heap.push(&c);
+    c.ready = false;
+    limit_heap.push(&c);
+  }
+  pump();
+  return f;
+}
+
+void MClockScheduler::complete()
+{
+  in_flight--;
+  pump();
+}
+
+void MClockScheduler::dispatch(Client& c, Phase phase)
+{
+  auto op = std::move(c.queue.front());
+  c.queue.pop_front();
+  queued--;
+  in_flight++;
+  if (phase == Phase::priority && c.info.reservation > 0) {
+    // the op was served out of the client's share, so pull its later
+    // reservation tags forward
+    c.reservation_offset += op.cost / c.info.reservation;
+  }
+
+  if (c.queue.empty()) {
+    reservation_heap.erase(&c);
+    if (c.ready)
+      ready_heap.erase(&c);
+    else
+      limit_heap.erase(&c);
+  } else {
+    reservation_heap.update(&c);
+    // the next op is checked against the limit again
+    if (c.ready) {
+      ready_heap.erase(&c);
+      c.ready = false;
+      limit_heap.push(&c);
+    } else {
+      limit_heap.update(&c);
+    }
+  }
+  op.dispatched.set_value(phase);
+}
+
+void MClockScheduler::pump()
+{
+  while (queued > 0 && in_flight < concurrency) {
+    const auto t = now();
+    // ops whose reservation is due come first
+    if (reservation_heap.top()->head_reservation() <= t) {
+      dispatch(*reservation_heap.top(), Phase::reservation);
+      continue;
+    }
+    // then the ops within their limits, by proportion
+    while (!limit_heap.empty() && limit_heap.top()->head().limit <= t) {
+      auto c = limit_heap.top();
+      limit_heap.erase(c);
+      c->ready = true;
+      ready_heap.push(c);
+    }
+    if (!ready_heap.empty()) {
+      dispatch(*ready_heap.top(), Phase::priority);
+      continue;
+    }
+    // nothing is due, so wake up when the first op is
+    auto next = reservation_heap.top()->head_reservation();
+    if (!limit_heap.empty())
+      next = std::min(next, limit_heap.top()->head().limit);
+    auto when = clock_type::time_point(
+        std::chrono::duration_cast<clock_type::duration>(
+            std::chrono::duration<double>(next)));
+    wakeup.rearm(when);
+    break;
+  }
+}
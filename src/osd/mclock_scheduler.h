@@ -0,0 +1,246 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <core/circular_buffer.hh>
+#include <core/timer.hh>
+
+#include "crimson.h"
+
+namespace crimson {
+namespace osd {
+
+/// The quality of service that a client is given: a reservation of ops per
+/// second that it gets regardless of other clients, a weight for its share
+/// of the capacity left over, and a limit of ops per second that it never
+/// exceeds. A reservation or limit of 0 means none.
+struct ClientInfo {
+  double reservation{0};
+  double weight{1};
+  double limit{0};
+};
+
+/// A dmClock scheduler for the ops of a single core. Each op is tagged on
+/// arrival with reservation, proportion and limit tags as in mClock, spaced
+/// by its client's reservation, weight and limit. Ops whose reservation tag
+/// is due are dispatched first, in tag order. The remaining capacity goes to
+/// the ops within their limit, by proportion tag.
+///
+/// As in dmClock, a client of several servers passes \a delta, the ops that
+/// all servers completed for it since its last op here, and \a rho, the ops
+/// that completed in the reservation phase, so that its tags account for
+/// the service it got elsewhere. Both are 1 for a client of one server.
+///
+/// Clients are kept in indexed heaps by the tags of their first queued op,
+/// so that dispatch is O(log clients), and an op that arrives at an idle
+/// scheduler is dispatched without being queued.
+class MClockScheduler {
+ public:
+  using client_id = uint64_t;
+  using clock_type = std::chrono::steady_clock;
+
+  /// The phase in which an op was dispatched
+  enum class Phase { reservation, priority };
+
+ private:
+  struct Op {
+    double cost;
+    double reservation; //< before the client's reservation offset
+    double proportion;
+    double limit;
+    promise<Phase> dispatched;
+  };
+
+  /// heap slots: every client with queued ops is in the reservation heap,
+  /// and in either the limit heap or the ready heap
+  enum { reservation_slot, limit_slot, nr_slots };
+
+  struct Client {
+    ClientInfo info;
+    double prev_reservation{0}; //< tags of the last op to arrive, with the
+                                //< reservation offset added
+    double prev_proportion{0};
+    double prev_limit{0};
+    /// reservation tags are reduced by this much for the ops dispatched in
+    /// the priority phase, as in mClock, without visiting every queued op
+    double reservation_offset{0};
+    seastar::circular_buffer<Op> queue;
+    size_t heap_pos[nr_slots];
+    bool ready{false}; //< in the ready heap, because its first op is within
+                       //< its limit
+
+    const Op& head() const { return queue.front(); }
+    double head_reservation() const {
+      return head().reservation - reservation_offset;
+    }
+  };
+
+  /// A binary min-heap of clients that records each client's position in
+  /// the given slot, so that a client can be removed or repositioned when
+  /// its first op changes
+  template <size_t Slot, typename Less>
+  class ClientHeap {
+    std::vector<Client*> items;
+    Less less;
+
+    void place(size_t i, Client* c) {
+      items[i] = c;
+      c->heap_pos[Slot] = i;
+    }
+    void sift_up(size_t i) {
+      auto c = items[i];
+      while (i > 0) {
+        auto parent = (i - 1) / 2;
+        if (!less(c, items[parent]))
+          break;
+        place(i, items[parent]);
+        i = parent;
+      }
+      place(i, c);
+    }
+    void sift_down(size_t i) {
+      auto c = items[i];
+      for (;;) {
+        auto child = 2 * i + 1;
+        if (child >= items.size())
+          break;
+        if (child + 1 < items.size() && less(items[child + 1], items[child]))
+          child++;
+        if (!less(items[child], c))
+          break;
+        place(i, items[child]);
+        i = child;
+      }
+      place(i, c);
+    }
+
+   public:
+    bool empty() const { return items.empty(); }
+    Client* top() const { return items.front(); }
+
+    void push(Client* c) {
+      items.push_back(c);
+      sift_up(items.size() - 1);
+    }
+    void erase(Client* c) {
+      auto i = c->heap_pos[Slot];
+      auto last = items.back();
+      items.pop_back();
+      if (i == items.size())
+        return;
+      place(i, last);
+      update(last);
+    }
+    /// Restore the heap after the client's key changed
+    void update(Client* c) {
+      sift_up(c->heap_pos[Slot]);
+      sift_down(c->heap_pos[Slot]);
+    }
+  };
+
+  struct ReservationLess {
+    bool operator()(const Client* a, const Client* b) const {
+      return a->head_reservation() < b->head_reservation();
+    }
+  };
+  struct LimitLess {
+    bool operator()(const Client* a, const Client* b) const {
+      return a->head().limit < b->head().limit;
+    }
+  };
+  struct ProportionLess {
+    bool operator()(const Client* a, const Client* b) const {
+      return a->head().proportion < b->head().proportion;
+    }
+  };
+
+  size_t concurrency; //< ops that may run at once
+  ClientInfo default_info; //< for clients without their own
+  size_t in_flight{0};
+  size_t queued{0};
+  std::unordered_map<client_id, std::unique_ptr<Client>> clients;
+  ClientHeap<reservation_slot, ReservationLess> reservation_heap;
+  ClientHeap<limit_slot, LimitLess> limit_heap;
+  ClientHeap<limit_slot, ProportionLess> ready_heap;
+  seastar::timer<clock_type> wakeup; //< fires when a queued op comes due
+
+  static double now() {
+    return std::chrono::duration<double>(
+        clock_type::now().time_since_epoch()).count();
+  }
+
+  Client& get_client(client_id id);
+
+  /// Assign the tags of a new op of the given client
+  void tag(Client& c, double t, double cost, uint32_t delta, uint32_t rho);
+
+  /// Dispatch the first op of the client
+  void dispatch(Client& c, Phase phase);
+
+  /// Dispatch queued ops while there's capacity, and arm the wakeup timer
+  /// if the ops left aren't due yet
+  void pump();
+
+ public:
+  /// Run at most \a concurrency ops at once, and give clients without their
+  /// own ClientInfo the given one
+  MClockScheduler(size_t concurrency, ClientInfo default_info = ClientInfo());
+
+  /// Set the quality of service for a client
+  void set_client_info(client_id id, ClientInfo info);
+
+  /// Forget a client, failing its queued ops
+  void remove_client(client_id id);
+
+  /// Queue an op of the given client, and resolve once it may run with the
+  /// phase in which it was dispatched. complete() must be called when the
+  /// op finishes.
+  future<Phase> admit(client_id id, double cost = 1,
+                      uint32_t delta = 1, uint32_t rho = 1);
+
+  /// Finish an op that was admitted
+  void complete();
+
+  /// Run \a func once admitted, and complete the op when the future it
+  /// returns resolves. \a func is called with the dispatch phase.
+  template <typename Func>
+  auto schedule(client_id id, uint32_t delta, uint32_t rho, Func&& func) {
+    return admit(id, 1, delta, rho).then(
+      [this, func = std::forward<Func>(func)] (Phase phase) mutable {
+        return make_ready_future<Phase>(phase).then(std::move(func)).finally(
+          [this] {
+            complete();
+          });
+      });
+  }
+
+  /// Return the number of ops waiting to be dispatched
+  size_t waiting() const { return queued; }
+};
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,96 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "memory_store.h"
+#include <core/align.hh>
+#include <algorithm>
+#include <system_error>
+
+using namespace crimson;
+using namespace crimson::osd;
+
+constexpr size_t MemoryStore::alignment;
+constexpr size_t MemoryStore::merge_limit;
+
+namespace {
+
+std::system_error store_error(int error)
+{
+  return std::system_error(error, std::system_category());
+}
+
+} // anonymous namespace
+
+future<std::vector<temporary_buffer>>
+MemoryStore::read_extents(const ObjectName& oid, uint64_t offset,
+                          uint64_t length)
+{
+  auto found = objects.find(oid);
+  if (!found)
+    return make_exception_future<std::vector<temporary_buffer>>(
+        store_error(ENOENT));
+
+  auto& object = *found;
+  std::vector<temporary_buffer> result;
+  if (offset >= object.size() || length == 0)
+    return make_ready_future<std::vector<temporary_buffer>>(std::move(result));
+  length = std::min(length, object.size() - offset);
+
+  uint64_t position = 0; // end of the last extent in the range
+  object.for_each(offset, length,
+    [&result, &position] (uint64_t at, temporary_buffer& extent,
+                          uint64_t skip, uint64_t count) {
+      if (at > position)
+        result.push_back(zero_buffer(at - position));
+      result.push_back(extent.share(skip, count));
+      position = at + count;
+    });
+  if (position < length)
+    result.push_back(zero_buffer(length - position));
+  return make_ready_future<std::vector<temporary_buffer>>(std::move(result));
+}
+
+future<uint64_t> MemoryStore::write(const ObjectName& oid, uint64_t offset,
+                                    temporary_buffer&& data)
+{
+  if (!in_bounds(offset, data.size()))
+    return make_exception_future<uint64_t>(store_error(EFBIG));
+  auto& object = objects[oid];
+  uint64_t start = 0;
+  auto prev = data.size() && data.size() < merge_limit ?
+      object.ending_at(offset, start) : nullptr;
+  if (prev && prev->size() + data.size() <= merge_limit) {
+    // copy the extent and the write into one buffer, which replaces the
+    // extent. reads may share the extent, so it can't be extended in place
+    const auto length = prev->size() + data.size();
+    auto merged = temporary_buffer::aligned(
+        alignment, seastar::align_up<uint64_t>(length, alignment));
+    auto p = std::copy(prev->get(), prev->get() + prev->size(),
+                       merged.get_write());
+    std::copy(data.get(), data.get() + data.size(), p);
+    merged.trim(length);
+    object.insert(start, std::move(merged));
+  } else {
+    object.insert(offset, std::move(data));
+  }
+  return make_ready_future<uint64_t>(0);
+}
@@ -0,0 +1,75 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <vector>
+#include <core/future.hh>
+
+#include "extent_map.h"
+#include "store.h"
+
+namespace crimson {
+namespace osd {
+
+/// An in-memory object store for a single core. Nothing is persisted, so a
+/// write is committed as soon as it is applied.
+///
+/// Each object is an ExtentMap of the buffers it was written with. A write
+/// keeps its buffer without copying it, and an overwrite only trims the
+/// extents it replaces, so buffers are never modified once written and
+/// reads can share them.
+class MemoryStore : public ObjectStore {
+  ObjectIndex<ExtentMap<temporary_buffer>> objects;
+
+ public:
+  /// Buffers that the store allocates are word-aligned, so that replies can
+  /// reference them directly
+  static constexpr size_t alignment = 8;
+  /// A write smaller than this that extends an extent smaller than this is
+  /// merged with it into one buffer, so that objects written in small
+  /// appends don't fragment into many extents
+  static constexpr size_t merge_limit = 64 << 10;
+
+  /// Return the range as a list of buffers that share the object's extents,
+  /// with buffers of zeroes for the holes between them
+  future<std::vector<temporary_buffer>> read_extents(
+      const ObjectName& oid, uint64_t offset, uint64_t length) override;
+
+  /// Every write has sequence number 0
+  future<uint64_t> write(const ObjectName& oid, uint64_t offset,
+                         temporary_buffer&& data) override;
+
+  future<> commit(uint64_t sequence) override { return now(); }
+
+  size_t size() const override { return objects.size(); }
+
+  /// Return the number of extents that hold the object's data
+  size_t extent_count(const ObjectName& oid) {
+    auto object = objects.find(oid);
+    return object ? object->extent_count() : 0;
+  }
+
+  future<> stop() override { return now(); }
+};
+
+} // namespace osd
+} // namespace crimson
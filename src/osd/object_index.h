@@ -0,0 +1,238 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "crimson.h"
+#include "placement.h"
+
+namespace crimson {
+namespace osd {
+
+/// The name of an object, with its object_hash(). It refers to the name
+/// rather than copying it, so that names can be looked up where they are in
+/// a request. The name must outlive it.
+struct ObjectName {
+  const char* data;
+  size_t size;
+  uint64_t hash;
+
+  ObjectName(const char* data, size_t size, uint64_t hash)
+    : data(data), size(size), hash(hash) {}
+  ObjectName(const char* data, size_t size)
+    : ObjectName(data, size, object_hash(data, size)) {}
+  ObjectName(const char* name) : ObjectName(name, std::strlen(name)) {}
+  ObjectName(const string& name) : ObjectName(name.data(), name.size()) {}
+};
+
+/// A core's objects, keyed by name. This is an open-addressing hash table
+/// laid out as a Swiss table: slots are split into groups of 16, each with
+/// a control byte per slot that holds 7 bits of the slot's hash, or marks
+/// it empty. A lookup compares a whole group's control bytes at once, and
+/// only compares the names of the slots that match, which is rarely more
+/// than the one it's looking for.
+///
+/// Names are copied into an arena of large chunks rather than allocated
+/// one by one. Values are kept out of line, in the order they were
+/// inserted, so that a slot is 24 bytes however large the value, and empty
+/// slots don't hold one. An object costs its name, its value, a slot and a
+/// control byte.
+///
+/// Growing rehashes every slot at once, in the task that inserts. Values
+/// don't move, but with millions of objects the rehash still stalls the
+/// reactor for milliseconds. Objects are never removed, since the stores
+/// have no way to remove them.
+template <typename T>
+class ObjectIndex {
+ public:
+  /// Slots per group
+  static constexpr size_t group_size = 16;
+  /// Names are copied into chunks of this size. Larger names get a chunk
+  /// of their own.
+  static constexpr size_t chunk_size = 64 << 10;
+
+ private:
+  static constexpr uint8_t empty = 0x80;
+
+  struct Slot {
+    uint64_t hash;
+    const char* name; //< in the arena
+    uint32_t name_size;
+    uint32_t value; //< index in values
+  };
+  static_assert(sizeof(Slot) == 24, "a slot should hold no padding");
+  std::vector<uint8_t> control; //< per slot: empty, or a tag of its hash
+  std::vector<Slot> slots;
+  std::deque<T> values; //< which don't move as it grows
+
+  std::vector<std::unique_ptr<char[]>> chunks; //< the arena
+  char* chunk_pos{nullptr};
+  size_t chunk_left{0};
+
+  /// Placement groups take the low bits of the hash, and all of a core's
+  /// objects share some of them, so the table uses the high bits
+  static uint8_t tag(uint64_t hash) { return hash >> 57; }
+  static size_t first_group(uint64_t hash) { return hash >> 10; }
+
+  /// Return a mask with a bit set for each slot of the group whose control
+  /// byte is \a value
+  static uint32_t match(const uint8_t* group, uint8_t value) {
+#ifdef __SSE2__
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < group_size; i++)
+      if (group[i] == value)
+        mask |= 1u << i;
+    return mask;
+#endif
+  }
+
+  /// Call func(slot index, mask of empty slots) for each group in the
+  /// probe sequence of \a hash, until it returns true
+  template <typename Func>
+  void probe(uint64_t hash, Func&& func) const {
+    const size_t groups = slots.size() / group_size;
+    size_t group = first_group(hash) & (groups - 1);
+    // triangular steps visit every group of a power-of-two table
+    for (size_t step = 1; ; group = (group + step++) & (groups - 1)) {
+      if (func(group * group_size,
+               match(&control[group * group_size], empty)))
+        return;
+    }
+  }
+
+  Slot* find_slot(const ObjectName& name) {
+    if (slots.empty())
+      return nullptr;
+    Slot* found = nullptr;
+    const auto t = tag(name.hash);
+    probe(name.hash, [&] (size_t base, uint32_t empties) {
+        for (auto m = match(&control[base], t); m; m &= m - 1) {
+          auto& slot = slots[base + __builtin_ctz(m)];
+          if (slot.hash == name.hash && slot.name_size == name.size &&
+              std::equal(name.data, name.data + name.size, slot.name)) {
+            found = &slot;
+            return true;
+          }
+        }
+        // a probe ends at the first group with an empty slot, because the
+        // name would have been inserted there
+        return empties != 0;
+      });
+    return found;
+  }
+
+  /// Return an empty slot for \a hash, and mark it used
+  Slot& claim_slot(uint64_t hash) {
+    Slot* claimed = nullptr;
+    probe(hash, [&] (size_t base, uint32_t empties) {
+        if (!empties)
+          return false;
+        const auto i = base + __builtin_ctz(empties);
+        control[i] = tag(hash);
+        claimed = &slots[i];
+        return true;
+      });
+    return *claimed;
+  }
+
+  void grow() {
+    const size_t capacity = std::max(group_size, slots.size() * 2);
+    auto old_slots = std::move(slots);
+    auto old_control = std::move(control);
+    slots = std::vector<Slot>(capacity);
+    control.assign(capacity, empty);
+    for (size_t i = 0; i < old_slots.size(); i++) {
+      if (old_control[i] != empty)
+        claim_slot(old_slots[i].hash) = old_slots[i];
+    }
+  }
+
+  const char* intern(const char* name, size_t size) {
+    if (size > chunk_size / 4) {
+      chunks.emplace_back(new char[size]);
+      return std::copy(name, name + size, chunks.back().get()) - size;
+    }
+    if (size > chunk_left) {
+      chunks.emplace_back(new char[chunk_size]);
+      chunk_pos = chunks.back().get();
+      chunk_left = chunk_size;
+    }
+    auto p = chunk_pos;
+    std::copy(name, name + size, p);
+    chunk_pos += size;
+    chunk_left -= size;
+    return p;
+  }
+
+ public:
+  /// Return the object's value, or null if there's no such object
+  T* find(const ObjectName& name) {
+    auto slot = find_slot(name);
+    return slot ? &values[slot->value] : nullptr;
+  }
+
+  /// Return the object's value, inserting a default one if there's no such
+  /// object. The reference stays valid as other objects are inserted.
+  T& operator[](const ObjectName& name) {
+    if (auto slot = find_slot(name))
+      return values[slot->value];
+    // keep the table at most 7/8 full, so that probes stay short
+    if ((values.size() + 1) * 8 > slots.size() * 7)
+      grow();
+    // claim the slot last, so that it never refers to a missing value
+    const auto interned = intern(name.data, name.size);
+    values.emplace_back();
+    auto& slot = claim_slot(name.hash);
+    slot.hash = name.hash;
+    slot.name = interned;
+    slot.name_size = name.size;
+    slot.value = values.size() - 1;
+    return values.back();
+  }
+
+  /// Return the number of objects
+  size_t size() const { return values.size(); }
+
+  /// Return the number of slots
+  size_t capacity() const { return slots.size(); }
+};
+
+template <typename T>
+constexpr size_t ObjectIndex<T>::group_size;
+template <typename T>
+constexpr size_t ObjectIndex<T>::chunk_size;
+template <typename T>
+constexpr uint8_t ObjectIndex<T>::empty;
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,753 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "osd.h"
+#include "pg_sequencer.h"
+#include "placement.h"
+#include "write_stages.h"
+#include "msg/message_pool.h"
+#include "msg/segment_reader.h"
+#include "crimson.capnp.h"
+#include <boost/range/irange.hpp>
+#include <capnp/message.h>
+#include <core/future-util.hh>
+#include <core/reactor.hh>
+#include <system_error>
+
+using namespace crimson;
+using namespace crimson::osd;
+
+constexpr uint64_t OSD::max_read_length;
+constexpr size_t OSD::max_write_streams;
+constexpr size_t OSD::max_batch_ops;
+
+namespace {
+
+using MessageBuilderPtr = OSD::MessageBuilderPtr;
+using buffer_ptr = seastar::foreign_ptr<std::unique_ptr<temporary_buffer>>;
+using extents_t = std::vector<temporary_buffer>;
+using extents_ptr = seastar::foreign_ptr<std::unique_ptr<extents_t>>;
+
+/// Start a reply message with the given sequence
+proto::Message::Builder init_reply(capnp::MessageBuilder& message,
+                                   uint32_t sequence)
+{
+  auto root = message.initRoot<proto::Message>();
+  root.initHeader().setSequence(sequence);
+  return root;
+}
+
+inline capnp::Data::Reader data_reader(const temporary_buffer& buf)
+{
+  return {reinterpret_cast<const capnp::byte*>(buf.get()), buf.size()};
+}
+
+/// Bytes of a reply message that aren't data, for sizing its first segment
+constexpr size_t reply_overhead = 64;
+
+/// Reads smaller than this are copied into the reply, because it's cheaper
+/// than sending their data as a separate segment
+constexpr size_t zero_copy_threshold = 4096;
+
+uint64_t total_size(const extents_t& extents)
+{
+  uint64_t total = 0;
+  for (auto& e : extents)
+    total += e.size();
+  return total;
+}
+
+/// Return the bytes of the extents that set_read_data() copies into the
+/// message, for sizing its first segment
+size_t copied_size(const extents_t& extents)
+{
+  const auto total = total_size(extents);
+  if (total < zero_copy_threshold)
+    return total;
+  size_t copied = 0;
+  if (extents.size() > 1) {
+    for (auto& e : extents)
+      copied += e.size() < zero_copy_threshold ? e.size() : 0;
+  }
+  return copied;
+}
+
+/// Set the data of a read reply from the extents that hold it. Small data
+/// is copied into the message. Otherwise the message references a single
+/// extent as its data, or the pieces of several as its extents, so that
+/// the store's buffers are sent without gathering them.
+void set_read_data(net::BufferMessageBuilder& message,
+                   proto::osd::read::Res::Builder res, extents_t&& extents)
+{
+  const auto total = total_size(extents);
+  if (total < zero_copy_threshold) {
+    auto p = res.initData(total).begin();
+    for (auto& e : extents)
+      p = std::copy(e.get(), e.get() + e.size(), p);
+  } else if (extents.size() == 1) {
+    res.adoptData(message.reference_data(std::move(extents.front())));
+  } else {
+    auto pieces = res.initExtents(extents.size());
+    for (size_t i = 0; i < extents.size(); i++) {
+      if (extents[i].size() < zero_copy_threshold)
+        pieces.set(i, data_reader(extents[i]));
+      else
+        pieces.adopt(i, message.reference_data(std::move(extents[i])));
+    }
+  }
+}
+
+MessageBuilderPtr read_reply(uint32_t sequence, uint64_t offset,
+                             extents_t&& extents, bool more = false)
+{
+  auto message = net::make_message(copied_size(extents) + reply_overhead);
+  auto reply = init_reply(*message, sequence).initOsdReadReply();
+  reply.setOffset(offset);
+  reply.setMore(more);
+  set_read_data(*message, reply, std::move(extents));
+  return std::move(message);
+}
+
+/// Wrap a buffer from another core in a local temporary_buffer, whose
+/// deleter sends it back to its own core
+temporary_buffer adopt_foreign(buffer_ptr&& buf)
+{
+  auto p = buf->get_write();
+  auto size = buf->size();
+  return temporary_buffer(p, size, seastar::make_deleter(seastar::deleter(),
+                                      [buf = std::move(buf)] {}));
+}
+
+/// Wrap extents from another core in local temporary_buffers, which send
+/// them back to their own core once they're all released
+extents_t adopt_foreign(extents_ptr&& foreign)
+{
+  auto owner = make_lw_shared<extents_ptr>(std::move(foreign));
+  extents_t extents;
+  extents.reserve((*owner)->size());
+  for (auto& e : **owner)
+    extents.emplace_back(e.get_write(), e.size(),
+        seastar::make_deleter(seastar::deleter(), [owner] {}));
+  return extents;
+}
+
+MessageBuilderPtr read_error(uint32_t sequence, int error)
+{
+  auto message = net::make_message();
+  init_reply(*message, sequence).initOsdReadReply().setErrorCode(error);
+  return std::move(message);
+}
+
+MessageBuilderPtr write_reply(uint32_t sequence, uint32_t flags)
+{
+  auto message = net::make_message();
+  init_reply(*message, sequence).initOsdWriteReply().setFlags(flags);
+  return std::move(message);
+}
+
+MessageBuilderPtr write_error(uint32_t sequence, int error)
+{
+  auto message = net::make_message();
+  init_reply(*message, sequence).initOsdWriteReply().setErrorCode(error);
+  return std::move(message);
+}
+
+/// Return the error for a read of the given range, or 0 if it's within the
+/// OSD's limits
+uint32_t check_read(uint64_t offset, uint64_t length)
+{
+  if (offset + length < offset || length > OSD::max_read_length)
+    return EINVAL;
+  return 0;
+}
+
+/// Return the error for a write of the given range, or 0 if it's within the
+/// store's limits
+uint32_t check_write(uint64_t offset, uint64_t length)
+{
+  if (offset + length < offset)
+    return EINVAL;
+  return ObjectStore::in_bounds(offset, length) ? 0 : EFBIG;
+}
+
+/// Read from the core that owns the object, in its placement group's order.
+/// Errors from the store fail the returned future with a std::system_error.
+/// The name must outlive the returned future.
+future<extents_t> read_data(seastar::distributed<Store>& store,
+                            ObjectName name, uint64_t offset, uint64_t length)
+{
+  auto pg = object_pg(name.hash);
+  auto cpu = pg_shard(pg);
+
+  if (auto error = check_read(offset, length))
+    return make_exception_future<extents_t>(
+        std::system_error(error, std::system_category()));
+
+  if (cpu == engine().cpu_id()) {
+    // we own the object, so skip the hop
+    return PGSequencer::local().with_pg(pg, false,
+      [&store, name, offset, length] {
+        return store.local().read_extents(name, offset, length);
+      });
+  }
+
+  return store.invoke_on(cpu, [name, pg, offset, length] (Store& s) {
+      return PGSequencer::local().with_pg(pg, false,
+        [&s, name, offset, length] {
+          return s.read_extents(name, offset, length).then(
+            [] (extents_t extents) {
+              return seastar::make_foreign(
+                  std::make_unique<extents_t>(std::move(extents)));
+            });
+        });
+    }).then([] (extents_ptr extents) {
+      return adopt_foreign(std::move(extents));
+    });
+}
+
+future<extents_t> read_data(seastar::distributed<Store>& store,
+                            proto::osd::read::Args::Reader args)
+{
+  auto oid = args.getObject();
+  // the request is held by our caller until the reply is ready, so the
+  // store can look up the name in place, even from another core
+  return read_data(store, ObjectName(oid.begin(), oid.size()),
+                   args.getOffset(), args.getLength());
+}
+
+future<MessageBuilderPtr> osd_read(seastar::distributed<Store>& store,
+                                   uint32_t sequence,
+                                   proto::osd::read::Args::Reader args)
+{
+  auto offset = args.getOffset();
+  return read_data(store, args).then_wrapped(
+    [sequence, offset] (future<extents_t> f) {
+      try {
+        return read_reply(sequence, offset, std::move(std::get<0>(f.get())));
+      } catch (std::system_error& e) {
+        return read_error(sequence, e.code().value());
+      }
+    });
+}
+
+/// Send the data of a read in replies of at most chunkSize bytes. Each
+/// chunk is read from the store once the connection has taken the reply
+/// before it, so only one chunk of the stream is held at a time, and a
+/// write that lands between two chunks is seen by the later one. The
+/// stream ends early at the end of the object, or at the first error.
+future<> read_stream(seastar::distributed<Store>& store,
+                     uint32_t sequence,
+                     proto::osd::read::Args::Reader args,
+                     OSD::ReplyFunc send)
+{
+  auto oid = args.getObject();
+  // the request is held by our caller until the last reply is sent
+  const ObjectName name(oid.begin(), oid.size());
+  const uint64_t offset = args.getOffset();
+  const uint64_t end = offset + args.getLength();
+  const uint64_t chunk_size = args.getChunkSize();
+  if (end < offset)
+    return send(read_error(sequence, EINVAL));
+
+  auto pos = make_lw_shared<uint64_t>(offset);
+  return seastar::repeat([&store, sequence, name, end, chunk_size, send, pos] {
+      const auto n = std::min(chunk_size, end - *pos);
+      return read_data(store, name, *pos, n).then_wrapped(
+        [sequence, end, send, pos, n] (future<extents_t> f) {
+          extents_t data;
+          try {
+            data = std::move(std::get<0>(f.get()));
+          } catch (std::system_error& e) {
+            return send(read_error(sequence, e.code().value())).then([] {
+                return seastar::stop_iteration::yes;
+              });
+          }
+          // a short chunk ends at the end of the object
+          const bool more = total_size(data) == n && *pos + n < end;
+          auto reply = read_reply(sequence, *pos, std::move(data), more);
+          *pos += n;
+          return send(std::move(reply)).then([more] {
+              return more ? seastar::stop_iteration::no
+                          : seastar::stop_iteration::yes;
+            });
+        });
+    });
+}
+
+/// Write to this core's store through its WriteStages, in the placement
+/// group's order, and return the write's sequence number once it's applied.
+/// The name must outlive the returned future.
+///
+/// The write takes its place in the placement group's order as it arrives,
+/// but only holds the group while the store applies it: pre_apply() runs
+/// while it waits for the ops before it, and post_apply() once it has
+/// released the group. Later writes to the group are ordered behind it
+/// without waiting out its simulated delays.
+future<uint64_t> stage_write(Store& s, uint32_t pg, ObjectName name,
+                             uint64_t offset, temporary_buffer&& buf)
+{
+  auto& stages = WriteStages::local();
+  auto& sequencer = PGSequencer::local();
+  return seastar::when_all(stages.pre_apply(), sequencer.admit(pg, true)).then(
+    [&s, &sequencer, pg, name, offset, buf = std::move(buf)]
+        (std::tuple<future<>, future<>> results) mutable {
+      // admission doesn't fail, and from here the write holds the group
+      std::get<1>(results).get();
+      auto& pre_applied = std::get<0>(results);
+      if (pre_applied.failed()) {
+        sequencer.release(pg, true);
+        return make_exception_future<uint64_t>(pre_applied.get_exception());
+      }
+      return s.write(name, offset, std::move(buf)).finally(
+        [&sequencer, pg] {
+          sequencer.release(pg, true);
+        });
+    }).then([&stages] (uint64_t sequence) {
+      return stages.post_apply().then([sequence] {
+          return sequence;
+        });
+    });
+}
+
+/// Wait for a write applied by stage_write() to pass the commit stage and
+/// be committed by the store. This runs outside the placement group's
+/// order, so that its latency overlaps the ops queued behind the write.
+future<> stage_commit(Store& s, uint64_t sequence)
+{
+  return seastar::when_all(WriteStages::local().commit(),
+                           s.commit(sequence)).then(
+    [] (std::tuple<future<>, future<>> results) {
+      std::get<0>(results).get();
+      std::get<1>(results).get();
+    });
+}
+
+/// A write that has been applied on the core that owns its object
+struct AppliedWrite {
+  uint32_t error; //< from the store, or 0 on success
+  unsigned cpu; //< the core that owns the object
+  uint64_t sequence; //< of the write in that core's store
+};
+
+/// Apply a write on the core that owns the object, in its placement group's
+/// order and through its WriteStages
+future<AppliedWrite> apply_write(seastar::distributed<Store>& store,
+                                 capnp::MessageReader& request,
+                                 proto::osd::write::Args::Reader args)
+{
+  auto oid = args.getObject();
+  // the request is held by our caller until the write is applied
+  const ObjectName name(oid.begin(), oid.size());
+  auto pg = object_pg(name.hash);
+  auto cpu = pg_shard(pg);
+  auto offset = args.getOffset();
+  auto data = args.getData();
+
+  if (args.getLength() != data.size())
+    return make_ready_future<AppliedWrite>(AppliedWrite{EINVAL, cpu, 0});
+  if (auto error = check_write(offset, data.size()))
+    return make_ready_future<AppliedWrite>(AppliedWrite{error, cpu, 0});
+
+  // the store keeps large writes in the buffers they were received in.
+  // small writes are copied, so they don't pin a whole network buffer
+  auto buf = data.size() >= zero_copy_threshold
+      ? net::share_data(request, data)
+      : net::copy_data(data);
+
+  auto applied = [&] {
+    if (cpu == engine().cpu_id()) {
+      return stage_write(store.local(), pg, name, offset, std::move(buf));
+    }
+    return store.invoke_on(cpu,
+      [name, pg, offset,
+       buf = seastar::make_foreign(std::make_unique<temporary_buffer>(
+               std::move(buf)))] (Store& s) mutable {
+        return stage_write(s, pg, name, offset, adopt_foreign(std::move(buf)));
+      });
+  }();
+  return applied.then_wrapped([cpu] (future<uint64_t> f) {
+      try {
+        return AppliedWrite{0, cpu, std::get<0>(f.get())};
+      } catch (std::system_error& e) {
+        return AppliedWrite{static_cast<uint32_t>(e.code().value()), cpu, 0};
+      }
+    });
+}
+
+/// Wait for an applied write to be committed on the core that owns its
+/// object, and return the error code from the store, or 0 on success
+future<uint32_t> commit_write(seastar::distributed<Store>& store,
+                              AppliedWrite write)
+{
+  if (write.error)
+    return make_ready_future<uint32_t>(write.error);
+  auto committed = write.cpu == engine().cpu_id()
+      ? stage_commit(store.local(), write.sequence)
+      : store.invoke_on(write.cpu, [sequence = write.sequence] (Store& s) {
+          return stage_commit(s, sequence);
+        });
+  return committed.then_wrapped([] (future<> f) {
+      try {
+        f.get();
+        return 0u;
+      } catch (std::system_error& e) {
+        return static_cast<uint32_t>(e.code().value());
+      }
+    });
+}
+
+future<MessageBuilderPtr> osd_write(seastar::distributed<Store>& store,
+                                    uint32_t sequence,
+                                    capnp::MessageReader& request,
+                                    proto::osd::write::Args::Reader args)
+{
+  // a single reply acknowledges the commit along with the apply
+  auto flags = args.getFlags();
+  return apply_write(store, request, args).then(
+    [&store, flags] (AppliedWrite write) {
+      if (flags & proto::osd::write::ON_COMMIT)
+        return commit_write(store, write);
+      return make_ready_future<uint32_t>(write.error);
+    }).then([sequence, flags] (uint32_t error) {
+      return error ? write_error(sequence, error)
+                   : write_reply(sequence, flags);
+    });
+}
+
+/// Apply one chunk of a write, which may be the only one. Once the last
+/// chunk has arrived and every chunk has been applied, reply to the write.
+/// A write that asks for both onApply and onCommit gets a reply for each.
+future<> write_chunk(seastar::distributed<Store>& store,
+                     uint32_t sequence,
+                     capnp::MessageReader& request,
+                     proto::osd::write::Args::Reader args,
+                     OSD::Session& session,
+                     OSD::ReplyFunc send)
+{
+  auto i = session.writes.find(sequence);
+  if (i == session.writes.end()) {
+    if (args.getMore() && session.writes.size() >= OSD::max_write_streams)
+      return send(write_error(sequence, EBUSY));
+    i = session.writes.emplace(sequence, OSD::Session::WriteStream()).first;
+  }
+  auto& stream = i->second;
+  stream.pending++;
+  if (!args.getMore()) {
+    stream.last = true;
+    stream.flags = args.getFlags();
+  }
+  return apply_write(store, request, args).then_wrapped(
+    [&store, &session, sequence, send] (future<AppliedWrite> f) {
+      AppliedWrite write{EIO, 0, 0};
+      try {
+        write = std::get<0>(f.get());
+      } catch (...) {
+      }
+      auto i = session.writes.find(sequence);
+      auto& stream = i->second;
+      if (!stream.error)
+        stream.error = write.error;
+      // chunks may go to objects on different cores, and committing the
+      // latest chunk on a core commits every chunk before it there
+      if (!write.error) {
+        auto& latest = stream.sequences[write.cpu];
+        latest = std::max(latest, write.sequence);
+      }
+      if (--stream.pending || !stream.last)
+        return now();
+      const auto done = std::move(stream);
+      session.writes.erase(i);
+      if (done.error)
+        return send(write_error(sequence, done.error));
+      if (!(done.flags & proto::osd::write::ON_COMMIT))
+        return send(write_reply(sequence, done.flags));
+
+      std::vector<future<uint32_t>> commits;
+      for (auto& latest : done.sequences)
+        commits.push_back(commit_write(store,
+            AppliedWrite{0, latest.first, latest.second}));
+      auto committed = seastar::when_all(commits.begin(), commits.end()).then(
+        [] (std::vector<future<uint32_t>> results) {
+          uint32_t error = 0;
+          for (auto& result : results) {
+            auto e = std::get<0>(result.get());
+            if (!error)
+              error = e;
+          }
+          return error;
+        });
+      auto applied = done.flags & proto::osd::write::ON_APPLY
+          ? send(write_reply(sequence, proto::osd::write::ON_APPLY))
+          : now();
+      return seastar::when_all(std::move(applied), std::move(committed)).then(
+        [sequence, send] (std::tuple<future<>, future<uint32_t>> results) {
+          std::get<0>(results).get();
+          auto error = std::get<0>(std::get<1>(results).get());
+          return send(error ? write_error(sequence, error)
+                            : write_reply(sequence,
+                                          proto::osd::write::ON_COMMIT));
+        });
+    });
+}
+
+/// An op of a batch, as executed on the core that owns its object
+struct ShardOp {
+  size_t index; //< position in the batch
+  uint32_t pg;
+  bool write;
+  ObjectName name; //< points into the request, which the caller holds
+  uint64_t offset;
+  uint64_t length;
+  buffer_ptr data; //< for writes
+  bool wait_commit; //< for writes
+};
+
+/// The result of an op of a batch
+struct ShardResult {
+  size_t index;
+  uint32_t error;
+  extents_ptr data; //< for reads
+};
+
+/// Execute a shard's ops of a batch on the core that owns them. The ops are
+/// queued to their placement groups in batch order before any of them run.
+future<std::vector<ShardResult>> execute_ops(Store& store,
+                                             std::vector<ShardOp>&& ops)
+{
+  struct State {
+    std::vector<ShardOp> ops;
+    std::vector<ShardResult> results;
+  };
+  auto state = make_lw_shared<State>();
+  state->ops = std::move(ops);
+  state->results.resize(state->ops.size());
+
+  std::vector<future<>> running;
+  running.reserve(state->ops.size());
+  for (size_t i = 0; i < state->ops.size(); i++) {
+    auto& op = state->ops[i];
+    state->results[i].index = op.index;
+    auto record_error = [state, i] (future<> f) {
+      try {
+        f.get();
+      } catch (std::system_error& e) {
+        state->results[i].error = e.code().value();
+      } catch (...) {
+        state->results[i].error = EIO;
+      }
+    };
+    if (op.write) {
+      // writes take their place in the pg's order as they are staged
+      running.push_back(stage_write(store, op.pg, op.name, op.offset,
+          adopt_foreign(std::move(op.data))).then(
+        [&store, wait_commit = op.wait_commit] (uint64_t sequence) {
+          return wait_commit ? stage_commit(store, sequence) : now();
+        }).then_wrapped(record_error));
+      continue;
+    }
+    running.push_back(PGSequencer::local().with_pg(op.pg, false,
+      [&store, state, i] {
+        auto& op = state->ops[i];
+        return store.read_extents(op.name, op.offset, op.length);
+      }).then([state, i] (extents_t data) {
+        state->results[i].data = seastar::make_foreign(
+            std::make_unique<extents_t>(std::move(data)));
+      }).then_wrapped(record_error));
+  }
+  return seastar::when_all(running.begin(), running.end()).then(
+    [state] (std::vector<future<>>) {
+      return std::move(state->results);
+    });
+}
+
+/// Execute the ops of a batch with a single pass over each core that owns
+/// any of their objects, and reply to them all in one message
+future<MessageBuilderPtr> osd_batch(seastar::distributed<Store>& store,
+                                    uint32_t sequence,
+                                    capnp::MessageReader& request,
+                                    capnp::List<proto::Op>::Reader ops)
+{
+  const size_t count = ops.size();
+  // refuse a batch that would make us buffer more than a single read, or
+  // that holds an op we don't know, before any of its ops run
+  auto refuse = [] (int error, const char* what) {
+    return make_exception_future<MessageBuilderPtr>(
+        std::system_error(error, std::system_category(), what));
+  };
+  if (count > OSD::max_batch_ops)
+    return refuse(E2BIG, "batch has too many ops");
+  uint64_t read_length = 0;
+  for (auto op : ops) {
+    if (op.isOsdRead()) {
+      const auto length = op.getOsdRead().getLength();
+      if (length > OSD::max_read_length - read_length)
+        return refuse(E2BIG, "batch reads too much");
+      read_length += length;
+    } else if (!op.isOsdWrite()) {
+      return refuse(EINVAL, "unknown op in batch");
+    }
+  }
+
+  auto results = make_lw_shared<std::vector<ShardResult>>(count);
+  std::vector<std::vector<ShardOp>> shards(smp::count);
+
+  for (size_t i = 0; i < count; i++) {
+    auto op = ops[i];
+    (*results)[i] = ShardResult{i, 0, extents_ptr()};
+    if (op.isOsdRead()) {
+      auto args = op.getOsdRead();
+      if (auto error = check_read(args.getOffset(), args.getLength())) {
+        (*results)[i].error = error;
+        continue;
+      }
+      auto oid = args.getObject();
+      const ObjectName name(oid.begin(), oid.size());
+      auto pg = object_pg(name.hash);
+      shards[pg_shard(pg)].push_back(ShardOp{i, pg, false, name,
+          args.getOffset(), args.getLength(), buffer_ptr(), false});
+    } else {
+      // every other op is a write, as checked above
+      auto args = op.getOsdWrite();
+      auto data = args.getData();
+      if (args.getMore() || args.getLength() != data.size()) {
+        (*results)[i].error = EINVAL;
+        continue;
+      }
+      if (auto error = check_write(args.getOffset(), data.size())) {
+        (*results)[i].error = error;
+        continue;
+      }
+      auto buf = data.size() >= zero_copy_threshold
+          ? net::share_data(request, data)
+          : net::copy_data(data);
+      auto oid = args.getObject();
+      const ObjectName name(oid.begin(), oid.size());
+      auto pg = object_pg(name.hash);
+      shards[pg_shard(pg)].push_back(ShardOp{i, pg, true, name,
+          args.getOffset(), data.size(),
+          seastar::make_foreign(std::make_unique<temporary_buffer>(
+                  std::move(buf))),
+          bool(args.getFlags() & proto::osd::write::ON_COMMIT)});
+    }
+  }
+
+  auto store_results = [results] (std::vector<ShardResult> shard_results) {
+    for (auto& r : shard_results)
+      (*results)[r.index] = std::move(r);
+  };
+  auto cpus = boost::irange(0u, smp::count);
+  return seastar::parallel_for_each(cpus.begin(), cpus.end(),
+    [&store, shards = std::move(shards), store_results] (unsigned cpu) mutable {
+      if (shards[cpu].empty())
+        return now();
+      if (cpu == engine().cpu_id())
+        return execute_ops(store.local(), std::move(shards[cpu])).then(
+            store_results);
+      return store.invoke_on(cpu,
+        [ops = std::move(shards[cpu])] (Store& s) mutable {
+          return execute_ops(s, std::move(ops));
+        }).then(store_results);
+    }).then([sequence, ops, results] {
+      // size the first segment for the replies and the data they copy
+      size_t bytes = reply_overhead;
+      for (auto& r : *results) {
+        bytes += reply_overhead;
+        if (r.data)
+          bytes += copied_size(*r.data);
+      }
+      auto message = net::make_message(bytes);
+      auto replies = init_reply(*message, sequence).initBatchReply(ops.size());
+      for (size_t i = 0; i < ops.size(); i++) {
+        auto& r = (*results)[i];
+        if (ops[i].isOsdRead()) {
+          auto res = replies[i].initOsdReadReply();
+          res.setOffset(ops[i].getOsdRead().getOffset());
+          if (r.error || !r.data) {
+            res.setErrorCode(r.error ? r.error : EIO);
+            continue;
+          }
+          set_read_data(*message, res, adopt_foreign(std::move(r.data)));
+        } else {
+          auto res = replies[i].initOsdWriteReply();
+          if (r.error)
+            res.setErrorCode(r.error);
+          else
+            res.setFlags(ops[i].getOsdWrite().getFlags());
+        }
+      }
+      return MessageBuilderPtr(std::move(message));
+    });
+}
+
+} // anonymous namespace
+
+future<OSD::MessageBuilderPtr> OSD::handle_message(MessageReaderPtr&& request)
+{
+  auto root = request->getRoot<proto::Message>();
+  auto sequence = root.getHeader().getSequence();
+
+  future<MessageBuilderPtr> reply = [&] {
+    switch (root.which()) {
+    case proto::Message::OSD_READ:
+      return osd_read(store, sequence, root.getOsdRead());
+    case proto::Message::OSD_WRITE:
+      return osd_write(store, sequence, *request, root.getOsdWrite());
+    case proto::Message::BATCH:
+      return osd_batch(store, sequence, *request, root.getBatch());
+    default:
+      return make_exception_future<MessageBuilderPtr>(
+          std::system_error(EOPNOTSUPP, std::system_category(),
+                            "unsupported request type"));
+    }
+  }();
+  // hold the request until the reply no longer refers to it
+  return reply.finally([request = std::move(request)] {});
+}
+
+future<> OSD::handle_message(MessageReaderPtr&& request, Session& session,
+                             ReplyFunc send)
+{
+  auto root = request->getRoot<proto::Message>();
+  auto sequence = root.getHeader().getSequence();
+
+  future<> done = [&] {
+    switch (root.which()) {
+    case proto::Message::OSD_READ:
+      if (root.getOsdRead().getChunkSize())
+        return read_stream(store, sequence, root.getOsdRead(), send);
+      break;
+    case proto::Message::OSD_WRITE:
+      return write_chunk(store, sequence, *request, root.getOsdWrite(),
+                         session, send);
+    default:
+      break;
+    }
+    return handle_message(std::move(request)).then(
+      [send] (MessageBuilderPtr&& reply) {
+        return send(std::move(reply));
+      });
+  }();
+  // hold the request until the replies no longer refer to it
+  if (request)
+    return done.finally([request = std::move(request)] {});
+  return done;
+}
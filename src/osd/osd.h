@@ -0,0 +1,100 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <core/distributed.hh>
+
+#include "msg/messenger.h"
+#include "store.h"
+
+namespace crimson {
+namespace osd {
+
+/// Executes OsdRead and OsdWrite requests against a Store that is
+/// distributed over all cores. Each request is forwarded to the core that
+/// owns its object, and the reply is built on the core that received it.
+/// The ops of a batch are grouped by core, and each core executes its
+/// share of the batch in a single pass.
+class OSD {
+ public:
+  using MessageReaderPtr = net::Connection::MessageReaderPtr;
+  using MessageBuilderPtr = net::Connection::MessageBuilderPtr;
+  /// Sends a reply, and resolves once the connection has taken it
+  using ReplyFunc = std::function<future<>(MessageBuilderPtr&&)>;
+
+  /// Reads of more than this many bytes fail with EINVAL, as do streamed
+  /// reads with larger chunks
+  static constexpr uint64_t max_read_length = 64 << 20;
+  /// A session holds at most this many unfinished streamed writes, and a
+  /// chunk that would start another fails with EBUSY
+  static constexpr size_t max_write_streams = 1024;
+  /// Batches of more than this many ops fail as a whole with E2BIG, as do
+  /// batches whose reads ask for more than max_read_length bytes in all
+  static constexpr size_t max_batch_ops = 4096;
+
+  /// The writes in progress on a single connection. A streamed write
+  /// whose last chunk never arrives is dropped along with the session.
+  struct Session {
+    struct WriteStream {
+      size_t pending{0}; //< chunks still being applied
+      bool last{false}; //< the last chunk has arrived
+      uint32_t error{0}; //< the first error from any chunk
+      uint32_t flags{0}; //< the flags of the last chunk
+      /// the latest chunk applied by each core's store, by core
+      std::unordered_map<unsigned, uint64_t> sequences;
+    };
+    std::unordered_map<uint32_t, WriteStream> writes; //< by sequence
+  };
+
+ private:
+  seastar::distributed<Store>& store;
+
+ public:
+  OSD(seastar::distributed<Store>& store) : store(store) {}
+
+  /// Execute the given request, and return a reply that carries the same
+  /// Header.sequence. Errors from the store are returned in the reply's
+  /// errorCode, as are ranges that wrap (EINVAL), reads longer than
+  /// max_read_length (EINVAL) and writes past the store's maximum object
+  /// size (EFBIG). Malformed requests fail the returned future, as do
+  /// requests of an unsupported type, with EOPNOTSUPP, batches that are
+  /// too large, with E2BIG, and batches with an op of an unknown type, with
+  /// EINVAL.
+  future<MessageBuilderPtr> handle_message(MessageReaderPtr&& request);
+
+  /// Execute the given request from a connection with the given Session,
+  /// and pass its replies to \a send. A read with a chunkSize streams its
+  /// data back in several replies, reading each chunk as it's sent. The
+  /// chunks of a streamed write are applied as they arrive, each to its own
+  /// object, and the write is replied to once after its last chunk has
+  /// been applied. A write that asks for both onApply and
+  /// onCommit gets a reply for each, as each happens. Otherwise this sends
+  /// the single reply of handle_message(). The Session must outlive the
+  /// returned future.
+  future<> handle_message(MessageReaderPtr&& request, Session& session,
+                          ReplyFunc send);
+};
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,61 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "pg_sequencer.h"
+
+using namespace crimson;
+using namespace crimson::osd;
+
+future<> PGSequencer::admit(uint32_t id, bool write)
+{
+  auto& pg = pgs[id];
+  // an op may not overtake the ops waiting ahead of it
+  if (pg.waiting.empty() && can_start(pg, write)) {
+    start(pg, write);
+    return now();
+  }
+  pg.waiting.push_back(Waiter{write, promise<>()});
+  return pg.waiting.back().ready.get_future();
+}
+
+void PGSequencer::release(uint32_t id, bool write)
+{
+  auto& pg = pgs[id];
+  if (write)
+    pg.writing = false;
+  else
+    pg.reads--;
+
+  // admit waiters in order, until one has to wait for those running
+  while (!pg.waiting.empty() && can_start(pg, pg.waiting.front().write)) {
+    auto& waiter = pg.waiting.front();
+    start(pg, waiter.write);
+    waiter.ready.set_value();
+    pg.waiting.pop_front();
+  }
+}
+
+PGSequencer& PGSequencer::local()
+{
+  static thread_local PGSequencer sequencer;
+  return sequencer;
+}
@@ -0,0 +1,96 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <vector>
+#include <core/circular_buffer.hh>
+#include <core/future.hh>
+
+#include "crimson.h"
+#include "placement.h"
+
+namespace crimson {
+namespace osd {
+
+/// Orders the ops of each placement group on the core that owns it, while
+/// ops in different placement groups run concurrently. Ops are admitted in
+/// arrival order: a read waits for the writes that arrived before it, and a
+/// write waits for every op that arrived before it. Reads that arrive
+/// together run together.
+///
+/// Every placement group is owned by a single core, so its queue needs no
+/// locks or atomics.
+class PGSequencer {
+  /// an op waiting for its turn
+  struct Waiter {
+    bool write;
+    promise<> ready;
+  };
+  struct PG {
+    size_t reads{0}; //< reads running
+    bool writing{false}; //< a write is running
+    seastar::circular_buffer<Waiter> waiting; //< ops in arrival order
+  };
+  std::vector<PG> pgs; //< indexed by pg id
+
+  /// Return true if an op may start now in the given pg
+  static bool can_start(const PG& pg, bool write) {
+    return write ? !pg.writing && pg.reads == 0 : !pg.writing;
+  }
+
+  /// Mark an op as running
+  static void start(PG& pg, bool write) {
+    if (write)
+      pg.writing = true;
+    else
+      pg.reads++;
+  }
+
+ public:
+  PGSequencer() : pgs(pg_count) {}
+
+  /// Resolve once an op may start in the given pg
+  future<> admit(uint32_t pg, bool write);
+
+  /// Finish an op that was admitted, and admit the ops that were waiting
+  /// for it
+  void release(uint32_t pg, bool write);
+
+  /// Run \a func once admitted to the given pg, and release the pg when the
+  /// future it returns resolves
+  template <typename Func>
+  auto with_pg(uint32_t pg, bool write, Func&& func) {
+    return admit(pg, write).then(std::forward<Func>(func)).finally(
+      [this, pg, write] {
+        release(pg, write);
+      });
+  }
+
+  /// Return the number of ops waiting in the given pg
+  size_t waiting(uint32_t pg) const { return pgs[pg].waiting.size(); }
+
+  /// Return this core's sequencer
+  static PGSequencer& local();
+};
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,190 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "placement.h"
+
+using namespace crimson;
+using namespace crimson::osd;
+
+namespace {
+
+/// Scramble a 64-bit value (the splitmix64 finalizer)
+uint64_t mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+uint64_t osd_key(uint32_t pg, int32_t osd)
+{
+  return mix((uint64_t(pg) << 32) | uint32_t(osd));
+}
+
+uint64_t core_key(uint32_t pg, int32_t osd, unsigned core)
+{
+  return mix(osd_key(pg, osd) + (core + 1) * 0x9e3779b97f4a7c15ull);
+}
+
+/// Draw the straw of an OSD for a pg: ln(u) / weight, for u uniform in
+/// (0, 1]. The longest straw wins, and an OSD's chance of winning is
+/// proportional to its weight.
+double straw2(uint32_t pg, const OSDInfo& osd)
+{
+  if (osd.weight <= 0)
+    return -std::numeric_limits<double>::infinity();
+  double u = ((osd_key(pg, osd.id) >> 11) + 1) * 0x1p-53;
+  return std::log(u) / osd.weight;
+}
+
+void validate(const PlacementMap& map)
+{
+  std::unordered_set<int32_t> ids;
+  bool weighted = false;
+  for (auto& osd : map.osds) {
+    if (!ids.insert(osd.id).second)
+      throw std::invalid_argument("duplicate osd id in placement map");
+    if (osd.cores == 0 || osd.cores > std::numeric_limits<uint16_t>::max())
+      throw std::invalid_argument("osd core count out of range");
+    if (osd.weight < 0)
+      throw std::invalid_argument("negative osd weight");
+    weighted |= osd.weight > 0;
+  }
+  if (!weighted)
+    throw std::invalid_argument("placement map has no weighted osd");
+}
+
+} // anonymous namespace
+
+PlacementTable::PlacementTable(PlacementMap map)
+  : entries(pg_count), draws(pg_count), map(std::move(map))
+{
+  validate(this->map);
+  for (uint32_t pg = 0; pg < pg_count; pg++)
+    choose_core(pg, this->map.osds[choose_osd(pg, draws[pg])]);
+}
+
+size_t PlacementTable::choose_osd(uint32_t pg, double& draw) const
+{
+  size_t winner = 0;
+  draw = -std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < map.osds.size(); i++) {
+    auto d = straw2(pg, map.osds[i]);
+    if (d > draw) {
+      draw = d;
+      winner = i;
+    }
+  }
+  return winner;
+}
+
+void PlacementTable::choose_core(uint32_t pg, const OSDInfo& osd)
+{
+  // every core has the same weight, so the largest key is the longest straw
+  unsigned winner = 0;
+  uint64_t longest = 0;
+  for (unsigned core = 0; core < osd.cores; core++) {
+    auto key = core_key(pg, osd.id, core);
+    if (key >= longest) {
+      longest = key;
+      winner = core;
+    }
+  }
+  entries[pg] = Entry{osd.id, static_cast<uint16_t>(winner)};
+}
+
+size_t PlacementTable::update(PlacementMap new_map)
+{
+  validate(new_map);
+
+  // sort the changes between the maps
+  std::unordered_map<int32_t, const OSDInfo*> old_osds;
+  for (auto& osd : map.osds)
+    old_osds.emplace(osd.id, &osd);
+  std::unordered_map<int32_t, size_t> index; //< id to index in new_map
+  std::unordered_set<int32_t> shrunk; //< removed, or weight fell
+  std::vector<size_t> grown; //< added, or weight grew
+  std::vector<bool> grew(new_map.osds.size());
+  std::vector<bool> recored(new_map.osds.size()); //< core count changed
+  for (size_t i = 0; i < new_map.osds.size(); i++) {
+    auto& osd = new_map.osds[i];
+    index.emplace(osd.id, i);
+    auto old = old_osds.find(osd.id);
+    if (old == old_osds.end() || osd.weight > old->second->weight) {
+      grown.push_back(i);
+      grew[i] = true;
+    } else if (osd.weight < old->second->weight) {
+      shrunk.insert(osd.id);
+    }
+    if (old != old_osds.end()) {
+      recored[i] = osd.cores != old->second->cores;
+      old_osds.erase(old);
+    }
+  }
+  for (auto& removed : old_osds)
+    shrunk.insert(removed.first);
+
+  map = std::move(new_map);
+
+  size_t moved = 0;
+  for (uint32_t pg = 0; pg < pg_count; pg++) {
+    auto before = entries[pg];
+    if (shrunk.count(before.osd)) {
+      // its straw got shorter, so any OSD may win now
+      choose_core(pg, map.osds[choose_osd(pg, draws[pg])]);
+    } else {
+      // every other straw is the same or shorter, so only the OSDs whose
+      // straws grew can take the pg
+      auto current = index[before.osd];
+      if (grew[current])
+        draws[pg] = straw2(pg, map.osds[current]);
+      auto winner = current;
+      for (auto i : grown) {
+        if (i == current)
+          continue;
+        auto d = straw2(pg, map.osds[i]);
+        if (d > draws[pg]) {
+          draws[pg] = d;
+          winner = i;
+        }
+      }
+      if (winner != current || recored[current])
+        choose_core(pg, map.osds[winner]);
+    }
+    if (entries[pg].osd != before.osd || entries[pg].core != before.core)
+      moved++;
+  }
+  return moved;
+}
+
+const PlacementTable& PlacementTable::local()
+{
+  static thread_local PlacementTable table(
+      PlacementMap{0, {OSDInfo{0, 1.0, smp::count}}});
+  return table;
+}
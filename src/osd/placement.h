@@ -0,0 +1,129 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <vector>
+
+#include <core/reactor.hh>
+
+#include "xxHash/xxhash.h"
+#include "crimson.h"
+
+namespace crimson {
+namespace osd {
+
+/// Hash an object name. Every core must agree on the result, so that they
+/// all route an object to the same shard.
+inline uint64_t object_hash(const char* name, size_t length)
+{
+  return XXH64(name, length, 0);
+}
+
+/// Objects are grouped into this many placement groups. Ops on the objects
+/// of a placement group are ordered with respect to each other, and ops in
+/// different placement groups are independent.
+constexpr uint32_t pg_count = 1024;
+
+/// Return the placement group of the object with the given name hash
+inline uint32_t object_pg(uint64_t hash)
+{
+  return hash % pg_count;
+}
+
+/// An OSD in the placement map
+struct OSDInfo {
+  int32_t id;
+  double weight; //< relative share of the placement groups, or 0 for none
+  unsigned cores; //< shards the OSD spreads its placement groups over
+};
+
+/// The OSDs that placement groups are spread over
+struct PlacementMap {
+  uint32_t epoch{0};
+  std::vector<OSDInfo> osds;
+};
+
+/// Precomputed placement of every placement group on an OSD and one of its
+/// cores. Each placement group goes to the OSD with the longest straw2 draw
+/// for it, which gives each OSD a share of the groups in proportion to its
+/// weight, and moves only the groups that must move when the map changes.
+/// The core within the OSD is chosen the same way, with equal weights.
+///
+/// Drawing straws walks the whole map, so it's done once per map rather
+/// than once per op: routing an op is a lookup in a table of pg_count
+/// entries that each core keeps its own copy of.
+class PlacementTable {
+  struct Entry {
+    int32_t osd;
+    uint16_t core;
+  };
+  std::vector<Entry> entries; //< indexed by pg id
+  std::vector<double> draws; //< the winning draw of each pg
+  PlacementMap map;
+
+  /// Return the index in the map of the OSD that wins the pg, and set its
+  /// draw
+  size_t choose_osd(uint32_t pg, double& draw) const;
+  /// Place the pg on a core of its OSD
+  void choose_core(uint32_t pg, const OSDInfo& osd);
+
+ public:
+  explicit PlacementTable(PlacementMap map);
+
+  /// Return the id of the OSD that owns the given placement group
+  int32_t pg_osd(uint32_t pg) const { return entries[pg].osd; }
+  /// Return the core of its OSD that owns the given placement group
+  unsigned pg_core(uint32_t pg) const { return entries[pg].core; }
+
+  const PlacementMap& get_map() const { return map; }
+
+  /// Switch to a new map. Only the placement groups of OSDs that were
+  /// removed, or whose weight fell, are placed from scratch. Every other
+  /// placement group only has to be checked against the OSDs that were
+  /// added, or whose weight grew. Return the number of placement groups
+  /// that moved, which is the data a migration would have to move.
+  size_t update(PlacementMap new_map);
+
+  /// Return this core's table, which routes ops to the cores that own
+  /// them: a single OSD that has every core. It's fixed for the life of the
+  /// process, because each core's store holds the objects of the placement
+  /// groups it owns, and PGSequencer orders ops by the core they run on.
+  /// Moving a placement group to another core would need its objects to be
+  /// migrated and its queued ops drained, so a new map needs a restart.
+  static const PlacementTable& local();
+};
+
+/// Return the core that owns the given placement group
+inline unsigned pg_shard(uint32_t pg)
+{
+  // a map with OSDs of more cores than ours folds them onto ours
+  return PlacementTable::local().pg_core(pg) % smp::count;
+}
+
+/// Return the core that owns the object with the given name hash
+inline unsigned object_shard(uint64_t hash)
+{
+  return pg_shard(object_pg(hash));
+}
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,182 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "server.h"
+#include "msg/message_pool.h"
+#include "crimson.capnp.h"
+#include <core/future-util.hh>
+#include <kj/exception.h>
+#include <system_error>
+
+using namespace crimson;
+using namespace crimson::osd;
+using namespace crimson::net;
+
+namespace {
+
+/// Return the sequence of a request, or 0 if it's too malformed to read
+uint32_t request_sequence(capnp::MessageReader& request)
+{
+  try {
+    return request.getRoot<proto::Message>().getHeader().getSequence();
+  } catch (...) {
+    return 0;
+  }
+}
+
+/// Return the errno to reply with for a request that failed as a whole
+uint32_t request_error(std::exception_ptr eptr)
+{
+  try {
+    std::rethrow_exception(eptr);
+  } catch (std::system_error& e) {
+    return e.code().value();
+  } catch (kj::Exception&) {
+    // the request doesn't match the schema
+    return EINVAL;
+  } catch (...) {
+    return EIO;
+  }
+}
+
+Connection::MessageBuilderPtr error_reply(uint32_t sequence, uint32_t error)
+{
+  auto message = net::make_message();
+  auto root = message->initRoot<proto::Message>();
+  root.initHeader().setSequence(sequence);
+  root.setError(error);
+  return std::move(message);
+}
+
+} // anonymous namespace
+
+Server::Server(seastar::distributed<Store>& store,
+               size_t qos_concurrency, ClientInfo qos)
+  : osd(store)
+{
+  if (qos_concurrency)
+    scheduler = std::make_unique<MClockScheduler>(qos_concurrency, qos);
+}
+
+future<> Server::listen(socket_address address)
+{
+  listener = std::make_unique<SocketListener>(address);
+  // batch the replies that complete in the same reactor tick
+  listener->set_cork(true);
+  // run the accept loop in the background until stop()
+  seastar::with_gate(connections, [this] { return accept_loop(*listener); });
+  return now();
+}
+
+future<> Server::listen_shm(string path)
+{
+  shm_listener = std::make_unique<ShmListener>(std::move(path));
+  seastar::with_gate(connections, [this] {
+      return accept_loop(*shm_listener);
+    });
+  return now();
+}
+
+future<> Server::accept_loop(Listener& listener)
+{
+  return seastar::keep_doing([this, &listener] {
+      return listener.accept().then(
+        [this] (shared_ptr<Connection> conn) {
+          active.emplace(conn.get(), conn);
+          seastar::with_gate(connections, [this, conn] {
+              return handle_connection(conn);
+            }).finally([this, conn] {
+              active.erase(conn.get());
+            });
+        });
+    }).handle_exception([] (auto eptr) {
+      // the listener was closed
+    });
+}
+
+future<> Server::handle_connection(shared_ptr<Connection> conn)
+{
+  auto requests = make_lw_shared<seastar::gate>();
+  auto session = make_lw_shared<OSD::Session>();
+  const auto client = next_client++;
+  return seastar::repeat([this, conn, requests, session, client] {
+      return conn->read_message().then(
+        [this, conn, requests, session, client]
+        (Connection::MessageReaderPtr&& request) {
+          const auto sequence = request_sequence(*request);
+          seastar::with_gate(*requests,
+            [this, conn, session, client, request = std::move(request)] () mutable {
+              if (!scheduler) {
+                return osd.handle_message(std::move(request), *session,
+                  [conn] (Connection::MessageBuilderPtr&& reply) {
+                    return conn->write_message(std::move(reply));
+                  });
+              }
+              auto header = request->getRoot<proto::Message>().getHeader();
+              auto delta = header.getDelta();
+              auto rho = header.getRho();
+              return scheduler->schedule(client, delta, rho,
+                [this, conn, session, request = std::move(request)]
+                (MClockScheduler::Phase phase) mutable {
+                  const bool reserved =
+                      phase == MClockScheduler::Phase::reservation;
+                  return osd.handle_message(std::move(request), *session,
+                    [conn, reserved] (Connection::MessageBuilderPtr&& reply) {
+                      // tell dmClock clients which phase served them
+                      if (reserved)
+                        reply->getRoot<proto::Message>().getHeader()
+                            .setReservationPhase(true);
+                      return conn->write_message(std::move(reply));
+                    });
+                });
+            }).handle_exception([conn, sequence] (auto eptr) {
+              // tell the client, unless the connection is what failed
+              return conn->write_message(
+                  error_reply(sequence, request_error(eptr))).handle_exception(
+                [] (auto eptr) {});
+            });
+          return seastar::stop_iteration::no;
+        });
+    }).handle_exception([] (auto eptr) {
+      // the client disconnected
+    }).then([requests] {
+      // let outstanding requests finish before closing the connection
+      return requests->close();
+    }).finally([this, conn, requests, session, client] {
+      if (scheduler)
+        scheduler->remove_client(client);
+      return conn->close().finally([conn] {});
+    });
+}
+
+future<> Server::stop()
+{
+  if (listener)
+    listener->close();
+  if (shm_listener)
+    shm_listener->close();
+  // closing a connection fails its pending read, so handle_connection()
+  // finishes without waiting for the client
+  for (auto& c : active)
+    c.second->close().finally([conn = c.second] {});
+  return connections.close();
+}
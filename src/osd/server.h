@@ -0,0 +1,81 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <core/distributed.hh>
+#include <core/gate.hh>
+
+#include "msg/shm_messenger.h"
+#include "msg/socket_messenger.h"
+#include "mclock_scheduler.h"
+#include "osd.h"
+
+namespace crimson {
+namespace osd {
+
+/// The network front end of an OSD for a single core. Every core runs its
+/// own Server with its own listening socket on the same address, so that
+/// connections are spread over all cores by the kernel. Requests are
+/// executed on the core that owns their object.
+///
+/// When quality of service is enabled, each connection is a client of this
+/// core's MClockScheduler, and requests wait for it before they execute.
+class Server {
+  OSD osd;
+  std::unique_ptr<MClockScheduler> scheduler; //< null unless enabled
+  MClockScheduler::client_id next_client{0};
+  std::unique_ptr<net::SocketListener> listener;
+  std::unique_ptr<net::ShmListener> shm_listener; //< null unless enabled
+  seastar::gate connections; //< stop() waits for open connections
+  /// open connections, so that stop() can close them
+  std::unordered_map<net::Connection*, shared_ptr<net::Connection>> active;
+
+  /// Accept connections until the listener is closed
+  future<> accept_loop(net::Listener& listener);
+
+  /// Read requests from the connection until it closes. Requests are
+  /// executed concurrently and replies are sent as they complete, so that
+  /// a client may pipeline its requests.
+  future<> handle_connection(shared_ptr<net::Connection> conn);
+
+ public:
+  /// Serve requests from the given store. If \a qos_concurrency is
+  /// nonzero, run at most that many requests at once under an
+  /// MClockScheduler, and give every client the \a qos ClientInfo.
+  Server(seastar::distributed<Store>& store, size_t qos_concurrency = 0,
+         ClientInfo qos = ClientInfo());
+
+  /// Listen for connections on the given address
+  future<> listen(net::socket_address address);
+
+  /// Also listen for ShmConnections from processes on this host, on a unix
+  /// socket at \a path
+  future<> listen_shm(string path);
+
+  /// Close the listener and all open connections
+  future<> stop();
+};
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,108 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "store.h"
+#include <core/align.hh>
+#include <core/reactor.hh>
+#include <algorithm>
+#include <vector>
+
+#include "log_store.h"
+#include "memory_store.h"
+#include "placement.h"
+
+using namespace crimson;
+using namespace crimson::osd;
+
+constexpr uint64_t ObjectStore::max_object_size;
+
+future<temporary_buffer> ObjectStore::read(const ObjectName& oid,
+                                           uint64_t offset, uint64_t length)
+{
+  return read_extents(oid, offset, length).then(
+    [] (std::vector<temporary_buffer> extents) {
+      if (extents.empty())
+        return temporary_buffer();
+      if (extents.size() == 1)
+        return std::move(extents.front());
+      uint64_t total = 0;
+      for (auto& e : extents)
+        total += e.size();
+      auto buf = temporary_buffer::aligned(
+          sizeof(uint64_t), seastar::align_up<uint64_t>(total, 8));
+      auto p = buf.get_write();
+      for (auto& e : extents)
+        p = std::copy(e.get(), e.get() + e.size(), p);
+      buf.trim(total);
+      return buf;
+    });
+}
+
+namespace {
+
+/// Return this core's shard of the logs, and a digest of the core that owns
+/// each placement group, so that a log is only replayed by the core that
+/// owns its objects
+LogStore::Layout local_layout()
+{
+  std::vector<uint16_t> owners(pg_count);
+  for (uint32_t pg = 0; pg < pg_count; pg++)
+    owners[pg] = pg_shard(pg);
+  return LogStore::Layout{engine().cpu_id(), smp::count,
+                          XXH64(owners.data(), owners.size() * 2, 0)};
+}
+
+} // anonymous namespace
+
+temporary_buffer crimson::osd::zero_buffer(size_t length)
+{
+  auto buf = temporary_buffer::aligned(sizeof(uint64_t),
+                                       seastar::align_up<size_t>(length, 8));
+  std::fill(buf.get_write(), buf.get_write() + buf.size(), 0);
+  buf.trim(length);
+  return buf;
+}
+
+Store::Store(StoreConfig config)
+  : config(std::move(config))
+{
+  if (this->config.log_dir.empty())
+    backend = std::make_unique<MemoryStore>();
+}
+
+future<> Store::open()
+{
+  if (config.log_dir.empty())
+    return now();
+  auto log = std::make_unique<LogStore>(
+      config.log_dir + "/log." + seastar::to_sstring(engine().cpu_id()),
+      config.log_size, config.cache_size, local_layout());
+  auto& opening = *log;
+  return opening.open().then([this, log = std::move(log)] () mutable {
+      backend = std::move(log);
+    });
+}
+
+future<> Store::stop()
+{
+  return backend ? backend->stop() : now();
+}
@@ -0,0 +1,136 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <core/future.hh>
+
+#include "crimson.h"
+#include "object_index.h"
+
+namespace crimson {
+namespace osd {
+
+/// The objects of a single core. Objects are partitioned across cores by
+/// object_shard(), and each core's store only sees the objects it owns, so
+/// there is no sharing or locking between them.
+///
+/// A write is applied once reads can see it, and committed once it will
+/// survive a restart. The two may be acknowledged separately, so write()
+/// resolves once the write is applied, with a sequence number that
+/// commit() waits for.
+///
+/// Names need only outlive the call, not the future it returns.
+///
+/// Errors are reported by failing futures with std::system_error.
+class ObjectStore {
+ public:
+  /// Writes that would extend an object past this fail with EFBIG
+  static constexpr uint64_t max_object_size = 4ull << 30;
+
+  virtual ~ObjectStore() {}
+
+  /// Return true if \a length bytes at \a offset lie within max_object_size
+  static bool in_bounds(uint64_t offset, uint64_t length) {
+    return length <= max_object_size && offset <= max_object_size - length;
+  }
+
+  /// Return up to \a length bytes of the object starting at \a offset,
+  /// truncated at the end of the object, as the buffers that hold them in
+  /// order. Each buffer shares the store's data where it can, and holes
+  /// read as buffers of zeroes. Fails with ENOENT if the object does not
+  /// exist.
+  virtual future<std::vector<temporary_buffer>> read_extents(
+      const ObjectName& oid, uint64_t offset, uint64_t length) = 0;
+
+  /// Return the range of read_extents() in a single buffer. A range within
+  /// a single buffer shares it, and otherwise the buffers are gathered.
+  future<temporary_buffer> read(const ObjectName& oid, uint64_t offset,
+                                uint64_t length);
+
+  /// Write \a data at \a offset, creating the object or extending it as
+  /// necessary. Any gap past the end of the object reads back as zeroes.
+  /// Fails with EFBIG if the write isn't in_bounds().
+  /// Resolves with the write's sequence number once it is applied.
+  virtual future<uint64_t> write(const ObjectName& oid, uint64_t offset,
+                                 temporary_buffer&& data) = 0;
+
+  /// Resolve once the write with the given sequence number, and every
+  /// write before it, is committed
+  virtual future<> commit(uint64_t sequence) = 0;
+
+  /// Return the number of objects in the store
+  virtual size_t size() const = 0;
+
+  /// Commit outstanding writes and release the store's resources
+  virtual future<> stop() = 0;
+};
+
+/// Return a word-aligned buffer of \a length zeroes, for a hole
+temporary_buffer zero_buffer(size_t length);
+
+/// Where each core's Store keeps its objects
+struct StoreConfig {
+  /// directory that holds a log for each core, or empty to keep objects in
+  /// memory only
+  string log_dir;
+  /// bytes of log to preallocate for each core
+  uint64_t log_size{1ull << 30};
+  /// bytes of each core's log to cache for reads
+  size_t cache_size{256 << 20};
+};
+
+/// Holds each core's ObjectStore for seastar::distributed<>. The store is
+/// usable once open() has resolved on every core.
+class Store {
+  StoreConfig config;
+  std::unique_ptr<ObjectStore> backend;
+
+ public:
+  explicit Store(StoreConfig config = StoreConfig());
+
+  /// Open this core's backend, replaying its log if it has one
+  future<> open();
+
+  future<std::vector<temporary_buffer>> read_extents(const ObjectName& oid,
+                                                     uint64_t offset,
+                                                     uint64_t length) {
+    return backend->read_extents(oid, offset, length);
+  }
+  future<temporary_buffer> read(const ObjectName& oid, uint64_t offset,
+                                uint64_t length) {
+    return backend->read(oid, offset, length);
+  }
+  future<uint64_t> write(const ObjectName& oid, uint64_t offset,
+                         temporary_buffer&& data) {
+    return backend->write(oid, offset, std::move(data));
+  }
+  future<> commit(uint64_t sequence) { return backend->commit(sequence); }
+  size_t size() const { return backend->size(); }
+
+  /// Called by seastar::distributed<> on shutdown
+  future<> stop();
+};
+
+} // namespace osd
+} // namespace crimson
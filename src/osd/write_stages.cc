@@ -0,0 +1,152 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "write_stages.h"
+#include <algorithm>
+#include <stdexcept>
+#include <core/reactor.hh>
+#include <core/sleep.hh>
+
+using namespace crimson;
+using namespace crimson::osd;
+
+namespace {
+
+/// Split a spec into its colon-separated fields
+std::vector<std::string> split(const std::string& spec)
+{
+  std::vector<std::string> fields;
+  size_t start = 0;
+  for (;;) {
+    auto end = spec.find(':', start);
+    fields.push_back(spec.substr(start, end - start));
+    if (end == std::string::npos)
+      return fields;
+    start = end + 1;
+  }
+}
+
+DelayModel::duration parse_usec(const std::string& field)
+{
+  size_t pos = 0;
+  auto usec = std::stoull(field, &pos);
+  if (pos != field.size())
+    throw std::invalid_argument("invalid delay " + field);
+  return DelayModel::duration(usec);
+}
+
+} // anonymous namespace
+
+DelayModel DelayModel::parse(const std::string& spec)
+{
+  auto fields = split(spec);
+  auto& name = fields.front();
+  auto args = fields.size() - 1;
+  DelayModel model;
+  model.rng.seed(engine().cpu_id());
+  try {
+    if (name == "none" && args == 0) {
+      model.kind = Kind::none;
+    } else if (name == "fixed" && args == 1) {
+      model.kind = Kind::fixed;
+      model.base = parse_usec(fields[1]);
+    } else if (name == "uniform" && args == 2) {
+      model.kind = Kind::uniform;
+      model.base = parse_usec(fields[1]);
+      model.max = parse_usec(fields[2]);
+      if (model.max < model.base)
+        throw std::invalid_argument("uniform max is below min");
+    } else if (name == "exp" && args == 1) {
+      model.kind = Kind::exponential;
+      model.base = parse_usec(fields[1]);
+    } else if (name == "queue" && (args == 1 || args == 2)) {
+      model.kind = Kind::queue;
+      model.base = parse_usec(fields[1]);
+      auto count = args == 2 ? std::stoul(fields[2]) : 1;
+      if (count == 0)
+        throw std::invalid_argument("queue needs a server");
+      model.servers.resize(count);
+    } else {
+      throw std::invalid_argument("unknown delay model");
+    }
+  } catch (std::logic_error& e) { // includes the std::stoul errors
+    throw std::invalid_argument("invalid delay spec '" + spec + "': " +
+                                e.what());
+  }
+  return model;
+}
+
+DelayModel::duration DelayModel::next_delay()
+{
+  switch (kind) {
+  case Kind::none:
+    return duration(0);
+  case Kind::fixed:
+    return base;
+  case Kind::uniform:
+    return duration(std::uniform_int_distribution<duration::rep>(
+            base.count(), max.count())(rng));
+  case Kind::exponential:
+    if (base.count() == 0)
+      return base;
+    return duration(static_cast<duration::rep>(
+            std::exponential_distribution<double>(1.0 / base.count())(rng)));
+  case Kind::queue: {
+    auto now = clock_type::now();
+    auto server = std::min_element(servers.begin(), servers.end());
+    auto start = std::max(now, *server);
+    *server = start + base;
+    return std::chrono::duration_cast<duration>(*server - now);
+  }
+  }
+  return duration(0);
+}
+
+future<> DelayModel::wait()
+{
+  auto delay = next_delay();
+  if (delay.count() == 0)
+    return now();
+  return seastar::sleep(delay);
+}
+
+WriteStages::Hook WriteStages::make_hook(DelayModel&& model)
+{
+  if (!model.enabled())
+    return nullptr;
+  auto m = make_lw_shared<DelayModel>(std::move(model));
+  return [m] { return m->wait(); };
+}
+
+void WriteStages::set_delays(DelayModel&& pre_apply, DelayModel&& post_apply,
+                             DelayModel&& commit)
+{
+  pre_apply_hook = make_hook(std::move(pre_apply));
+  post_apply_hook = make_hook(std::move(post_apply));
+  commit_hook = make_hook(std::move(commit));
+}
+
+WriteStages& WriteStages::local()
+{
+  static thread_local WriteStages stages;
+  return stages;
+}
@@ -0,0 +1,110 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <core/future.hh>
+
+#include "crimson.h"
+
+namespace crimson {
+namespace osd {
+
+/// A model of the time that a simulated stage takes, which is spent in a
+/// seastar timer rather than by blocking the reactor. Models are parsed from
+/// specs of the form:
+///
+///   none                       no delay
+///   fixed:<usec>               a constant delay
+///   uniform:<min>:<max>        uniformly distributed between min and max usec
+///   exp:<mean>                 exponentially distributed with the given mean
+///   queue:<usec>[:<servers>]   FIFO service of the given time by a number of
+///                              servers, so that delays grow with load
+class DelayModel {
+ public:
+  using clock_type = std::chrono::steady_clock;
+  using duration = std::chrono::microseconds;
+
+  enum class Kind { none, fixed, uniform, exponential, queue };
+
+ private:
+  Kind kind{Kind::none};
+  duration base{0}; //< fixed delay, minimum, mean, or service time
+  duration max{0}; //< maximum of a uniform delay
+  std::vector<clock_type::time_point> servers; //< when each is next free
+  std::mt19937_64 rng;
+
+ public:
+  DelayModel() = default;
+
+  /// Parse a spec, and throw std::invalid_argument if it's malformed
+  static DelayModel parse(const std::string& spec);
+
+  bool enabled() const { return kind != Kind::none; }
+
+  /// Return the delay for the next op. For a queue, the op is added to the
+  /// queue of the server that's free first.
+  duration next_delay();
+
+  /// Wait for the next delay
+  future<> wait();
+};
+
+/// The simulated stages of the write path on a single core, for the
+/// replication and snapshot work that the prototype doesn't do. Each write
+/// passes through pre_apply() before it reaches the store, post_apply()
+/// after, and commit() before it's acknowledged as committed. Every stage is
+/// a null function unless a hook or DelayModel is installed.
+class WriteStages {
+ public:
+  using Hook = std::function<future<>()>;
+
+ private:
+  Hook pre_apply_hook;
+  Hook post_apply_hook;
+  Hook commit_hook;
+
+  static Hook make_hook(DelayModel&& model);
+
+ public:
+  future<> pre_apply() { return pre_apply_hook ? pre_apply_hook() : now(); }
+  future<> post_apply() { return post_apply_hook ? post_apply_hook() : now(); }
+  future<> commit() { return commit_hook ? commit_hook() : now(); }
+
+  void set_pre_apply(Hook hook) { pre_apply_hook = std::move(hook); }
+  void set_post_apply(Hook hook) { post_apply_hook = std::move(hook); }
+  void set_commit(Hook hook) { commit_hook = std::move(hook); }
+
+  /// Install a DelayModel in each stage
+  void set_delays(DelayModel&& pre_apply, DelayModel&& post_apply,
+                  DelayModel&& commit);
+
+  /// Return this core's stages
+  static WriteStages& local();
+};
+
+} // namespace osd
+} // namespace crimson
@@ -0,0 +1,306 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+/// \file bench_messenger.cc
+/// \brief Throughput and latency benchmark for the messenger transports
+///
+/// Sweeps message size, segment count, in-flight depth and connection count
+/// over DirectConnection, SocketConnection on loopback and ShmConnection.
+/// Each point runs for a fixed time with a closed loop of RpcClient calls
+/// against an echo server, and writes one JSON object per line with its
+/// results.
+
+#include "msg/direct_messenger.h"
+#include "msg/message_pool.h"
+#include "msg/rpc_client.h"
+#include "msg/shm_messenger.h"
+#include "msg/socket_messenger.h"
+#include "crimson.capnp.h"
+#include "histogram.h"
+#include <capnp/message.h>
+#include <core/app-template.hh>
+#include <core/align.hh>
+#include <core/future-util.hh>
+#include <boost/range/irange.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+using namespace crimson;
+using namespace crimson::net;
+
+namespace bpo = boost::program_options;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct BenchConfig {
+  std::string transport;
+  size_t size; //< payload bytes per message
+  size_t segments; //< segments per message
+  size_t depth; //< calls in flight per connection
+  size_t connections;
+  std::chrono::milliseconds duration;
+};
+
+struct BenchResult {
+  uint64_t messages{0};
+  uint64_t bytes{0};
+  Histogram latency; //< nanoseconds per call
+};
+
+/// Build a request that carries \a cfg.size bytes of \a payload in
+/// \a cfg.segments segments. With more than one segment, the payload is
+/// referenced in place as extra segments, one per chunk, and only the first
+/// chunk is reachable from the root.
+Connection::MessageBuilderPtr make_request(const BenchConfig& cfg,
+                                           const temporary_buffer& payload)
+{
+  auto data = [&payload] (size_t offset, size_t length) {
+    return capnp::Data::Reader(
+        reinterpret_cast<const capnp::byte*>(payload.get() + offset), length);
+  };
+  if (cfg.segments <= 1) {
+    // size the first segment to hold the whole message
+    const auto bytes = cfg.size + 128;
+    const auto words = seastar::align_up(bytes, sizeof(capnp::word))
+        / sizeof(capnp::word);
+    std::unique_ptr<capnp::MallocMessageBuilder> message;
+    if (words <= MessagePool::class_words[MessagePool::nr_classes - 1])
+      message = make_message(bytes);
+    else
+      message = std::make_unique<capnp::MallocMessageBuilder>(words);
+    auto args = message->initRoot<proto::Message>().initOsdWrite();
+    args.setLength(cfg.size);
+    args.setData(data(0, cfg.size));
+    return std::move(message);
+  }
+  auto message = make_message();
+  auto args = message->initRoot<proto::Message>().initOsdWrite();
+  const auto chunks = cfg.segments - 1;
+  const auto chunk = seastar::align_up((cfg.size + chunks - 1) / chunks,
+                                       sizeof(capnp::word));
+  for (size_t offset = 0, i = 0; i < chunks; i++, offset += chunk) {
+    auto length = std::min(chunk, cfg.size - std::min(offset, cfg.size));
+    auto orphan = message->reference_data(
+        temporary_buffer(const_cast<char*>(payload.get()) + offset, length,
+                         seastar::deleter()));
+    if (i == 0) {
+      args.setLength(length);
+      args.adoptData(std::move(orphan));
+    }
+    // the other chunks stay in the message as unreachable segments
+  }
+  return std::move(message);
+}
+
+/// Reply to each request with an empty osd_write_reply, until the client
+/// hangs up
+future<> run_echo_server(shared_ptr<Connection> conn)
+{
+  return seastar::repeat([conn] {
+      return conn->read_message().then(
+        [conn] (Connection::MessageReaderPtr&& request) {
+          auto sequence = request->getRoot<proto::Message>()
+              .getHeader().getSequence();
+          auto message = make_message();
+          auto root = message->initRoot<proto::Message>();
+          root.initHeader().setSequence(sequence);
+          root.initOsdWriteReply().setFlags(0);
+          return conn->write_message(std::move(message)).then([] {
+              return seastar::stop_iteration::no;
+            });
+        });
+    }).handle_exception([] (auto eptr) {
+    }).finally([conn] {
+      return conn->close().finally([conn] {});
+    });
+}
+
+/// Keep \a cfg.depth calls in flight on the connection until \a end
+future<> run_client(shared_ptr<Connection> conn, const BenchConfig& cfg,
+                    const temporary_buffer& payload,
+                    clock_type::time_point end, BenchResult& result)
+{
+  auto client = make_lw_shared<RpcClient>(conn);
+  auto workers = boost::irange<size_t>(0, cfg.depth);
+  return seastar::parallel_for_each(workers.begin(), workers.end(),
+    [client, &cfg, &payload, end, &result] (size_t) {
+      return seastar::do_until([end] { return clock_type::now() >= end; },
+        [client, &cfg, &payload, &result] {
+          auto start = clock_type::now();
+          return client->call(make_request(cfg, payload)).then(
+            [start, &cfg, &result] (Connection::MessageReaderPtr&&) {
+              auto elapsed = clock_type::now() - start;
+              result.latency.add(std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(elapsed).count());
+              result.messages++;
+              result.bytes += cfg.size;
+            });
+        });
+    }).finally([client] {
+      return client->close().finally([client] {});
+    });
+}
+
+/// Connect a client and an echo server over the configured transport
+future<shared_ptr<Connection>> connect(const BenchConfig& cfg,
+                                       shared_ptr<SocketListener> listener,
+                                       net::socket_address addr,
+                                       shared_ptr<ShmListener> shm)
+{
+  if (cfg.transport == "direct") {
+    auto c = DirectConnection::make_pair();
+    run_echo_server(c.second);
+    return make_ready_future<shared_ptr<Connection>>(c.first);
+  }
+  if (cfg.transport == "shm") {
+    shm->accept().then(&run_echo_server);
+    return ShmConnection::connect(shm->get_path());
+  }
+  listener->accept().then(&run_echo_server);
+  return engine().connect(addr).then(
+    [addr] (connected_socket fd) {
+      auto conn = make_shared<SocketConnection>(std::move(fd), addr);
+      return make_ready_future<shared_ptr<Connection>>(std::move(conn));
+    });
+}
+
+future<> run_point(BenchConfig cfg, const temporary_buffer& payload,
+                   shared_ptr<SocketListener> listener,
+                   net::socket_address addr, shared_ptr<ShmListener> shm,
+                   std::ostream& out)
+{
+  auto state = make_lw_shared<std::pair<BenchConfig, BenchResult>>();
+  state->first = cfg;
+  auto range = boost::irange<size_t>(0, cfg.connections);
+  auto conns = make_lw_shared<std::vector<shared_ptr<Connection>>>();
+  return do_for_each(range.begin(), range.end(),
+    [state, listener, addr, shm, conns] (size_t) {
+      return connect(state->first, listener, addr, shm).then(
+        [conns] (shared_ptr<Connection> conn) {
+          conns->push_back(conn);
+        });
+    }).then([state, conns, &payload] {
+      auto start = clock_type::now();
+      auto end = start + state->first.duration;
+      return seastar::parallel_for_each(conns->begin(), conns->end(),
+        [state, &payload, end] (shared_ptr<Connection> conn) {
+          return run_client(conn, state->first, payload, end, state->second);
+        }).then([start] {
+          return clock_type::now() - start;
+        });
+    }).then([state, conns, &out] (auto elapsed) {
+      auto& cfg = state->first;
+      auto& r = state->second;
+      auto secs = std::chrono::duration<double>(elapsed).count();
+      out << "{\"transport\":\"" << cfg.transport << "\""
+          << ",\"size\":" << cfg.size
+          << ",\"segments\":" << cfg.segments
+          << ",\"depth\":" << cfg.depth
+          << ",\"connections\":" << cfg.connections
+          << ",\"seconds\":" << secs
+          << ",\"messages\":" << r.messages
+          << ",\"messages_per_sec\":" << r.messages / secs
+          << ",\"bytes_per_sec\":" << r.bytes / secs
+          << ",\"latency_ns\":{\"min\":" << r.latency.min()
+          << ",\"mean\":" << r.latency.mean()
+          << ",\"p50\":" << r.latency.percentile(50)
+          << ",\"p99\":" << r.latency.percentile(99)
+          << ",\"p999\":" << r.latency.percentile(99.9)
+          << ",\"max\":" << r.latency.max() << "}}" << std::endl;
+    });
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+  using sizes = std::vector<size_t>;
+  seastar::app_template app;
+  app.add_options()
+    ("transports", bpo::value<std::vector<std::string>>()->multitoken()
+       ->default_value({"direct", "socket", "shm"}, "direct socket shm"),
+     "Transports to measure")
+    ("sizes", bpo::value<sizes>()->multitoken()
+       ->default_value({64, 4096, 65536}, "64 4096 65536"),
+     "Payload sizes in bytes")
+    ("segments", bpo::value<sizes>()->multitoken()
+       ->default_value({1, 4}, "1 4"),
+     "Segments per message")
+    ("depths", bpo::value<sizes>()->multitoken()
+       ->default_value({1, 16, 128}, "1 16 128"),
+     "Calls in flight per connection")
+    ("connections", bpo::value<sizes>()->multitoken()
+       ->default_value({1, 4}, "1 4"),
+     "Concurrent connections")
+    ("duration", bpo::value<unsigned>()->default_value(2000),
+     "Duration of each measurement in milliseconds")
+    ("port", bpo::value<uint16_t>()->default_value(3690),
+     "Loopback port for the socket transport")
+    ("shm-path", bpo::value<std::string>()->default_value(
+        "bench_messenger.shm"),
+     "Socket path for the shm transport")
+    ("output", bpo::value<std::string>(),
+     "File for results, one JSON object per line (default stdout)");
+
+  return app.run(argc, argv, [&app] {
+      auto& config = app.configuration();
+      auto points = make_lw_shared<std::vector<BenchConfig>>();
+      for (auto& t : config["transports"].as<std::vector<std::string>>())
+        for (auto size : config["sizes"].as<sizes>())
+          for (auto segments : config["segments"].as<sizes>())
+            for (auto depth : config["depths"].as<sizes>())
+              for (auto conns : config["connections"].as<sizes>())
+                points->push_back({t, size, segments, depth, conns,
+                    std::chrono::milliseconds(config["duration"].as<unsigned>())});
+
+      auto max_size = std::max_element(points->begin(), points->end(),
+          [] (auto& a, auto& b) { return a.size < b.size; })->size;
+      auto payload = make_lw_shared<temporary_buffer>(
+          temporary_buffer::aligned(sizeof(capnp::word),
+                                    seastar::align_up(max_size + 1, 4096ul)));
+      std::fill(payload->get_write(), payload->get_write() + payload->size(), 'x');
+
+      auto file = make_lw_shared<std::ofstream>();
+      if (config.count("output"))
+        file->open(config["output"].as<std::string>());
+      std::ostream* out = file->is_open() ? file.get() : &std::cout;
+
+      auto addr = seastar::make_ipv4_address(
+          {"127.0.0.1", config["port"].as<uint16_t>()});
+      auto listener = make_shared<SocketListener>(addr);
+      auto shm_path = config["shm-path"].as<std::string>();
+      auto shm = make_shared<ShmListener>(
+          string(shm_path.data(), shm_path.size()));
+
+      return do_for_each(points->begin(), points->end(),
+        [payload, listener, addr, shm, out] (const BenchConfig& cfg) {
+          return run_point(cfg, *payload, listener, addr, shm, *out);
+        }).finally([points, payload, listener, shm, file] {
+          listener->close();
+          shm->close();
+        });
+    });
+}
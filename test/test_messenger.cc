@@ -21,12 +21,18 @@
 // 02110-1301 USA
 
 #include "msg/direct_messenger.h"
+#include "msg/inbound_budget.h"
+#include "msg/message_pool.h"
+#include "msg/rpc_client.h"
+#include "msg/shm_messenger.h"
 #include "msg/socket_messenger.h"
 #include "crimson.capnp.h"
 #include <capnp/message.h>
 #include <kj/debug.h>
 #include <core/app-template.hh>
+#include <core/future-util.hh>
 #include <iostream>
+#include <vector>
 
 using namespace crimson;
 using namespace crimson::net;
@@ -49,7 +55,7 @@ future<> run_mock_server(shared_ptr<Connection> conn)
           << " offset=" << read_request.getOffset()
           << " length=" << read_request.getLength()<< std::endl;
       // reply with ENOENT
-      auto message = std::make_unique<capnp::MallocMessageBuilder>();
+      auto message = make_message();
       auto reply = message->initRoot<proto::Message>().initOsdReadReply();
       reply.setErrorCode(ENOENT);
       std::cout << "sending osd_read_reply" << std::endl;
@@ -62,7 +68,7 @@ future<> run_mock_server(shared_ptr<Connection> conn)
 future<uint32_t> run_mock_client(shared_ptr<Connection> conn)
 {
   // send an osd_read message over the connection
-  auto message = std::make_unique<capnp::MallocMessageBuilder>();
+  auto message = make_message();
   auto request = message->initRoot<proto::Message>().initOsdRead();
   request.setOffset(65536);
   request.setLength(1024);
@@ -82,6 +88,202 @@ future<uint32_t> run_mock_client(shared_ptr<Connection> conn)
     });
 }
 
+/// Read \a count osd_read requests, then reply to them in reverse order. Each
+/// reply carries the request's offset as its error code.
+future<> run_reordering_server(shared_ptr<Connection> conn, size_t count)
+{
+  using request_t = std::pair<uint32_t, uint64_t>; // sequence, offset
+  auto requests = make_lw_shared<std::vector<request_t>>();
+  return seastar::do_until([requests, count] { return requests->size() == count; },
+    [conn, requests] {
+      return conn->read_message().then(
+        [requests] (Connection::MessageReaderPtr&& reader) {
+          auto request = reader->getRoot<proto::Message>();
+          requests->emplace_back(request.getHeader().getSequence(),
+                                 request.getOsdRead().getOffset());
+        });
+    }).then([conn, requests] {
+      std::cout << "replying to " << requests->size()
+          << " requests in reverse order" << std::endl;
+      return do_for_each(requests->rbegin(), requests->rend(),
+        [conn] (const request_t& r) {
+          auto message = std::make_unique<capnp::MallocMessageBuilder>();
+          auto root = message->initRoot<proto::Message>();
+          root.initHeader().setSequence(r.first);
+          root.initOsdReadReply().setErrorCode(r.second);
+          return conn->write_message(std::move(message));
+        });
+    }).then([conn] {
+      // wait for the client to hang up
+      return seastar::repeat([conn] {
+          return conn->read_message().then([] (auto&&) {
+              return seastar::stop_iteration::no;
+            });
+        }).handle_exception([] (auto eptr) {});
+    }).finally([conn, requests] {
+      return conn->close().finally([conn] {});
+    });
+}
+
+/// Send \a count osd_read requests at once, and check that each reply is
+/// matched to its request
+future<> run_pipelined_client(shared_ptr<Connection> conn, size_t count)
+{
+  auto client = make_lw_shared<RpcClient>(conn);
+  auto offsets = make_lw_shared<std::vector<uint64_t>>();
+  for (size_t i = 0; i < count; i++)
+    offsets->push_back(i * 4096);
+
+  return seastar::parallel_for_each(offsets->begin(), offsets->end(),
+    [client] (uint64_t offset) {
+      auto message = std::make_unique<capnp::MallocMessageBuilder>();
+      auto request = message->initRoot<proto::Message>().initOsdRead();
+      request.setOffset(offset);
+      request.setLength(4096);
+      return client->call(std::move(message)).then(
+        [offset] (Connection::MessageReaderPtr&& reader) {
+          auto reply = reader->getRoot<proto::Message>().getOsdReadReply();
+          KJ_REQUIRE(reply.getErrorCode() == static_cast<uint32_t>(offset));
+        });
+    }).then([client] {
+      KJ_REQUIRE(client->in_flight() == 0);
+      std::cout << "got all pipelined replies" << std::endl;
+    }).finally([client, offsets] {
+      return client->close().finally([client] {});
+    });
+}
+
+/// Echo the data of an osd_write back in an osd_read_reply, using a small
+/// first segment so that the reply spans many segments
+future<> run_echo_server(shared_ptr<Connection> conn)
+{
+  return conn->read_message().then(
+    [conn] (Connection::MessageReaderPtr&& reader) {
+      auto data = reader->getRoot<proto::Message>().getOsdWrite().getData();
+      auto message = std::make_unique<capnp::MallocMessageBuilder>(16);
+      auto reply = message->initRoot<proto::Message>().initOsdReadReply();
+      reply.setData(data);
+      return conn->write_message(std::move(message));
+    }).finally([conn] {
+      return conn->close().finally([conn] {});
+    });
+}
+
+/// Send an osd_write that spans many segments, and check that the echoed
+/// reply matches
+future<> run_echo_client(shared_ptr<Connection> conn)
+{
+  const size_t size = 256 * 1024;
+  auto message = std::make_unique<capnp::MallocMessageBuilder>(16);
+  auto request = message->initRoot<proto::Message>().initOsdWrite();
+  request.setObject("multisegment");
+  request.setLength(size);
+  auto data = request.initData(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = i % 251;
+  KJ_REQUIRE(message->getSegmentsForOutput().size() > 1);
+
+  return conn->write_message(std::move(message)).then(
+    [conn] {
+      return conn->read_message();
+    }).then([size] (Connection::MessageReaderPtr&& reader) {
+      auto data = reader->getRoot<proto::Message>().getOsdReadReply().getData();
+      KJ_REQUIRE(data.size() == size, data.size());
+      for (size_t i = 0; i < size; i++)
+        KJ_REQUIRE(data[i] == i % 251, i);
+      std::cout << "got multi-segment reply" << std::endl;
+    }).finally([conn] {
+      return conn->close().finally([conn] {});
+    });
+}
+
+/// Read a write request in three chunks and reply to it once, then stream
+/// three replies to a read request
+future<> run_streaming_server(shared_ptr<Connection> conn)
+{
+  const size_t count = 3;
+  auto chunks = make_lw_shared<std::vector<Connection::MessageReaderPtr>>();
+  return seastar::do_until([chunks, count] { return chunks->size() == count; },
+    [conn, chunks] {
+      return conn->read_message().then(
+        [chunks] (Connection::MessageReaderPtr&& reader) {
+          chunks->push_back(std::move(reader));
+        });
+    }).then([conn, chunks] {
+      auto sequence = chunks->front()->getRoot<proto::Message>()
+          .getHeader().getSequence();
+      for (auto& chunk : *chunks) {
+        auto root = chunk->getRoot<proto::Message>();
+        KJ_REQUIRE(root.getHeader().getSequence() == sequence);
+        KJ_REQUIRE(root.getOsdWrite().getMore() == (&chunk != &chunks->back()));
+      }
+      auto message = make_message();
+      auto root = message->initRoot<proto::Message>();
+      root.initHeader().setSequence(sequence);
+      root.initOsdWriteReply().setFlags(proto::osd::write::ON_APPLY);
+      return conn->write_message(std::move(message));
+    }).then([conn] {
+      return conn->read_message();
+    }).then([conn, count] (Connection::MessageReaderPtr&& reader) {
+      auto sequence = reader->getRoot<proto::Message>()
+          .getHeader().getSequence();
+      auto i = make_lw_shared<uint32_t>(0);
+      return seastar::do_until([i, count] { return *i == count; },
+        [conn, sequence, i, count] {
+          auto message = make_message();
+          auto root = message->initRoot<proto::Message>();
+          root.initHeader().setSequence(sequence);
+          auto reply = root.initOsdReadReply();
+          reply.setOffset(*i);
+          reply.setMore(++*i < count);
+          return conn->write_message(std::move(message));
+        });
+    }).then([conn] {
+      // wait for the client to hang up
+      return seastar::repeat([conn] {
+          return conn->read_message().then([] (auto&&) {
+              return seastar::stop_iteration::no;
+            });
+        }).handle_exception([] (auto eptr) {});
+    }).finally([conn, chunks] {
+      return conn->close().finally([conn] {});
+    });
+}
+
+/// Send a write in three chunks, then consume a read's streamed replies
+future<> run_streaming_client(shared_ptr<Connection> conn)
+{
+  auto client = make_lw_shared<RpcClient>(conn);
+  auto n = make_lw_shared<uint32_t>(0);
+  return client->call_chunked([n] () -> Connection::MessageBuilderPtr {
+      if (*n == 3)
+        return nullptr;
+      auto message = make_message();
+      auto args = message->initRoot<proto::Message>().initOsdWrite();
+      args.setOffset(*n);
+      args.setMore(++*n < 3);
+      return std::move(message);
+    }).then([client] (Connection::MessageReaderPtr&& reply) {
+      KJ_REQUIRE(reply->getRoot<proto::Message>().getOsdWriteReply().isFlags());
+      auto message = make_message();
+      message->initRoot<proto::Message>().initOsdRead().setChunkSize(1);
+      auto count = make_lw_shared<uint32_t>(0);
+      return client->call_streamed(std::move(message),
+        [count] (Connection::MessageReaderPtr&& reply) {
+          auto res = reply->getRoot<proto::Message>().getOsdReadReply();
+          KJ_REQUIRE(res.getOffset() == (*count)++);
+          return res.getMore() ? seastar::stop_iteration::no
+                               : seastar::stop_iteration::yes;
+        }).then([client, count] {
+          KJ_REQUIRE(*count == 3, *count);
+          KJ_REQUIRE(client->in_flight() == 0);
+          std::cout << "got chunked and streamed replies" << std::endl;
+        });
+    }).finally([client] {
+      return client->close().finally([client] {});
+    });
+}
+
 future<> test_direct_connection()
 {
   // start a listener
@@ -114,6 +316,211 @@ future<> test_socket_connection()
     }).finally([listener] {});
 }
 
+future<> test_cross_core_connection()
+{
+  if (smp::count < 2) {
+    std::cout << "skipping cross-core test with a single core" << std::endl;
+    return now();
+  }
+  // run the server on the next core
+  auto cpu = (engine().cpu_id() + 1) % smp::count;
+  return CrossCoreConnection::connect(cpu,
+    [] (shared_ptr<Connection> conn) {
+      run_mock_server(conn);
+    }).then(
+      &run_mock_client
+    ).then([] (auto result) {
+      KJ_REQUIRE(result == ENOENT);
+    });
+}
+
+future<> test_direct_pipeline()
+{
+  const size_t count = 16;
+  auto listener = make_shared<DirectListener>();
+  listener->accept().then([count] (auto conn) {
+      return run_reordering_server(conn, count);
+    });
+
+  return listener->connect().then(
+    [count] (auto conn) {
+      return run_pipelined_client(conn, count);
+    }).finally([listener] {});
+}
+
+future<> test_direct_flow_control()
+{
+  // the reader queues at most two unread messages
+  auto c = DirectConnection::make_pair(2);
+  auto writer = c.first;
+  auto reader = c.second;
+
+  auto write = [writer] {
+    auto message = make_message();
+    message->initRoot<proto::Message>().initOsdRead();
+    return writer->write_message(std::move(message));
+  };
+  auto first = write();
+  auto second = write();
+  auto third = write();
+  KJ_REQUIRE(first.available() && second.available());
+  KJ_REQUIRE(!third.available(), "write must wait for credits");
+
+  // reading a message returns its credit to the writer
+  return reader->read_message().then(
+    [third = std::move(third)] (auto&&) mutable {
+      return std::move(third);
+    }).then([] {
+      std::cout << "blocked write resumed after read" << std::endl;
+    }).finally([writer, reader] {
+      return writer->close().finally([writer, reader] {});
+    });
+}
+
+future<> test_inbound_budget()
+{
+  auto budget = make_lw_shared<InboundBudget>(1024);
+  auto first = budget->charge(1000);
+  auto second = budget->charge(100);
+  KJ_REQUIRE(first.available());
+  KJ_REQUIRE(!second.available(), "charge must wait for the budget");
+  auto large = budget->charge(4096);
+  KJ_REQUIRE(large.failed(), "a charge over the limit must be refused");
+  large.ignore_ready_future();
+
+  return first.then([second = std::move(second)] (seastar::deleter d) mutable {
+      // releasing the first charge admits the second
+      d = seastar::deleter();
+      return std::move(second);
+    }).then([budget] (seastar::deleter d) {
+      KJ_REQUIRE(budget->get_available() == 1024 - 100);
+      std::cout << "inbound budget admitted charges in order" << std::endl;
+    });
+}
+
+future<> test_direct_streaming()
+{
+  auto c = DirectConnection::make_pair();
+  run_streaming_server(c.second);
+  return run_streaming_client(c.first);
+}
+
+future<> test_socket_pipeline()
+{
+  const size_t count = 16;
+  auto addr = seastar::make_ipv4_address({"127.0.0.1", 3679});
+
+  auto listener = make_shared<SocketListener>(addr);
+  listener->accept().then([count] (auto conn) {
+      return run_reordering_server(conn, count);
+    });
+
+  return engine().connect(addr).then(
+    [addr, count] (connected_socket fd) {
+      auto conn = make_shared<SocketConnection>(std::move(fd), addr);
+      conn->set_cork(true);
+      return run_pipelined_client(conn, count);
+    }).finally([listener] {});
+}
+
+future<> test_socket_multisegment()
+{
+  auto addr = seastar::make_ipv4_address({"127.0.0.1", 3680});
+
+  auto listener = make_shared<SocketListener>(addr);
+  listener->accept().then(&run_echo_server);
+
+  return engine().connect(addr).then(
+    [addr] (connected_socket fd) {
+      auto conn = make_shared<SocketConnection>(std::move(fd), addr);
+      return run_echo_client(conn);
+    }).finally([listener] {});
+}
+
+/// Stream over a socket, whose writes resolve later, so that call_chunked
+/// asks for each chunk after its repeat() body has been moved
+future<> test_socket_streaming()
+{
+  auto addr = seastar::make_ipv4_address({"127.0.0.1", 3681});
+
+  auto listener = make_shared<SocketListener>(addr);
+  listener->accept().then(&run_streaming_server);
+
+  return engine().connect(addr).then(
+    [addr] (connected_socket fd) {
+      auto conn = make_shared<SocketConnection>(std::move(fd), addr);
+      return run_streaming_client(conn);
+    }).finally([listener] {});
+}
+
+future<> test_shm_connection()
+{
+  auto listener = make_shared<ShmListener>("test_messenger.shm");
+  listener->accept().then(&run_mock_server);
+
+  return ShmConnection::connect(listener->get_path()).then(
+      &run_mock_client
+    ).then([] (auto result) {
+      KJ_REQUIRE(result == ENOENT);
+    }).finally([listener] {
+      return listener->close().finally([listener] {});
+    });
+}
+
+/// Pipeline enough requests through the smallest ring that it wraps many
+/// times, and writers wait for the reader to make room
+future<> test_shm_pipeline()
+{
+  const size_t count = 1000;
+  auto listener = make_shared<ShmListener>("test_messenger.shm");
+  listener->accept().then([count] (auto conn) {
+      return run_reordering_server(conn, count);
+    });
+
+  return ShmConnection::connect(listener->get_path(),
+                                ShmConnection::min_ring_size).then(
+    [count] (shared_ptr<Connection> conn) {
+      return run_pipelined_client(conn, count);
+    }).finally([listener] {
+      return listener->close().finally([listener] {});
+    });
+}
+
+future<> test_shm_multisegment()
+{
+  auto listener = make_shared<ShmListener>("test_messenger.shm");
+  listener->accept().then(&run_echo_server);
+
+  return ShmConnection::connect(listener->get_path()).then(
+      &run_echo_client
+    ).finally([listener] {
+      return listener->close().finally([listener] {});
+    });
+}
+
+/// Drop a client without closing it, as if its process died, and check
+/// that the server's read fails rather than waiting for it forever
+future<> test_shm_hangup()
+{
+  auto listener = make_shared<ShmListener>("test_messenger.shm");
+  auto accepted = listener->accept();
+
+  return ShmConnection::connect(listener->get_path()).then(
+    [accepted = std::move(accepted)] (shared_ptr<Connection> client) mutable {
+      client = nullptr;
+      return std::move(accepted);
+    }).then([] (shared_ptr<Connection> conn) {
+      return conn->read_message().then_wrapped(
+        [conn] (future<Connection::MessageReaderPtr> f) {
+          KJ_REQUIRE(f.failed(), "read from a client that hung up");
+          f.ignore_ready_future();
+          std::cout << "server saw the client hang up" << std::endl;
+        });
+    }).finally([listener] {
+      return listener->close().finally([listener] {});
+    });
+}
+
 } // anonymous namespace
 
 int main(int argc, char** argv)
@@ -124,6 +531,30 @@ int main(int argc, char** argv)
           &test_direct_connection
         ).then(
           &test_socket_connection
+        ).then(
+          &test_cross_core_connection
+        ).then(
+          &test_direct_pipeline
+        ).then(
+          &test_direct_flow_control
+        ).then(
+          &test_inbound_budget
+        ).then(
+          &test_direct_streaming
+        ).then(
+          &test_socket_pipeline
+        ).then(
+          &test_socket_multisegment
+        ).then(
+          &test_socket_streaming
+        ).then(
+          &test_shm_connection
+        ).then(
+          &test_shm_pipeline
+        ).then(
+          &test_shm_multisegment
+        ).then(
+          &test_shm_hangup
         ).then([] {
           std::cout << "All tests succeeded" << std::endl;
         }).handle_exception([] (auto eptr) {
@@ -0,0 +1,1009 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+// Crimson: a prototype high performance OSD
+
+// Copyright (C) 2016 Red Hat, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation; either version 2.1 of
+// the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301 USA
+
+#include "osd/mclock_scheduler.h"
+#include "osd/log_store.h"
+#include "osd/memory_store.h"
+#include "osd/object_index.h"
+#include "osd/osd.h"
+#include "osd/pg_sequencer.h"
+#include "osd/placement.h"
+#include "osd/write_stages.h"
+#include "crimson.capnp.h"
+#include <algorithm>
+#include <capnp/message.h>
+#include <kj/debug.h>
+#include <core/app-template.hh>
+#include <core/distributed.hh>
+#include <core/future-util.hh>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+using namespace crimson;
+using namespace crimson::osd;
+
+namespace {
+
+using MessageReaderPtr = OSD::MessageReaderPtr;
+using MessageBuilderPtr = OSD::MessageBuilderPtr;
+
+/// Adapt a MessageBuilder into a MessageReader, as DirectConnection would
+class BuilderReader : public capnp::SegmentArrayMessageReader {
+  MessageBuilderPtr message;
+ public:
+  BuilderReader(MessageBuilderPtr&& builder)
+    : SegmentArrayMessageReader(builder->getSegmentsForOutput()),
+      message(std::move(builder)) {}
+};
+
+MessageReaderPtr make_reader(MessageBuilderPtr&& message)
+{
+  return std::make_unique<BuilderReader>(std::move(message));
+}
+
+MessageReaderPtr make_write(const char* oid, uint64_t offset,
+                            const std::string& data,
+                            uint32_t flags = proto::osd::write::ON_APPLY)
+{
+  auto message = std::make_unique<capnp::MallocMessageBuilder>();
+  auto root = message->initRoot<proto::Message>();
+  root.initHeader().setSequence(offset);
+  auto args = root.initOsdWrite();
+  args.setObject(oid);
+  args.setOffset(offset);
+  args.setLength(data.size());
+  args.setData(capnp::Data::Reader(
+          reinterpret_cast<const capnp::byte*>(data.data()), data.size()));
+  args.setFlags(flags);
+  return make_reader(std::move(message));
+}
+
+MessageReaderPtr make_read(const char* oid, uint64_t offset, uint64_t length)
+{
+  auto message = std::make_unique<capnp::MallocMessageBuilder>();
+  auto root = message->initRoot<proto::Message>();
+  root.initHeader().setSequence(offset);
+  auto args = root.initOsdRead();
+  args.setObject(oid);
+  args.setOffset(offset);
+  args.setLength(length);
+  return make_reader(std::move(message));
+}
+
+/// Write a few objects that hash to different cores, and read them back
+future<> test_read_write(OSD& osd)
+{
+  static const char* oids[] = {"obj.a", "obj.b", "obj.c", "obj.d",
+                               "obj.e", "obj.f", "obj.g", "obj.h"};
+  return do_for_each(std::begin(oids), std::end(oids),
+    [&osd] (const char* oid) {
+      // write past the start to leave a hole
+      return osd.handle_message(make_write(oid, 4, oid)).then(
+        [&osd, oid] (MessageBuilderPtr&& message) {
+          auto reply = make_reader(std::move(message));
+          auto root = reply->getRoot<proto::Message>();
+          KJ_REQUIRE(root.getHeader().getSequence() == 4);
+          auto res = root.getOsdWriteReply();
+          KJ_REQUIRE(res.isFlags());
+          KJ_REQUIRE(res.getFlags() == proto::osd::write::ON_APPLY);
+          return osd.handle_message(make_read(oid, 0, 1024));
+        }).then([oid] (MessageBuilderPtr&& message) {
+          auto reply = make_reader(std::move(message));
+          auto res = reply->getRoot<proto::Message>().getOsdReadReply();
+          KJ_REQUIRE(res.getErrorCode() == 0);
+          auto data = res.getData();
+          const auto len = strlen(oid);
+          KJ_REQUIRE(data.size() == 4 + len, data.size());
+          for (size_t i = 0; i < 4; i++)
+            KJ_REQUIRE(data[i] == 0);
+          KJ_REQUIRE(memcmp(data.begin() + 4, oid, len) == 0);
+        });
+    });
+}
+
+future<> test_enoent(OSD& osd)
+{
+  return osd.handle_message(make_read("missing", 0, 1024)).then(
+    [] (MessageBuilderPtr&& message) {
+      auto reply = make_reader(std::move(message));
+      auto res = reply->getRoot<proto::Message>().getOsdReadReply();
+      KJ_REQUIRE(res.getErrorCode() == ENOENT);
+    });
+}
+
+/// Read a range of several extents with a hole between them, and check
+/// that the reply carries them as extents rather than gathering them
+future<> test_extents_reply(OSD& osd)
+{
+  const size_t size = 8192;
+  return osd.handle_message(make_write("extents", 0, std::string(size, 'a')))
+    .then([&osd, size] (MessageBuilderPtr&&) {
+      return osd.handle_message(make_write("extents", 2 * size,
+                                           std::string(size, 'b')));
+    }).then([&osd, size] (MessageBuilderPtr&&) {
+      return osd.handle_message(make_read("extents", 0, 3 * size));
+    }).then([size] (MessageBuilderPtr&& message) {
+      auto reply = make_reader(std::move(message));
+      auto res = reply->getRoot<proto::Message>().getOsdReadReply();
+      KJ_REQUIRE(res.getErrorCode() == 0);
+      KJ_REQUIRE(res.getData().size() == 0);
+      auto extents = res.getExtents();
+      KJ_REQUIRE(extents.size() == 3, extents.size());
+      std::string data;
+      for (auto extent : extents)
+        data.append(reinterpret_cast<const char*>(extent.begin()),
+                    extent.size());
+      KJ_REQUIRE(data == std::string(size, 'a') + std::string(size, '\0') +
+                         std::string(size, 'b'));
+    });
+}
+
+/// Check that ranges outside the OSD's limits are rejected before they
+/// reach the store
+future<> test_bad_range(OSD& osd)
+{
+  auto error_of = [] (MessageBuilderPtr&& message) {
+    auto reply = make_reader(std::move(message));
+    auto root = reply->getRoot<proto::Message>();
+    return root.isOsdReadReply() ? root.getOsdReadReply().getErrorCode()
+                                 : root.getOsdWriteReply().getErrorCode();
+  };
+  return osd.handle_message(make_write("range", ~0ull - 2, "wraps")).then(
+    [&osd, error_of] (MessageBuilderPtr&& message) {
+      KJ_REQUIRE(error_of(std::move(message)) == EINVAL);
+      return osd.handle_message(make_write("range",
+          ObjectStore::max_object_size, "too far"));
+    }).then([&osd, error_of] (MessageBuilderPtr&& message) {
+      KJ_REQUIRE(error_of(std::move(message)) == EFBIG);
+      return osd.handle_message(make_read("range", 0,
+          OSD::max_read_length + 1));
+    }).then([&osd, error_of] (MessageBuilderPtr&& message) {
+      KJ_REQUIRE(error_of(std::move(message)) == EINVAL);
+      return osd.handle_message(make_read("range", ~0ull - 2, 5));
+    }).then([error_of] (MessageBuilderPtr&& message) {
+      KJ_REQUIRE(error_of(std::move(message)) == EINVAL);
+    });
+}
+
+/// Write an object in chunks that share a sequence, then read it back in a
+/// stream of smaller chunks
+future<> test_streaming(OSD& osd)
+{
+  const uint32_t sequence = 42;
+  const size_t chunk = 8192;
+  const size_t count = 3;
+  auto session = make_lw_shared<OSD::Session>();
+  auto replies = make_lw_shared<std::vector<MessageReaderPtr>>();
+  auto send = [replies] (MessageBuilderPtr&& reply) {
+    replies->push_back(make_reader(std::move(reply)));
+    return now();
+  };
+
+  std::vector<MessageReaderPtr> chunks;
+  for (size_t i = 0; i < count; i++) {
+    auto message = std::make_unique<capnp::MallocMessageBuilder>();
+    auto root = message->initRoot<proto::Message>();
+    root.initHeader().setSequence(sequence);
+    auto args = root.initOsdWrite();
+    args.setObject("streamed");
+    args.setOffset(i * chunk);
+    args.setLength(chunk);
+    auto data = args.initData(chunk);
+    std::fill(data.begin(), data.end(), 'a' + i);
+    args.setFlags(proto::osd::write::ON_APPLY);
+    args.setMore(i + 1 < count);
+    chunks.push_back(make_reader(std::move(message)));
+  }
+  auto writes = make_lw_shared(std::move(chunks));
+
+  return do_for_each(writes->begin(), writes->end(),
+    [&osd, session, send] (MessageReaderPtr& request) {
+      return osd.handle_message(std::move(request), *session, send);
+    }).then([&osd, session, send, replies, writes] {
+      // a single reply for the whole write
+      KJ_REQUIRE(replies->size() == 1, replies->size());
+      auto root = replies->front()->getRoot<proto::Message>();
+      KJ_REQUIRE(root.getHeader().getSequence() == sequence);
+      KJ_REQUIRE(root.getOsdWriteReply().isFlags());
+      KJ_REQUIRE(session->writes.empty());
+      replies->clear();
+
+      auto message = std::make_unique<capnp::MallocMessageBuilder>();
+      auto request = message->initRoot<proto::Message>();
+      request.initHeader().setSequence(sequence);
+      auto args = request.initOsdRead();
+      args.setObject("streamed");
+      args.setLength(chunk * count);
+      args.setChunkSize(chunk / 2);
+      return osd.handle_message(make_reader(std::move(message)), *session, send);
+    }).then([replies] {
+      KJ_REQUIRE(replies->size() == count * 2, replies->size());
+      uint64_t offset = 0;
+      for (auto& reply : *replies) {
+        auto res = reply->getRoot<proto::Message>().getOsdReadReply();
+        KJ_REQUIRE(res.getErrorCode() == 0);
+        KJ_REQUIRE(res.getOffset() == offset, res.getOffset());
+        auto data = res.getData();
+        KJ_REQUIRE(data.size() == chunk / 2, data.size());
+        for (auto c : data)
+          KJ_REQUIRE(c == 'a' + offset / chunk);
+        offset += data.size();
+        KJ_REQUIRE(res.getMore() == (offset < chunk * count));
+      }
+    });
+}
+
+/// Send a streamed write whose chunks go to several objects, which may be
+/// owned by different cores, and check that its commit covers them all
+future<> test_streamed_objects(OSD& osd)
+{
+  static const char* oids[] = {"chunk.a", "chunk.b", "chunk.c", "chunk.d"};
+  const uint32_t sequence = 43;
+  const size_t count = std::end(oids) - std::begin(oids);
+  auto session = make_lw_shared<OSD::Session>();
+  auto replies = make_lw_shared<std::vector<MessageReaderPtr>>();
+  auto send = [replies] (MessageBuilderPtr&& reply) {
+    replies->push_back(make_reader(std::move(reply)));
+    return now();
+  };
+  auto chunks = make_lw_shared<std::vector<MessageReaderPtr>>();
+  for (size_t i = 0; i < count; i++) {
+    auto message = std::make_unique<capnp::MallocMessageBuilder>();
+    auto root = message->initRoot<proto::Message>();
+    root.initHeader().setSequence(sequence);
+    auto args = root.initOsdWrite();
+    args.setObject(oids[i]);
+    args.setLength(strlen(oids[i]));
+    args.setData(capnp::Data::Reader(
+            reinterpret_cast<const capnp::byte*>(oids[i]), strlen(oids[i])));
+    args.setFlags(proto::osd::write::ON_COMMIT);
+    args.setMore(i + 1 < count);
+    chunks->push_back(make_reader(std::move(message)));
+  }
+
+  return do_for_each(chunks->begin(), chunks->end(),
+    [&osd, session, send] (MessageReaderPtr& request) {
+      return osd.handle_message(std::move(request), *session, send);
+    }).then([&osd, session, replies, chunks] {
+      KJ_REQUIRE(replies->size() == 1, replies->size());
+      auto res = replies->front()->getRoot<proto::Message>()
+          .getOsdWriteReply();
+      KJ_REQUIRE(res.isFlags());
+      KJ_REQUIRE(res.getFlags() == proto::osd::write::ON_COMMIT);
+      KJ_REQUIRE(session->writes.empty());
+      return do_for_each(std::begin(oids), std::end(oids),
+        [&osd] (const char* oid) {
+          return osd.handle_message(make_read(oid, 0, 64)).then(
+            [oid] (MessageBuilderPtr&& message) {
+              auto reply = make_reader(std::move(message));
+              auto res = reply->getRoot<proto::Message>().getOsdReadReply();
+              KJ_REQUIRE(res.getErrorCode() == 0);
+              auto data = res.getData();
+              KJ_REQUIRE(data.size() == strlen(oid), data.size());
+              KJ_REQUIRE(memcmp(data.begin(), oid, data.size()) == 0);
+            });
+        });
+    });
+}
+
+/// Write and read objects on every core in a single batch, along with a
+/// read of a missing object
+future<> test_batch(OSD& osd)
+{
+  static const char* oids[] = {"batch.a", "batch.b", "batch.c", "batch.d",
+                               "batch.e", "batch.f", "batch.g", "batch.h"};
+  const size_t n = std::end(oids) - std::begin(oids);
+  auto message = std::make_unique<capnp::MallocMessageBuilder>();
+  auto root = message->initRoot<proto::Message>();
+  root.initHeader().setSequence(7);
+  auto ops = root.initBatch(2 * n + 1);
+  for (size_t i = 0; i < n; i++) {
+    // each write is followed by a read of the same object
+    auto write = ops[2 * i].initOsdWrite();
+    write.setObject(oids[i]);
+    write.setLength(strlen(oids[i]));
+    write.setData(capnp::Data::Reader(
+            reinterpret_cast<const capnp::byte*>(oids[i]), strlen(oids[i])));
+    write.setFlags(proto::osd::write::ON_APPLY);
+    auto read = ops[2 * i + 1].initOsdRead();
+    read.setObject(oids[i]);
+    read.setLength(1024);
+  }
+  ops[2 * n].initOsdRead().setObject("batch.missing");
+
+  return osd.handle_message(make_reader(std::move(message))).then(
+    [n] (MessageBuilderPtr&& message) {
+      auto reply = make_reader(std::move(message));
+      auto root = reply->getRoot<proto::Message>();
+      KJ_REQUIRE(root.getHeader().getSequence() == 7);
+      auto replies = root.getBatchReply();
+      KJ_REQUIRE(replies.size() == 2 * n + 1, replies.size());
+      for (size_t i = 0; i < n; i++) {
+        auto write = replies[2 * i].getOsdWriteReply();
+        KJ_REQUIRE(write.isFlags());
+        auto read = replies[2 * i + 1].getOsdReadReply();
+        KJ_REQUIRE(read.getErrorCode() == 0);
+        auto data = read.getData();
+        KJ_REQUIRE(data.size() == strlen(oids[i]), data.size());
+        KJ_REQUIRE(memcmp(data.begin(), oids[i], data.size()) == 0);
+      }
+      KJ_REQUIRE(replies[2 * n].getOsdReadReply().getErrorCode() == ENOENT);
+    });
+}
+
+/// Check that a batch whose reads add up to more than a single read may
+/// ask for is refused as a whole
+future<> test_batch_limit(OSD& osd)
+{
+  auto message = std::make_unique<capnp::MallocMessageBuilder>();
+  auto root = message->initRoot<proto::Message>();
+  root.initHeader().setSequence(8);
+  auto ops = root.initBatch(2);
+  for (auto op : ops) {
+    auto read = op.initOsdRead();
+    read.setObject("batch.a");
+    read.setLength(OSD::max_read_length / 2 + 1);
+  }
+  return osd.handle_message(make_reader(std::move(message))).then_wrapped(
+    [] (future<MessageBuilderPtr> f) {
+      try {
+        f.get();
+        KJ_FAIL_REQUIRE("executed a batch that reads too much");
+      } catch (std::system_error& e) {
+        KJ_REQUIRE(e.code().value() == E2BIG, e.code().value());
+      }
+    });
+}
+
+/// Check that ops in a placement group are admitted in arrival order, and
+/// that other placement groups aren't held up
+future<> test_pg_sequencer()
+{
+  PGSequencer seq;
+  auto write1 = seq.admit(1, true);
+  auto read1 = seq.admit(1, false);
+  auto read2 = seq.admit(1, false);
+  auto write2 = seq.admit(1, true);
+  auto other = seq.admit(2, true);
+  KJ_REQUIRE(write1.available() && other.available());
+  KJ_REQUIRE(!read1.available() && !read2.available() && !write2.available());
+  KJ_REQUIRE(seq.waiting(1) == 3);
+
+  // reads after the write run together
+  seq.release(1, true);
+  KJ_REQUIRE(read1.available() && read2.available() && !write2.available());
+  seq.release(1, false);
+  KJ_REQUIRE(!write2.available());
+  // the second write waits for both reads
+  seq.release(1, false);
+  KJ_REQUIRE(write2.available());
+  KJ_REQUIRE(seq.waiting(1) == 0);
+  seq.release(1, true);
+  seq.release(2, true);
+  return seastar::when_all(std::move(write1), std::move(read1), std::move(read2),
+                           std::move(write2), std::move(other)).discard_result();
+}
+
+/// Check that placement groups are spread by weight, and that updating a
+/// table gives the same placement as building it from scratch
+future<> test_placement()
+{
+  auto same = [] (const PlacementTable& a, const PlacementTable& b) {
+    for (uint32_t pg = 0; pg < pg_count; pg++) {
+      if (a.pg_osd(pg) != b.pg_osd(pg) || a.pg_core(pg) != b.pg_core(pg))
+        return false;
+    }
+    return true;
+  };
+  auto count = [] (const PlacementTable& table, int32_t osd) {
+    size_t pgs = 0;
+    for (uint32_t pg = 0; pg < pg_count; pg++)
+      pgs += table.pg_osd(pg) == osd;
+    return pgs;
+  };
+
+  PlacementMap map{1, {{0, 1.0, 4}, {1, 1.0, 4}, {2, 2.0, 8}}};
+  PlacementTable table(map);
+  KJ_REQUIRE(count(table, 2) > count(table, 0) + count(table, 1) / 2);
+  for (uint32_t pg = 0; pg < pg_count; pg++)
+    KJ_REQUIRE(table.pg_core(pg) < (table.pg_osd(pg) == 2 ? 8u : 4u));
+
+  // adding an OSD only moves pgs onto it
+  auto added = map;
+  added.osds.push_back({3, 1.0, 4});
+  auto moved = table.update(added);
+  KJ_REQUIRE(same(table, PlacementTable(added)));
+  KJ_REQUIRE(moved == count(table, 3), moved);
+  KJ_REQUIRE(moved > 0 && moved < pg_count / 2, moved);
+
+  // reweight, reshape and remove
+  auto changed = added;
+  changed.osds[0].weight = 0;
+  changed.osds[1].cores = 2;
+  changed.osds[2].weight = 3.0;
+  changed.osds.pop_back();
+  table.update(changed);
+  KJ_REQUIRE(same(table, PlacementTable(changed)));
+  KJ_REQUIRE(count(table, 0) == 0 && count(table, 3) == 0);
+
+  try {
+    table.update(PlacementMap{2, {{0, 0.0, 1}}});
+    KJ_FAIL_REQUIRE("accepted a map without weight");
+  } catch (std::invalid_argument&) {}
+  return now();
+}
+
+/// Check that a client with three times the weight gets about three times
+/// the ops while both are backlogged
+future<> test_mclock_weights()
+{
+  auto sched = make_lw_shared<MClockScheduler>(1);
+  sched->set_client_info(1, ClientInfo{0, 1, 0});
+  sched->set_client_info(2, ClientInfo{0, 3, 0});
+
+  // hold the only slot while both clients queue ops
+  auto first = sched->admit(1);
+  KJ_REQUIRE(first.available());
+  auto order = make_lw_shared<std::vector<int>>();
+  auto ops = make_lw_shared<std::vector<future<>>>();
+  for (int i = 0; i < 8; i++) {
+    for (int client : {1, 2}) {
+      ops->push_back(sched->admit(client).then(
+        [sched, order, client] (MClockScheduler::Phase) {
+          order->push_back(client);
+          sched->complete();
+        }));
+    }
+  }
+  KJ_REQUIRE(sched->waiting() == 16);
+  sched->complete();
+
+  return seastar::when_all(ops->begin(), ops->end()).then(
+    [sched, order, ops] (std::vector<future<>>) {
+      KJ_REQUIRE(order->size() == 16);
+      auto heavy = std::count(order->begin(), order->begin() + 8, 2);
+      KJ_REQUIRE(heavy >= 5, heavy);
+      std::cout << "weighted client got " << heavy << " of the first 8 ops"
+          << std::endl;
+    });
+}
+
+/// Check that a client's limit holds back its ops until they're due
+future<> test_mclock_limit()
+{
+  auto sched = make_lw_shared<MClockScheduler>(4);
+  sched->set_client_info(1, ClientInfo{0, 1, 100});
+  auto first = sched->admit(1);
+  KJ_REQUIRE(first.available());
+  sched->complete();
+
+  auto start = std::chrono::steady_clock::now();
+  auto second = sched->admit(1);
+  KJ_REQUIRE(!second.available(), "op must wait for its limit");
+  return second.then([sched, start] (MClockScheduler::Phase phase) {
+      KJ_REQUIRE(phase == MClockScheduler::Phase::priority);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      KJ_REQUIRE(elapsed >= std::chrono::milliseconds(5));
+      sched->complete();
+    });
+}
+
+} // anonymous namespace
+
+/// Check the delay specs, then inject a commit delay on every core and check
+/// that only writes that ask for the commit wait for it, and a post-apply
+/// delay and check that writes to one object don't wait out each other's
+future<> test_write_stages(OSD& osd)
+{
+  using std::chrono::microseconds;
+  KJ_REQUIRE(!DelayModel::parse("none").enabled());
+  KJ_REQUIRE(DelayModel::parse("fixed:50").next_delay() == microseconds(50));
+  auto uniform = DelayModel::parse("uniform:10:20");
+  for (int i = 0; i < 100; i++) {
+    auto delay = uniform.next_delay();
+    KJ_REQUIRE(delay >= microseconds(10) && delay <= microseconds(20));
+  }
+  // a single server queues ops behind each other
+  auto queue = DelayModel::parse("queue:1000");
+  queue.next_delay();
+  KJ_REQUIRE(queue.next_delay() > microseconds(1000));
+  for (auto spec : {"fixed", "fixed:x", "uniform:20:10", "queue:10:0", "?"}) {
+    try {
+      DelayModel::parse(spec);
+      KJ_FAIL_REQUIRE("parsed a bad spec", spec);
+    } catch (std::invalid_argument&) {}
+  }
+
+  return smp::invoke_on_all([] {
+      WriteStages::local().set_delays(DelayModel(), DelayModel(),
+                                      DelayModel::parse("fixed:20000"));
+    }).then([&osd] {
+      auto start = std::chrono::steady_clock::now();
+      return osd.handle_message(make_write("staged", 0, "applied")).then(
+        [&osd] (MessageBuilderPtr&& message) {
+          auto reply = make_reader(std::move(message));
+          auto res = reply->getRoot<proto::Message>().getOsdWriteReply();
+          KJ_REQUIRE(res.getFlags() == proto::osd::write::ON_APPLY);
+          return osd.handle_message(make_write("staged", 0, "committed",
+              proto::osd::write::ON_APPLY | proto::osd::write::ON_COMMIT));
+        }).then([start] (MessageBuilderPtr&& message) {
+          auto elapsed = std::chrono::steady_clock::now() - start;
+          KJ_REQUIRE(elapsed >= std::chrono::milliseconds(20));
+          auto reply = make_reader(std::move(message));
+          auto res = reply->getRoot<proto::Message>().getOsdWriteReply();
+          KJ_REQUIRE(res.getFlags() & proto::osd::write::ON_COMMIT);
+        });
+    }).then([] {
+      return smp::invoke_on_all([] {
+          WriteStages::local().set_delays(DelayModel(),
+                                          DelayModel::parse("fixed:20000"),
+                                          DelayModel());
+        });
+    }).then([&osd] {
+      // writes to one object are ordered, but their post-apply delays
+      // overlap rather than holding up the writes behind them
+      auto start = std::chrono::steady_clock::now();
+      std::vector<future<MessageBuilderPtr>> writes;
+      for (int i = 0; i < 4; i++)
+        writes.push_back(osd.handle_message(make_write("staged", 0, "again")));
+      return seastar::when_all(writes.begin(), writes.end()).then(
+        [start] (std::vector<future<MessageBuilderPtr>> replies) {
+          for (auto& reply : replies)
+            reply.get();
+          auto elapsed = std::chrono::steady_clock::now() - start;
+          KJ_REQUIRE(elapsed < std::chrono::milliseconds(60));
+        });
+    }).finally([] {
+      return smp::invoke_on_all([] {
+          WriteStages::local().set_delays(DelayModel(), DelayModel(),
+                                          DelayModel());
+        });
+    });
+}
+
+/// Check that a write that asks for both onApply and onCommit over a
+/// connection gets a reply for each, in that order
+future<> test_separate_acks(OSD& osd)
+{
+  auto session = make_lw_shared<OSD::Session>();
+  auto replies = make_lw_shared<std::vector<MessageReaderPtr>>();
+  auto send = [replies] (MessageBuilderPtr&& reply) {
+    replies->push_back(make_reader(std::move(reply)));
+    return now();
+  };
+  auto request = make_write("acked", 0, "twice",
+      proto::osd::write::ON_APPLY | proto::osd::write::ON_COMMIT);
+  return osd.handle_message(std::move(request), *session, send).then(
+    [session, replies] {
+      KJ_REQUIRE(replies->size() == 2, replies->size());
+      const uint32_t expected[] = {proto::osd::write::ON_APPLY,
+                                   proto::osd::write::ON_COMMIT};
+      for (size_t i = 0; i < 2; i++) {
+        auto res = (*replies)[i]->getRoot<proto::Message>().getOsdWriteReply();
+        KJ_REQUIRE(res.isFlags() && res.getFlags() == expected[i]);
+      }
+      KJ_REQUIRE(session->writes.empty());
+    });
+}
+
+temporary_buffer make_buffer(const std::string& data)
+{
+  return temporary_buffer(data.data(), data.size());
+}
+
+/// Check that a scan through the ExtentCache doesn't evict extents that
+/// were read more than once
+future<> test_extent_cache()
+{
+  const size_t extent = 4096;
+  ExtentCache cache(16 * extent);
+  auto read = [&cache, extent] (uint64_t position) {
+    if (cache.find(position))
+      return true;
+    cache.insert(position, temporary_buffer(extent));
+    return false;
+  };
+
+  // read the hot extents, then push them out of the recent queue
+  for (uint64_t i = 0; i < 4; i++)
+    KJ_REQUIRE(!read(i));
+  for (uint64_t i = 100; i < 116; i++)
+    KJ_REQUIRE(!read(i));
+  // they're remembered, so a second read keeps them
+  for (uint64_t i = 0; i < 4; i++)
+    KJ_REQUIRE(!read(i));
+  for (uint64_t i = 1000; i < 2000; i++)
+    read(i);
+  for (uint64_t i = 0; i < 4; i++)
+    KJ_REQUIRE(read(i), i);
+  KJ_REQUIRE(cache.get_bytes() <= cache.get_budget());
+  KJ_REQUIRE(cache.get_hits() == 4, cache.get_hits());
+
+  // extents larger than an eighth of the budget aren't cached
+  KJ_REQUIRE(!cache.admits(4 * extent));
+  KJ_REQUIRE(cache.reclaim(extent) >= extent);
+  cache.set_budget(0);
+  KJ_REQUIRE(cache.get_bytes() == 0);
+  return now();
+}
+
+/// Fill an ObjectIndex past several resizes, and check that every object
+/// keeps its value, in place, and that names with the same hash stay
+/// distinct
+future<> test_object_index()
+{
+  ObjectIndex<uint64_t> index;
+  const uint64_t count = 10000;
+  // values don't move as the table grows
+  auto& first = index["obj.0"];
+  for (uint64_t i = 0; i < count; i++)
+    index[ObjectName(string("obj.") + seastar::to_sstring(i))] = i;
+  KJ_REQUIRE(&first == index.find("obj.0"));
+  KJ_REQUIRE(index.size() == count, index.size());
+  KJ_REQUIRE(index.capacity() * 7 >= count * 8, index.capacity());
+  for (uint64_t i = 0; i < count; i++) {
+    auto value = index.find(string("obj.") + seastar::to_sstring(i));
+    KJ_REQUIRE(value && *value == i, i);
+  }
+  KJ_REQUIRE(!index.find("missing"));
+
+  const uint64_t hash = 42;
+  index[ObjectName("one", 3, hash)] = 1;
+  index[ObjectName("two", 3, hash)] = 2;
+  KJ_REQUIRE(*index.find(ObjectName("one", 3, hash)) == 1);
+  KJ_REQUIRE(*index.find(ObjectName("two", 3, hash)) == 2);
+  KJ_REQUIRE(!index.find(ObjectName("six", 3, hash)));
+  KJ_REQUIRE(index.size() == count + 2);
+  return now();
+}
+
+/// Overwrite parts of a MemoryStore object and check that reads see the
+/// latest data, with zeroes in the holes, and that small appends merge
+future<> test_memory_store()
+{
+  auto store = make_lw_shared<MemoryStore>();
+  auto contents = [] (const temporary_buffer& buf) {
+    return std::string(buf.get(), buf.size());
+  };
+  return store->write("obj", 0, make_buffer("aaaaaaaa")).then(
+    [store] (uint64_t) {
+      // an append merges with the extent it extends
+      return store->write("obj", 8, make_buffer("bbbb"));
+    }).then([store] (uint64_t) {
+      KJ_REQUIRE(store->extent_count("obj") == 1);
+      // an overwrite splits the extent
+      return store->write("obj", 4, make_buffer("cc"));
+    }).then([store] (uint64_t) {
+      KJ_REQUIRE(store->extent_count("obj") == 3);
+      return store->write("obj", 20, make_buffer("dd"));
+    }).then([store] (uint64_t) {
+      KJ_REQUIRE(store->extent_count("obj") == 4);
+      return store->read_extents("obj", 0, 64);
+    }).then([store, contents] (std::vector<temporary_buffer> extents) {
+      const char* expected[] = {"aaaa", "cc", "aabbbb",
+                                "\0\0\0\0\0\0\0\0", "dd"};
+      KJ_REQUIRE(extents.size() == 5, extents.size());
+      for (size_t i = 0; i < extents.size(); i++)
+        KJ_REQUIRE(contents(extents[i]) ==
+                   std::string(expected[i], i == 3 ? 8 : strlen(expected[i])),
+                   i);
+      return store->read("obj", 2, 8);
+    }).then([store, contents] (temporary_buffer buf) {
+      KJ_REQUIRE(contents(buf) == "aaccaabb", contents(buf));
+      return store->read("obj", 4, 2);
+    }).then([contents] (temporary_buffer buf) {
+      KJ_REQUIRE(contents(buf) == "cc");
+    });
+}
+
+/// Call \a func with the path of a log in a new directory, and remove them
+/// once the future it returns resolves
+template <typename Func>
+future<> with_temp_log(Func&& func)
+{
+  char dir[] = "test_log_store.XXXXXX";
+  KJ_REQUIRE(::mkdtemp(dir) != nullptr);
+  const string path = string(dir) + "/log";
+  return func(path).finally([path, dir = string(dir)] {
+      ::unlink(path.c_str());
+      ::rmdir(dir.c_str());
+    });
+}
+
+/// Write objects to a LogStore, with overwrites and holes, then reopen it
+/// and check that replaying the log gives back the same objects
+future<> test_log_store(const string& path)
+{
+  const uint64_t capacity = 4 << 20;
+  auto store = make_lw_shared<LogStore>(path, capacity);
+  auto contents = [] (const temporary_buffer& buf) {
+    return std::string(buf.get(), buf.size());
+  };
+  auto check = [contents] (lw_shared_ptr<LogStore> store) {
+    return store->read("a", 0, 100).then([store, contents] (temporary_buffer a) {
+        KJ_REQUIRE(contents(a) == "hello there", contents(a));
+        return store->read("b", 4000, 8192);
+      }).then([store] (temporary_buffer b) {
+        KJ_REQUIRE(b.size() == 8192, b.size());
+        for (size_t i = 0; i < b.size(); i++)
+          KJ_REQUIRE(b[i] == (i < 4096 ? 0 : 'x'));
+        return store->read("c", 0, 1);
+      }).then_wrapped([] (future<temporary_buffer> f) {
+        try {
+          f.get();
+          KJ_FAIL_REQUIRE("read a missing object");
+        } catch (std::system_error& e) {
+          KJ_REQUIRE(e.code().value() == ENOENT);
+        }
+      });
+  };
+
+  return store->open().then([store] {
+      return store->write("a", 0, make_buffer("hello world"));
+    }).then([store] (uint64_t sequence) {
+      return store->write("a", 6, make_buffer("there"));
+    }).then([store] (uint64_t sequence) {
+      temporary_buffer data(5000);
+      std::fill(data.get_write(), data.get_write() + data.size(), 'x');
+      return store->write("b", 8096, std::move(data));
+    }).then([store, capacity] (uint64_t sequence) {
+      KJ_REQUIRE(sequence == 3, sequence);
+      return store->write("c", 0, temporary_buffer(capacity)).then_wrapped(
+        [store, sequence] (future<uint64_t> f) {
+          try {
+            f.get();
+            KJ_FAIL_REQUIRE("overfilled the log");
+          } catch (std::system_error& e) {
+            KJ_REQUIRE(e.code().value() == ENOSPC);
+          }
+          return store->commit(sequence);
+        });
+    }).then([store, check] {
+      KJ_REQUIRE(store->size() == 2, store->size());
+      return check(store);
+    }).then([store] {
+      return store->stop();
+    }).then([path, capacity, check] {
+      auto replayed = make_lw_shared<LogStore>(path, capacity, 1 << 20);
+      return replayed->open().then([replayed, check] {
+          KJ_REQUIRE(replayed->size() == 2, replayed->size());
+          KJ_REQUIRE(replayed->get_tail() > 0);
+          return check(replayed);
+        }).then([replayed, check] {
+          // the second time around, the reads hit the cache
+          KJ_REQUIRE(replayed->get_cache().get_hits() == 0);
+          return check(replayed);
+        }).then([replayed] {
+          KJ_REQUIRE(replayed->get_cache().get_hits() > 0);
+          // the log carries on after the last record
+          return replayed->write("a", 0, make_buffer("jello"));
+        }).then([replayed] (uint64_t sequence) {
+          KJ_REQUIRE(sequence == 4, sequence);
+          return replayed->stop();
+        });
+    });
+}
+
+/// Overwrite the middle of a record, and check that reads of the pieces
+/// left on either side share the cache entry of the whole record
+future<> test_trimmed_cache(const string& path)
+{
+  auto store = make_lw_shared<LogStore>(path, 4 << 20, 1 << 20);
+  return store->open().then([store] {
+      temporary_buffer data(12288);
+      std::fill(data.get_write(), data.get_write() + data.size(), 'x');
+      return store->write("t", 0, std::move(data));
+    }).then([store] (uint64_t sequence) {
+      return store->write("t", 4096, make_buffer("middle"));
+    }).then([store] (uint64_t sequence) {
+      return store->commit(sequence);
+    }).then([store] {
+      return store->read("t", 0, 4096);
+    }).then([store] (temporary_buffer head) {
+      KJ_REQUIRE(store->get_cache().get_hits() == 0);
+      return store->read("t", 8192, 4096);
+    }).then([store] (temporary_buffer tail) {
+      KJ_REQUIRE(tail.size() == 4096 && tail[0] == 'x', tail.size());
+      KJ_REQUIRE(store->get_cache().get_hits() == 1,
+                 store->get_cache().get_hits());
+      KJ_REQUIRE(store->get_cache().get_bytes() == 12288,
+                 store->get_cache().get_bytes());
+      return store->stop();
+    });
+}
+
+/// Corrupt the end of a record that spans two blocks, and check that the
+/// records written after replay survive the next one
+future<> test_torn_record(const string& path)
+{
+  const uint64_t capacity = 1 << 20;
+  auto store = make_lw_shared<LogStore>(path, capacity);
+  return store->open().then([store] {
+      return store->write("a", 0, make_buffer("first"));
+    }).then([store] (uint64_t sequence) {
+      return store->write("b", 0, temporary_buffer(8000));
+    }).then([store] (uint64_t sequence) {
+      return store->commit(sequence);
+    }).then([store] {
+      return store->stop();
+    }).then([path, capacity] {
+      // records start after the header block, and "b" runs from the first
+      // block of them into the second
+      std::string garbage(LogStore::block_size, 'x');
+      auto fd = ::open(path.c_str(), O_WRONLY);
+      KJ_REQUIRE(fd >= 0);
+      auto written = ::pwrite(fd, garbage.data(), garbage.size(),
+                              2 * LogStore::block_size);
+      ::close(fd);
+      KJ_REQUIRE(written == ssize_t(garbage.size()), written);
+      auto replayed = make_lw_shared<LogStore>(path, capacity);
+      return replayed->open().then([replayed] {
+          KJ_REQUIRE(replayed->size() == 1, replayed->size());
+          return replayed->write("c", 0, make_buffer("next run"));
+        }).then([replayed] (uint64_t sequence) {
+          return replayed->commit(sequence);
+        }).then([replayed] {
+          return replayed->stop();
+        });
+    }).then([path, capacity] {
+      auto replayed = make_lw_shared<LogStore>(path, capacity);
+      return replayed->open().then([replayed] {
+          KJ_REQUIRE(replayed->size() == 2, replayed->size());
+          return replayed->read("c", 0, 8);
+        }).then([replayed] (temporary_buffer c) {
+          KJ_REQUIRE(std::string(c.get(), c.size()) == "next run");
+          return replayed->stop();
+        });
+    });
+}
+
+/// Check that a log only opens under the layout it was created with
+future<> test_log_layout(const string& path)
+{
+  const uint64_t capacity = 1 << 20;
+  const LogStore::Layout layout{1, 2, 42};
+  auto store = make_lw_shared<LogStore>(path, capacity, 0, layout);
+  return store->open().then([store] {
+      return store->write("a", 0, make_buffer("data"));
+    }).then([store] (uint64_t sequence) {
+      return store->commit(sequence);
+    }).then([store] {
+      return store->stop();
+    }).then([path, capacity] {
+      // another core count
+      auto other = make_lw_shared<LogStore>(path, capacity, 0,
+                                            LogStore::Layout{1, 4, 42});
+      return other->open().then_wrapped([other] (future<> f) {
+          try {
+            f.get();
+            KJ_FAIL_REQUIRE("opened a log of another layout");
+          } catch (std::system_error& e) {
+            KJ_REQUIRE(e.code().value() == EINVAL);
+          }
+        });
+    }).then([path, capacity, layout] {
+      auto reopened = make_lw_shared<LogStore>(path, capacity, 0, layout);
+      return reopened->open().then([reopened] {
+          KJ_REQUIRE(reopened->size() == 1, reopened->size());
+          return reopened->stop();
+        });
+    });
+}
+
+/// Check that commits of writes that arrive together share a flush
+future<> test_group_commit(const string& path)
+{
+  auto store = make_lw_shared<LogStore>(path, 4 << 20);
+  return store->open().then([store] {
+      std::vector<future<>> commits;
+      for (int i = 0; i < 32; i++) {
+        auto name = string("obj.") + seastar::to_sstring(i);
+        commits.push_back(store->write(name, 0, make_buffer("data")).then(
+          [store] (uint64_t sequence) {
+            return store->commit(sequence);
+          }));
+      }
+      return seastar::when_all(commits.begin(), commits.end());
+    }).then([store] (std::vector<future<>> commits) {
+      for (auto& f : commits)
+        f.get();
+      KJ_REQUIRE(store->get_flushes() == 1, store->get_flushes());
+      // a write can be read back before it's flushed
+      auto write = store->write("late", 0, make_buffer("first"));
+      return write.then([store] (uint64_t sequence) {
+          return store->read("late", 0, 5).then(
+            [store, sequence] (temporary_buffer data) {
+              KJ_REQUIRE(std::string(data.get(), data.size()) == "first");
+              return store->commit(sequence);
+            });
+        }).then([store] {
+          KJ_REQUIRE(store->get_flushes() == 2, store->get_flushes());
+          return store->stop();
+        });
+    });
+}
+
+int main(int argc, char** argv)
+{
+  seastar::app_template app;
+  return app.run(argc, argv, [] {
+      auto store = make_lw_shared<seastar::distributed<Store>>();
+      auto osd = make_lw_shared<OSD>(*store);
+      return store->start().then([osd] {
+          return test_read_write(*osd);
+        }).then([osd] {
+          return test_enoent(*osd);
+        }).then([osd] {
+          return test_bad_range(*osd);
+        }).then([osd] {
+          return test_extents_reply(*osd);
+        }).then([osd] {
+          return test_streaming(*osd);
+        }).then([osd] {
+          return test_streamed_objects(*osd);
+        }).then([osd] {
+          return test_batch(*osd);
+        }).then([osd] {
+          return test_batch_limit(*osd);
+        }).then([] {
+          return test_pg_sequencer();
+        }).then([] {
+          return test_placement();
+        }).then([] {
+          return test_mclock_weights();
+        }).then([] {
+          return test_mclock_limit();
+        }).then([osd] {
+          return test_write_stages(*osd);
+        }).then([osd] {
+          return test_separate_acks(*osd);
+        }).then([] {
+          return test_extent_cache();
+        }).then([] {
+          return test_object_index();
+        }).then([] {
+          return test_memory_store();
+        }).then([] {
+          return with_temp_log(test_log_store);
+        }).then([] {
+          return with_temp_log(test_trimmed_cache);
+        }).then([] {
+          return with_temp_log(test_torn_record);
+        }).then([] {
+          return with_temp_log(test_log_layout);
+        }).then([] {
+          return with_temp_log(test_group_commit);
+        }).then([] {
+          std::cout << "All tests succeeded" << std::endl;
+        }).handle_exception([] (auto eptr) {
+          std::cout << "Test failure" << std::endl;
+          return make_exception_future<>(eptr);
+        }).finally([store, osd] {
+          return store->stop().finally([store] {});
+        });
+    });
+}